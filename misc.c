@@ -109,14 +109,129 @@ writeDBName(const char *dbname, FILE *file, const char *path)
  */
 const char*
 getSavefileName(int filenum)
+{
+	return getSavefilePath(SAVE_LOCATION, filenum);
+}
+
+/* Name of the save-file in the given directory; see getSnapshotDirectory(). */
+const char*
+getSavefilePath(const char *dir, int filenum)
+{
+	static char ret[MAXPGPATH];
+
+	snprintf(ret, sizeof(ret), "%s/%d.save", dir, filenum);
+
+	return ret;
+}
+
+/*
+ * Name of the file a save-file is written to before it is renamed into place.
+ * It doesn't pass parseSavefileName(), so a BlockReader never picks it up.
+ *
+ * Uses a static array, for the same reasons as getSavefileName() does.
+ */
+const char*
+getTempSavefilePath(const char *dir, int filenum)
+{
+	static char ret[MAXPGPATH];
+
+	snprintf(ret, sizeof(ret), "%s/%d.tmp", dir, filenum);
+
+	return ret;
+}
+
+/*
+ * Name of the delta file of the save-file; see the save-file format below.
+ *
+ * Uses a static array, for the same reasons as getSavefileName() does.
+ */
+const char*
+getDeltaFilePath(const char *dir, int filenum)
+{
+	static char ret[MAXPGPATH];
+
+	snprintf(ret, sizeof(ret), "%s/%d.delta", dir, filenum);
+
+	return ret;
+}
+
+/* Like getTempSavefilePath(), for delta files. */
+const char*
+getTempDeltaFilePath(const char *dir, int filenum)
+{
+	static char ret[MAXPGPATH];
+
+	snprintf(ret, sizeof(ret), "%s/%d.delta.tmp", dir, filenum);
+
+	return ret;
+}
+
+/*
+ * The file holding the generation of the last full save of the directory.
+ * The '.' keeps it from clashing with the directory of a snapshot.
+ */
+const char*
+getGenerationFilePath(const char *dir)
+{
+	static char ret[MAXPGPATH];
+
+	snprintf(ret, sizeof(ret), "%s/generation.id", dir);
+
+	return ret;
+}
+
+/* Like getTempSavefilePath(), for the generation file. */
+const char*
+getTempGenerationFilePath(const char *dir)
 {
 	static char ret[MAXPGPATH];
 
-	snprintf(ret, sizeof(ret), "%s/%d.save", SAVE_LOCATION, filenum);
+	snprintf(ret, sizeof(ret), "%s/generation.id.tmp", dir);
 
 	return ret;
 }
 
+/*
+ * Directory holding the save-files of the named snapshot, or, for the empty
+ * name, the save-files saved at shutdown.
+ *
+ * Uses a static array, for the same reasons as getSavefileName() does.
+ */
+const char*
+getSnapshotDirectory(const char *snapshot)
+{
+	static char ret[MAXPGPATH];
+
+	if (snapshot[0] == '\0')
+		strlcpy(ret, SAVE_LOCATION, sizeof(ret));
+	else
+		snprintf(ret, sizeof(ret), "%s/%s", SAVE_LOCATION, snapshot);
+
+	return ret;
+}
+
+/*
+ * Is the name fit to be a snapshot's directory name? We allow only the
+ * characters that need no quoting in any filesystem we run on.
+ */
+bool
+isValidSnapshotName(const char *snapshot)
+{
+	const char *p;
+
+	if (snapshot[0] == '\0' || strlen(snapshot) >= NAMEDATALEN)
+		return false;
+
+	for (p = snapshot; *p != '\0'; ++p)
+	{
+		if (!((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z')
+			  || (*p >= '0' && *p <= '9') || *p == '_' || *p == '-'))
+			return false;
+	}
+
+	return true;
+}
+
 bool
 parseSavefileName(const char *fname, int *filenum)
 {
@@ -137,3 +252,16 @@ parseSavefileName(const char *fname, int *filenum)
 
 	return true;
 }
+
+/* Like parseSavefileName(), for delta files: <integer>.delta */
+bool
+parseDeltaFileName(const char *fname, int *filenum)
+{
+	/* Room for one spurious character past the suffix, to catch it. */
+	char suffix[8];
+
+	if (sscanf(fname, "%d%7s", filenum, suffix) != 2)
+		return false;
+
+	return strcmp(suffix, ".delta") == 0;
+}
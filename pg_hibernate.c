@@ -17,10 +17,17 @@ PG_MODULE_MAGIC;
  * BGWorkers right away, because the number of workers needed to restore all the
  * databases may be greater than max_worker_processes.
  *
- * The BufferSaver calls processOnePendingWorker() periodically, which in turn
- * waits for any currently running BlockReader to exit, and then registers a new
- * dynamic background worker to run a new BlockReader for the next item on the
- * "pending" list.
+ * The BufferSaver calls DispatchBlockReaders() whenever its latch is set, which
+ * registers up to pg_hibernator.max_readers dynamic background workers to run
+ * BlockReaders for the items on the "pending" list, as long as the workers
+ * are available (and, if parallelism is disabled, the previous save-file's
+ * BlockReaders have exited).
+ *
+ * The BlockReaders restoring the same save-file share a RestoreSlot in shared
+ * memory, which they use to divide the save-file's blocks among themselves,
+ * and to report progress. The last BlockReader to detach from the slot removes
+ * the save-file, and sets the BufferSaver's latch so that it can dispatch the
+ * next save-file right away.
  *
  * On shutdown request, the BufferSaver scans the shared buffers and saves the
  * list of blocks currently in memory to the $PGDATA/pg_hibernator/ directory;
@@ -28,49 +35,584 @@ PG_MODULE_MAGIC;
  *
  * When launched, the BlockReader reads the save-file assigned to it, connects
  * to the database represented by that save-file, and restores the blocks
- * identified by the list of blocks in save-file.
+ * identified by the list of blocks in save-file that it claims from the slot.
+ *
+ * Database number (and hence save-file name) 0 is reserved; in _PG_init() it
+ * is used to identify and register the BufferSaver. The save-file of global
+ * objects is 1, if the save found any; the header of a save-file names its
+ * database, so the BlockReader goes by that.
+ */
+
+/*
+ * Blocks that a BlockReader has issued a prefetch request for, but has not yet
+ * read into shared buffers. All the blocks in the queue belong to the same
+ * relation fork; the queue is drained before moving on to the next fork.
+ */
+typedef struct PrefetchQueue
+{
+	BlockNumber	   *blocks;		/* circular array of 'size' elements */
+	int				size;		/* == pg_hibernator.prefetch_distance */
+	int				head;		/* index of the oldest element */
+	int				count;		/* number of elements in the queue */
+} PrefetchQueue;
+
+/*
+ * The segment file of a relation fork, kept open by a BlockReader so that it
+ * can issue readahead requests for whole block ranges. fd is -1 when no file
+ * is open.
+ */
+typedef struct SegmentFile
+{
+	RelFileNode		rnode;
+	ForkNumber		forknum;
+	BlockNumber		segno;
+	int				fd;
+} SegmentFile;
+
+/*
+ * Number of blocks in a work unit; see WorkUnitClaim. This is large enough
+ * that the readers don't contend for the shared counter, and small enough
+ * that a long range of blocks is spread across all the readers.
+ */
+#define BLOCKS_PER_WORK_UNIT	1024
+
+/*
+ * A save-file restore waiting to be dispatched by the BufferSaver.
+ *
+ * Each save-file is restored in the order of its blocks' usage counts, hottest
+ * first, by one job per usage count found in the file; the jobs of all the
+ * save-files are dispatched in that order, so that the hottest blocks of all
+ * databases are in shared buffers before the colder blocks of any database. A
+ * job for SAVEFILE_ALL_LEVELS restores all the blocks of the save-file; that's
+ * used for save-files that don't record usage counts.
+ *
+ * With pg_hibernator.structure_first, each save-file also gets a job for
+ * SAVEFILE_STRUCTURE_LEVEL, dispatched before all the others. It restores the
+ * blocks that the queries need before they can use any other block: those of
+ * the system catalogs, and of the visibility map and free space map forks, and
+ * the root and internal pages of the B-tree indexes. The other jobs of the
+ * save-file leave those blocks, except the index pages, to it.
+ */
+typedef struct RestoreJob
+{
+	char		snapshot[NAMEDATALEN];	/* "" for the save-files saved at shutdown */
+	int			filenum;
+	int			level;		/* usage count to restore, or SAVEFILE_*_LEVEL(S) */
+	Oid			database;	/* InvalidOid for global objects, or if unknown */
+	Oid			tablespace;	/* of the save-file's blocks, InvalidOid if unknown */
+	bool		structure_first;	/* does the save-file have a structure job? */
+	uint32		restore_id;	/* the restore it's part of; see RestoreBudget() */
+} RestoreJob;
+
+/*
+ * The blocks restored by the finished jobs of a restore; see RestoreBudget().
+ * Kept by the BufferSaver for as long as the restore has a pending job, or a
+ * slot.
+ */
+typedef struct RestoreBudgetUse
+{
+	uint32		restore_id;
+	uint32		blocks_restored;
+} RestoreBudgetUse;
+
+#define SAVEFILE_ALL_LEVELS			(-1)
+#define SAVEFILE_STRUCTURE_LEVEL	(-2)
+
+/*
+ * An entry of the BlockReader's filenode -> relation map. Relations in
+ * different tablespaces can have the same filenode, so the key is both.
+ */
+typedef struct FilenodeMapKey
+{
+	Oid			tablespace;	/* InvalidOid if the save-file doesn't say */
+	Oid			filenode;
+} FilenodeMapKey;
+
+typedef struct FilenodeMapEntry
+{
+	FilenodeMapKey key;		/* hash key */
+	Oid			relid;
+} FilenodeMapEntry;
+
+/*
+ * The BlockReaders share a token bucket limiting the rate at which they read
+ * blocks from disk to pg_hibernator.max_restore_mb_per_sec; see ThrottleRead().
+ * The bucket holds THROTTLE_BURST_US worth of reads, so that the readers sleep
+ * every now and then rather than before every block.
+ *
+ * Each reader also keeps a moving average of how long its reads take, and if
+ * that exceeds pg_hibernator.throttle_read_latency, taken to mean that the
+ * disks are busy serving the foreground, it slows down, by charging the bucket
+ * up to THROTTLE_MAX_SLOWDOWN times the cost of each read. It reconsiders that
+ * every THROTTLE_ADJUST_READS reads.
+ */
+#define THROTTLE_BURST_US		(100 * 1000L)
+#define THROTTLE_MAX_SLOWDOWN	16
+#define THROTTLE_ADJUST_READS	64
+
+typedef struct ReadThrottle
+{
+	double		latency_us;		/* moving average of the read latency */
+	int			slowdown;		/* multiplier of the cost of each read */
+	int			nreads;			/* reads since the slowdown was adjusted */
+} ReadThrottle;
+
+/*
+ * State of the restore of a save-file, shared by the BlockReaders restoring
+ * it. A slot is in use iff filenum is non-zero.
+ */
+typedef struct RestoreSlot
+{
+	int					filenum;	/* save-file being restored */
+	char				snapshot[NAMEDATALEN];	/* of the save-file; see RestoreJob */
+	int					level;		/* usage count being restored; see RestoreJob */
+	Oid					tablespace;	/* see RestoreJob */
+	bool				structure_first;	/* see RestoreJob */
+	bool				remove_file;	/* is this the save-file's last job? */
+	int					nreaders;	/* BlockReaders not yet detached */
+	int					npending;	/* ... of which not yet attached */
+	uint32				generation;	/* bumped when (re)assigned; see BlockReaderMain() */
+	bool				failed;		/* did any BlockReader fail? */
+	pg_atomic_uint32	next_unit;	/* next work unit up for grabs */
+	pg_atomic_uint32	blocks_restored;	/* progress, across all readers */
+	uint32				restore_id;	/* of the job, 0 once reaped; see RestoreBudget() */
+	pg_atomic_uint32	restore_base;	/* blocks of the restore's finished jobs */
+} RestoreSlot;
+
+/*
+ * Progress of a BlockReader, for pg_hibernator_progress. Only the owner of the
+ * entry writes the counters, and without a lock, so the readers of the counters
+ * may see slightly stale values. The entries are claimed and given up with the
+ * SharedState lock held.
+ */
+typedef enum ReaderState
+{
+	READER_FREE = 0,	/* never used */
+	READER_RUNNING,
+	READER_DONE,
+	READER_FAILED
+} ReaderState;
+
+typedef struct ReaderStats
+{
+	ReaderState	state;
+	pid_t		pid;
+	int			filenum;
+	char		snapshot[NAMEDATALEN];	/* see RestoreJob */
+	int			level;				/* see RestoreJob */
+	char		database[NAMEDATALEN];
+	Oid			tablespace;			/* InvalidOid if unknown */
+	TimestampTz	start_time;
+	TimestampTz	end_time;			/* 0 while running */
+	Oid			current_relid;		/* relation being restored, if any */
+	uint32		blocks_planned;		/* blocks in the job; 0 if unknown */
+	uint32		blocks_read;
+	uint32		blocks_skipped;		/* of dropped or truncated relations */
+} ReaderStats;
+
+/*
+ * A BlockReader that has finished its job, waiting for the BufferSaver to hand
+ * it another one; see AwaitNextJob(). A process can't switch databases, so it
+ * can take on only the jobs of the database it's connected to, or the job of
+ * the global objects, which are visible from every database. That saves the
+ * launch of a worker, the connection, and the scan of pg_class for every job;
+ * with hundreds of small databases, that's most of the restore time.
+ *
+ * The entries are protected by the SharedState lock.
+ */
+#define IDLE_READER_WAITING		(-1)	/* for a job */
+#define IDLE_READER_RETIRE		(-2)	/* there's no job for it; exit */
+
+/* How long an idle BlockReader waits for a job before exiting. */
+#define READER_IDLE_TIMEOUT_MS	5000
+
+typedef struct IdleReader
+{
+	pid_t		pid;		/* 0 if the entry is free */
+	Oid			database;	/* the reader is connected to */
+	Latch	   *latch;
+	int			slotno;		/* slot to attach to, or IDLE_READER_* */
+} IdleReader;
+
+/*
+ * Number of blocks of each fork saved for a database by the last save, for
+ * pg_hibernator_save_composition(). The databases past the first
+ * SAVE_STATS_MAX_DATABASES are lumped together in one more entry.
+ */
+#define SAVE_STATS_MAX_DATABASES	64
+
+/* A relation segment file whose residency SavePageCache() records */
+typedef struct CacheSegment
+{
+	Oid			filenode;
+	ForkNumber	forknum;
+	BlockNumber	segno;
+	char	   *path;
+} CacheSegment;
+
+typedef struct DatabaseComposition
+{
+	Oid			database;		/* InvalidOid for global objects */
+	uint32		blocks[MAX_FORKNUM + 1];
+} DatabaseComposition;
+
+/* Timings of the phases of the last save, for pg_hibernator_last_save() */
+typedef struct SaveStats
+{
+	TimestampTz	end_time;		/* 0 if there was no save yet */
+	int			num_buffers;
+	int			num_databases;
+	double		scan_ms;		/* scan of the buffer headers */
+	double		sort_ms;
+	double		write_ms;		/* writing the save-files */
+	double		fsync_ms;		/* fsync'ing and renaming the save-files */
+	double		total_ms;
+	int			ncomposition;	/* entries used in composition */
+	bool		overflow;		/* is the last entry the lumped one? */
+	DatabaseComposition composition[SAVE_STATS_MAX_DATABASES + 1];
+} SaveStats;
+
+/* Requests that backends make to the BufferSaver; see SubmitRequest() */
+typedef enum HibernatorRequest
+{
+	REQUEST_NONE = 0,
+	REQUEST_SAVE,			/* save the buffers as a snapshot */
+	REQUEST_RESTORE			/* restore the buffers from a snapshot */
+} HibernatorRequest;
+
+typedef struct SharedState
+{
+	LWLock	   *lock;		/* protects the slots, except the atomics */
+	Latch	   *saver_latch;	/* BufferSaver's latch, NULL if not running */
+	uint32		last_restore_id;	/* protected by the lock; see RestoreBudget() */
+	pg_atomic_uint64 throttle_tat;	/* the reads are paid for until then; see ThrottleRead() */
+	pg_atomic_uint32 next_numa_node;	/* for the next BlockReader; see PinToNumaNode() */
+	SaveStats	last_save;	/* written by BufferSaver at the end of each save */
+
+	/* The on-demand request, protected by the lock; see SubmitRequest() */
+	HibernatorRequest request;	/* REQUEST_NONE if there's none outstanding */
+	char		request_snapshot[NAMEDATALEN];
+	Latch	   *request_latch;	/* of the backend waiting for the request */
+	uint32		request_seq;	/* of the last request submitted */
+	uint32		completed_seq;	/* of the last request completed */
+	int64		request_result;	/* of the last request completed, -1 on failure */
+
+	ReaderStats *readers;	/* nslots entries; a BlockReader needs a slot anyway */
+	IdleReader *idle_readers;	/* nslots entries, likewise */
+	int			nslots;
+	RestoreSlot	slots[FLEXIBLE_ARRAY_MEMBER];
+} SharedState;
+
+/*
+ * A BlockReader's claim on the work units of its save-file.
+ *
+ * The BlockReaders restoring the same save-file all parse the whole file, and
+ * divide it into the same sequence of work units: a new unit begins with the
+ * first block of every fork, and whenever a block falls in a different
+ * BLOCKS_PER_WORK_UNIT-aligned chunk of the fork than the previous block did.
+ * Each reader claims the next unclaimed unit from the shared counter, skips the
+ * units before it, and claims another one as soon as it moves past its unit;
+ * so a reader that is quick to finish its units picks up more of them.
+ *
+ * Every block and range in the file must be passed to ClaimBlock(), whether or
+ * not the reader restores it, to keep the unit numbers in sync across readers.
+ */
+typedef struct WorkUnitClaim
+{
+	pg_atomic_uint32   *next_unit;	/* the slot's shared counter */
+	uint32				nunits;		/* number of units parsed so far */
+	uint32				claimed;	/* the unit we have claimed */
+	BlockNumber			chunk;		/* chunk of the last block parsed */
+	bool				owned;		/* is the current unit ours? */
+} WorkUnitClaim;
+
+/*
+ * The relation fork whose blocks a BlockReader is parsing. The relation is
+ * looked up and opened, and the fork is checked, only when the reader comes
+ * across a block of the fork that it has claimed.
+ */
+typedef struct ReaderFork
+{
+	Oid			tablespace;		/* of the save-file, InvalidOid if unknown */
+	Oid			filenode;		/* from the last 'r' record */
+	ForkNumber	forknum;		/* from the last 'f' record */
+	bool		rel_checked;	/* have we looked up the relation? */
+	bool		fork_checked;	/* have we checked the fork? */
+	Relation	rel;			/* NULL if the relation was dropped/rewritten */
+	bool		fork_exists;
+	BlockNumber	nblocks;		/* number of blocks in the fork */
+	uint32		block_records;	/* 'b' and 'N' records of the fork parsed so far */
+} ReaderFork;
+
+/* What the structure job restores of a fork; see RestoreJob. */
+typedef enum StructureClass
+{
+	STRUCTURE_NONE,		/* nothing; the other jobs restore the fork */
+	STRUCTURE_ALL,		/* all the blocks of the fork */
+	STRUCTURE_BTREE		/* the root and internal pages of the index */
+} StructureClass;
+
+/*
+ * The save in chunks, used when the list of all the shared buffers wouldn't
+ * fit in pg_hibernator.save_memory_limit; see SaveBuffersChunked().
  *
- * Database numbers (and hence save-files with names) 0 and 1 are reserved;
- * In _PG_init() 0 is used to identify and register the BufferSaver, and 1 is
- * reserved in BufferSaver for save-file that contains global objects.
+ * A saved buffer whose database and tablespace are those of the save-file it
+ * goes to, so they needn't be stored; 12 bytes instead of a SavedBuffer's 24.
  */
+typedef struct PackedBuffer
+{
+	Oid			filenode;
+	BlockNumber	blocknum;
+	uint8		forknum;
+	uint8		usage;
+} PackedBuffer;
+
+/* The buffers of one save-file, i.e. of a (database, tablespace). */
+typedef struct SaveGroup
+{
+	Oid			database;
+	Oid			tablespace;
+	int			count;		/* buffers found by the counting scan */
+	int			offset;		/* of the group's buffers in the chunk */
+	int			filled;		/* buffers put there so far */
+} SaveGroup;
+
+/* A sorted run of the buffers of a group, spilled to a temporary file */
+typedef struct MergeRun
+{
+	BufFile	   *file;
+	PackedBuffer current;	/* the run's next buffer, in sort order */
+} MergeRun;
+
+/* Turns a sorted stream of buffers into save-file records; see StreamBlock(). */
+typedef struct BlockStream
+{
+	SavefileWriter *writer;
+	DatabaseComposition *comp;
+	Oid			filenode;		/* of the last 'r' record */
+	ForkNumber	forknum;		/* of the last 'f' record */
+	BlockNumber	start;			/* the range of blocks not yet written */
+	BlockNumber	range;
+	uint8		usage;
+	bool		pending;		/* is there such a range? */
+	int			nblocks;		/* blocks written */
+} BlockStream;
+
+typedef struct ChunkedSave
+{
+	const char *dir;
+	SaveStats  *stats;
+	PackedBuffer *chunk;
+	int			chunk_size;		/* in buffers */
+	SaveGroup  *groups;
+	int			ngroups;
+	int			ndatabases;
+	int			npasses;		/* scans of shared buffers */
+	int			nruns;			/* sorted runs spilled */
+	int			nmissed;		/* buffers that turned up after the counting scan */
+	double		scan_ms;
+	double		sort_ms;
+	double		fsync_ms;
+	DatabaseComposition *comp;
+	uint64		generation;		/* of the save; see WriteSaveGeneration() */
+} ChunkedSave;
+
+/*
+ * The working set sampled by the BufferSaver, with pg_hibernator.sample_interval;
+ * see SampleBuffers(). Each entry covers HOT_RANGE_BLOCKS blocks of a fork, one
+ * bit of the masks per block.
+ */
+#define HOT_RANGE_BLOCKS	64
 
-typedef struct SavedBuffer
+typedef struct HotRangeKey
 {
 	Oid			database;
-	Oid			filenode;	/* On-disk marker: 'r', for Relfilenode */
-	ForkNumber	forknum;	/* On-disk marker: 'f' */
-	BlockNumber	blocknum;	/* On-disk marker: 'b' */
-							/* On-disk marker: 'N', for range of N blocks */
-} SavedBuffer;
+	Oid			tablespace;
+	Oid			filenode;
+	ForkNumber	forknum;
+	BlockNumber	range;			/* first block / HOT_RANGE_BLOCKS */
+} HotRangeKey;
+
+typedef struct HotRange
+{
+	HotRangeKey	key;
+	uint64		seen;			/* blocks sampled in the current generation */
+	uint64		seen_before;	/* ... and in the one before it */
+	uint32		generation;		/* of the masks */
+	uint32		sample;			/* sum of usage counts + 1, in this sample */
+	double		hotness;		/* decayed sum of the samples */
+	double		heat;			/* hotness per block in the masks */
+	int			nblocks;		/* blocks in the masks */
+} HotRange;
 
 /* Primary functions */
 void			_PG_init(void);
+Datum			pg_hibernator_get_progress(PG_FUNCTION_ARGS);
+Datum			pg_hibernator_last_save(PG_FUNCTION_ARGS);
+Datum			pg_hibernator_save_composition(PG_FUNCTION_ARGS);
+Datum			pg_hibernator_save(PG_FUNCTION_ARGS);
+Datum			pg_hibernator_restore(PG_FUNCTION_ARGS);
+static void		CheckSnapshotName(const char *snapshot);
+static bool		check_snapshot_guc(char **newval, void **extra, GucSource source);
+static long		FollowSnapshot(void);
+static bool		SnapshotGeneration(const char *snapshot, uint64 *generation);
 static void		DefineGUCs(void);
 static void		CreateDirectory(void);
 
-static void		RegisterBlockReaders(void);
-static bool		RegisterWorker(int id, BackgroundWorkerHandle **handle);
+static void		SharedStateSetup(void);
+static Size		SharedStateSize(void);
+static void		shmem_startup(void);
+
+static int		RegisterBlockReaders(const char *snapshot);
+static bool		RegisterWorker(int id, int slotno, BackgroundWorkerHandle **handle);
 
 static void		BlockReaderMain(Datum main_arg);
-static void		ReadBlocks(int filenum);
+static void		ReadBlocks(int filenum, RestoreSlot *slot);
 
 static void		BufferSaverMain(Datum main_arg);
-static void		SaveBuffers(void);
+static int		SaveBuffers(const char *snapshot, const char *publish);
+static int		WriteSavefiles(const char *dir, SavedBuffer *saved_buffers, int num_buffers,
+							   uint64 generation, SaveStats *stats, int *ndatabases,
+							   double *fsync_ms);
+static void		PublishSnapshot(const char *snapshot, SavedBuffer *buffers, int num_buffers);
+static void		BeginBufferScan(void);
+static void		EndBufferScan(void);
+static bool		ScanBuffer(int buf_id, SavedBuffer *buf);
+static bool		ReadBufferTagLockless(BufferDesc *bufHdr, BufferTag *tag, uint32 *state);
+static int		SaveBuffersChunked(ChunkedSave *cs);
+static void		CountSaveGroups(ChunkedSave *cs);
+static int		FindSaveGroup(SaveGroup *groups, int ngroups, Oid database, Oid tablespace);
+static void		SaveGroupBatch(ChunkedSave *cs, int first, int end);
+static void		SaveLargeGroup(ChunkedSave *cs, int g);
+static MergeRun	SpillRun(ChunkedSave *cs, int nbuffers);
+static bool		ReadMergeRun(MergeRun *run);
+static int		MergeRunCmp(Datum a, Datum b, void *arg);
+static int		PackedBufferCmp(const void *a, const void *b);
+static void		OpenGroupSavefile(ChunkedSave *cs, int g, BlockStream *stream);
+static void		CloseGroupSavefile(ChunkedSave *cs, int g, BlockStream *stream);
+static void		StreamBlock(BlockStream *stream, const PackedBuffer *buf);
+static void		StreamFlush(BlockStream *stream);
+static void		SampleBuffers(void);
+static void		AgeHotRange(HotRange *range);
+static int		CollectWorkingSet(SavedBuffer *buffers, int max_buffers);
+static int		HotRangeCmp(const void *a, const void *b);
+static void		PublishSavefile(const char *dir, int filenum);
+static BlockNumber	SavePageCache(SavefileWriter *writer, Oid database, Oid tablespace);
+static void		CollectSegments(const char *dir, CacheSegment **segments, int *nsegments, int *maxsegments);
+static bool		ParseSegmentName(const char *name, Oid *filenode, ForkNumber *forknum, BlockNumber *segno);
+static int		CacheSegmentCmp(const void *a, const void *b);
+static BlockNumber	WriteSegmentResidency(SavefileWriter *writer, CacheSegment *seg);
+static void		RemoveStaleSavefiles(const char *dir, int max_filenum);
+static bool		ReadSaveGeneration(const char *dir, uint64 *generation);
+static void		WriteSaveGeneration(const char *dir, uint64 generation);
+static bool		SaveDelta(const char *dir, SavedBuffer *buffers, int num_buffers,
+						  SaveStats *stats, int *ndatabases, double *fsync_ms);
+static int		GroupEnd(SavedBuffer *buffers, int num_buffers, int start);
+static void		KeepDeltaBase(SavedBuffer *buffers, int num_buffers);
+static int		DiffGroup(const SaveGroup *group, SavedBuffer *cur, int ncur,
+						  SavedBuffer *added, int *nadded, SavedBuffer *removed, int *nremoved);
+static int		BlockKeyCmp(const SavedBuffer *a, const SavedBuffer *b);
+static void		RemoveDeltaFiles(const char *dir);
+static void		DiscardDeltaBase(void);
+static void		FoldDeltaFiles(const char *dir);
+static bool		FoldDeltaFile(const char *dir, int filenum, uint64 generation);
+static bool		LoadSavefile(const char *path, SavedBuffer **blocks, int *nblocks,
+							 SavedBuffer **removed, int *nremoved, Oid *database, Oid *tablespace,
+							 uint64 *generation);
+static bool		RestoreInProgress(void);
 
 /* Secondary/supporting functions */
 static void		sigtermHandler(SIGNAL_ARGS);
 static void		sighupHandler(SIGNAL_ARGS);
 
-static void		addPendingWorker(int filenum);
-static void		processOnePendingWorker(void);
+static void		addPendingJob(const char *snapshot, int filenum, int level, Oid database,
+							  Oid tablespace, bool structure_first, uint32 restore_id);
+static int		TablespaceReaders(Oid tablespace);
+static void		SortPendingJobs(void);
+static int		RestoreJobCmp(const void *a, const void *b);
+static void		DropPendingJobs(const char *snapshot, int filenum);
+static void		DispatchBlockReaders(void);
+static void		ReapBlockReaders(void);
+static int		AcquireRestoreSlot(RestoreJob *job, bool last_job, int nreaders);
+static bool		ReaderCanRestore(Oid database, RestoreJob *job);
+static int		CountIdleReaders(RestoreJob *job);
+static int		AdoptIdleReaders(RestoreJob *job, int slotno, int max_readers);
+static BackgroundWorkerHandle *TakeReaderHandle(pid_t pid);
+static void		RetireIdleReaders(void);
+static int		AwaitNextJob(void);
+static void		ReleaseRestoreSlot(RestoreSlot *slot, int nreaders, bool attached, bool success);
+static void		ReleaseUnstartedReaders(void);
+static void		BlockReaderExit(int code, Datum arg);
+static ReaderStats *AcquireReaderStats(int filenum, const char *snapshot, int level);
+static void		ReleaseReaderStats(bool success);
+static void		BufferSaverExit(int code, Datum arg);
+static bool		IsBeingRestored(const char *snapshot, int filenum);
+static bool		IsPending(const char *snapshot, int filenum);
+static void		ServeRequest(void);
+static int64	SaveSnapshot(const char *snapshot);
+static void		CompleteRequest(int64 result);
+static int64	SubmitRequest(HibernatorRequest request, const char *snapshot);
 
 static void		WorkerCommon(void);
-static int		SavedBufferCmp(const void *a, const void *b);
-static Oid		GetRelOid(Oid filenode);
+static void		PinToNumaNode(void);
+#ifdef __linux__
+static bool		ReadSysfsList(const char *path, int **ids, int *nids);
+#endif
+static Oid		GetRelOid(Oid tablespace, Oid filenode);
+static void		BuildFilenodeMap(bool any_tablespace);
+static bool		ReadOneBlock(Relation rel, ForkNumber forknum, BlockNumber blocknum);
+static bool		IsBlockResident(Relation rel, ForkNumber forknum, BlockNumber blocknum);
+static void		PrefetchMissingBlocks(SegmentFile *seg, Relation rel, ForkNumber forknum,
+									  BlockNumber start, BlockNumber count);
+static Buffer	ReadThrottledBuffer(Relation rel, ForkNumber forknum, BlockNumber blocknum);
+static void		ThrottleRead(void);
+static void		ChargeRead(TimestampTz start, TimestampTz end);
+static BlockNumber	QueueBlock(PrefetchQueue *queue, Relation rel, ForkNumber forknum, BlockNumber blocknum, bool prefetch);
+static BlockNumber	DrainPrefetchQueue(PrefetchQueue *queue, Relation rel, ForkNumber forknum);
+static void		PrefetchRange(SegmentFile *seg, Relation rel, ForkNumber forknum, BlockNumber start, BlockNumber count);
+static void		CloseSegmentFile(SegmentFile *seg);
+static BlockNumber	RestoreRange(PrefetchQueue *queue, SegmentFile *seg, Relation rel,
+								ForkNumber forknum, BlockNumber first, BlockNumber last);
+static bool		ClaimBlock(WorkUnitClaim *claim, BlockNumber blocknum);
+static bool		PrepareFork(ReaderFork *fork);
+static StructureClass ClassifyFork(ReaderFork *fork);
+static bool		WantFork(ReaderFork *fork, int level, bool structure_first,
+						 BlockNumber *blocks_restored);
+static BlockNumber RestoreIndexUpperLevels(Relation rel);
+static double	ElapsedMs(TimestampTz start, TimestampTz end);
+static DatabaseComposition *AddDatabaseComposition(SaveStats *stats, Oid database);
+static uint32	RestoreBudget(void);
+static Tuplestorestate *BeginMaterializedResult(FunctionCallInfo fcinfo, TupleDesc *tupdesc);
+static bool		RestoreBudgetExhausted(void);
+static uint32	RestoreBlocksSpent(uint32 restore_id, uint32 finished);
+static RestoreBudgetUse *GetRestoreBudgetUse(uint32 restore_id);
+static void		RetireSlotBudget(int slotno);
+static void		ForgetFinishedRestores(void);
+static int		DiscardPendingJobs(uint32 restore_id);
 
 /* Global variables */
-static List *pendingWorkers = NIL;	/* Used by BufferSaver */
+static List *pendingJobs = NIL;		/* Used by BufferSaver; RestoreJobs */
+static List **slot_handles = NULL;	/* Used by BufferSaver; readers of each slot */
+static RestoreJob *slot_jobs = NULL;	/* Used by BufferSaver; job of each slot */
+static List *restores = NIL;		/* Used by BufferSaver; RestoreBudgetUses */
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+static SharedState *shared_mem = NULL;
+static bool		slot_detached = false;	/* Used by BlockReader */
+static RestoreSlot *my_slot = NULL;		/* Used by BlockReader */
+static bool		reader_connected = false;	/* Used by BlockReader */
+static ReaderStats *my_stats = NULL;	/* Used by BlockReader */
+static ReadThrottle my_throttle = {0, 1, 0};	/* Used by BlockReader */
+static HTAB	   *filenode_map = NULL;	/* Used by BlockReader; see GetRelOid() */
+static PackedBuffer *base_buffers = NULL;	/* Used by BufferSaver; see SaveDelta() */
+static int		base_num_buffers = 0;		/* Used by BufferSaver */
+static SaveGroup *base_groups = NULL;		/* Used by BufferSaver; save-files of base_buffers */
+static int		base_ngroups = 0;			/* Used by BufferSaver */
+static int		num_delta_saves = 0;		/* Used by BufferSaver; since the last full save */
+static HTAB	   *hot_ranges = NULL;			/* Used by BufferSaver; see SampleBuffers() */
+static TimestampTz last_sample_time = 0;	/* Used by BufferSaver */
+static TimestampTz generation_start = 0;	/* Used by BufferSaver; of hot_generation */
+static uint32	hot_generation = 0;			/* Used by BufferSaver */
+static BlockNumber blocks_resident = 0;	/* Used by BlockReader; see ReadOneBlock() */
 
 /* flags set by signal handlers */
 static volatile sig_atomic_t got_sighup = false;
@@ -80,6 +622,26 @@ static volatile sig_atomic_t got_sigterm = false;
 static bool		guc_enabled = true;					/* Is the extension enabled? */
 static bool		guc_parallel_enabled = false;		/* Can we restore databases in parallel? */
 static char*	guc_default_database = "postgres";	/* Default DB to connect to. */
+static int		guc_prefetch_distance = 0;			/* Blocks to prefetch ahead of the reads. */
+static int		guc_range_read_size = 32;			/* Blocks per readahead request for ranges. */
+static int		guc_max_readers = 1;				/* BlockReaders per save-file. */
+static int		guc_max_tablespace_readers = 0;		/* BlockReaders per tablespace. */
+static int		guc_save_interval = 0;				/* Seconds between periodic saves. */
+static int		guc_max_delta_saves = 0;			/* Periodic saves between full saves. */
+static int		guc_save_memory_limit = 0;			/* kB the list of buffers may take, when saving. */
+static bool		guc_lockless_scan = true;			/* Scan buffers without locking them? */
+static double	guc_max_restore_fraction = 1.0;		/* Fraction of shared_buffers to restore. */
+static int		guc_max_restore_rate = 0;			/* MB per second the BlockReaders may read. */
+static double	guc_throttle_read_latency = 0;		/* Read latency, in ms, to slow down at. */
+static bool		guc_save_page_cache = false;		/* Save the OS page cache as well? */
+static char*	guc_publish_snapshot = "";			/* Snapshot to save along with each save. */
+static char*	guc_follow_snapshot = "";			/* Snapshot to restore whenever it changes. */
+static int		guc_follow_interval = 60;			/* Seconds between checks of that snapshot. */
+static bool		guc_structure_first = false;		/* Restore catalogs, maps, index pages first? */
+static bool		guc_numa_placement = false;			/* Spread the BlockReaders across NUMA nodes? */
+static int		guc_sample_interval = 0;			/* Seconds between samples of the working set. */
+static int		guc_sample_half_life = 3600;		/* Seconds for a sample's weight to halve. */
+static bool		guc_save_working_set = false;		/* Save the sampled working set instead? */
 
 /*
  * Signal handler for SIGTERM
@@ -129,8 +691,15 @@ sigusr1Handler(SIGNAL_ARGS)
 void
 _PG_init(void)
 {
+	/* Define the parameters even when LOADed, so that they aren't placeholders. */
 	DefineGUCs();
+
+	/* The shared memory and the BufferSaver can only be set up by postmaster. */
+	if (!process_shared_preload_libraries_in_progress)
+		return;
+
 	CreateDirectory();
+	SharedStateSetup();
 	/*
 	 * Create the BufferSaver irrespective of whether the extension is enabled.
 	 * The BufferSaver will check the parameter when it receives SIGTERM, and act
@@ -140,7 +709,7 @@ _PG_init(void)
 	 * shuts down.
 	 */
 	 /* Register the BufferSaver worker */
-	RegisterWorker(0, NULL);
+	RegisterWorker(0, -1, NULL);
 
 	/*
 	 * In Postgres version 9.4 and above, we use the dynamic background worker
@@ -177,7 +746,7 @@ DefineGUCs(void)
 
 	DefineCustomStringVariable("pg_hibernator.default_database",
 							"Database to connect to, by default.",
-							"Postgres Hibernator will connect to this database when saving buffers, and when reading blocks of global objects.",
+							"Postgres Hibernator will connect to this database when reading blocks of global objects.",
 							&guc_default_database,
 							guc_default_database,
 							PGC_POSTMASTER,
@@ -185,6 +754,356 @@ DefineGUCs(void)
 							NULL,
 							NULL,
 							NULL);
+
+	DefineCustomIntVariable("pg_hibernator.prefetch_distance",
+							"Number of blocks a Block Reader prefetches ahead of the block it is reading.",
+							"Zero disables prefetching, and the blocks are read synchronously, one at a time.",
+							&guc_prefetch_distance,
+							guc_prefetch_distance,
+							0,
+							1024,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_hibernator.range_read_size",
+							"Size of the readahead requests a Block Reader issues for ranges of blocks.",
+							"Zero disables range readahead, and the blocks of a range are prefetched one at a time.",
+							&guc_range_read_size,
+							guc_range_read_size,
+							0,
+							RELSEG_SIZE,
+							PGC_SIGHUP,
+							GUC_UNIT_BLOCKS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_hibernator.save_interval",
+							"Interval between periodic saves of the list of shared buffers.",
+							"Zero disables periodic saves; the list is then saved only at shutdown.",
+							&guc_save_interval,
+							guc_save_interval,
+							0,
+							INT_MAX / 1000,
+							PGC_SIGHUP,
+							GUC_UNIT_S,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_hibernator.max_delta_saves",
+							"Maximum number of periodic saves that write only the changes since the last full save.",
+							"Zero makes every save a full save.",
+							&guc_max_delta_saves,
+							guc_max_delta_saves,
+							0,
+							INT_MAX,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_hibernator.save_memory_limit",
+							"Maximum memory to hold the list of shared buffers in, when saving.",
+							"Zero means no limit. Above the limit, the list is saved in chunks, "
+							"which takes more scans of shared buffers, and temporary files.",
+							&guc_save_memory_limit,
+							guc_save_memory_limit,
+							0,
+							MAX_KILOBYTES,
+							PGC_SIGHUP,
+							GUC_UNIT_KB,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("pg_hibernator.lockless_scan",
+							"Scan shared buffers without locking them, when saving.",
+							"When disabled, all buffer mapping partitions are locked for the duration of the scan.",
+							&guc_lockless_scan,
+							guc_lockless_scan,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_hibernator.max_readers",
+							"Maximum number of Block Readers restoring a database in parallel.",
+							NULL,
+							&guc_max_readers,
+							guc_max_readers,
+							1,
+							MAX_BACKENDS,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_hibernator.max_readers_per_tablespace",
+							"Maximum number of Block Readers restoring blocks of a tablespace in parallel.",
+							"Zero means no limit other than pg_hibernator.max_readers per save-file.",
+							&guc_max_tablespace_readers,
+							guc_max_tablespace_readers,
+							0,
+							MAX_BACKENDS,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomRealVariable("pg_hibernator.max_restore_fraction",
+							"Fraction of shared_buffers to fill with restored blocks.",
+							NULL,
+							&guc_max_restore_fraction,
+							guc_max_restore_fraction,
+							0.0,
+							1.0,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_hibernator.max_restore_mb_per_sec",
+							"Maximum rate, in megabytes per second, at which the Block Readers read blocks from disk.",
+							"The limit is shared by all the Block Readers. Zero disables the limit.",
+							&guc_max_restore_rate,
+							guc_max_restore_rate,
+							0,
+							INT_MAX / 1024,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomRealVariable("pg_hibernator.throttle_read_latency",
+							"Read latency, in milliseconds, above which the Block Readers slow down.",
+							"Only applies when pg_hibernator.max_restore_mb_per_sec is set. Zero disables slowing down.",
+							&guc_throttle_read_latency,
+							guc_throttle_read_latency,
+							0.0,
+							1000.0,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("pg_hibernator.save_page_cache",
+							"Save, and restore, the blocks of relations in the OS page cache as well.",
+							"Restoring them only asks the kernel to read them ahead; they're not read into shared buffers.",
+							&guc_save_page_cache,
+							guc_save_page_cache,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("pg_hibernator.structure_first",
+							"Restore the system catalogs, visibility maps, free space maps, and upper levels of B-tree indexes before the other blocks of each save-file.",
+							NULL,
+							&guc_structure_first,
+							guc_structure_first,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("pg_hibernator.numa_placement",
+							"Spread the Block Readers across the NUMA nodes, each running on the CPUs of its node.",
+							"Only supported on Linux.",
+							&guc_numa_placement,
+							guc_numa_placement,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_hibernator.sample_interval",
+							"Interval between samples of the usage counts of shared buffers.",
+							"The samples make up the working set saved by pg_hibernator.save_working_set. Zero disables sampling.",
+							&guc_sample_interval,
+							guc_sample_interval,
+							0,
+							INT_MAX / 1000,
+							PGC_SIGHUP,
+							GUC_UNIT_S,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_hibernator.sample_half_life",
+							"Time it takes for the weight of a sample of shared buffers to halve.",
+							"Blocks not seen in samples for twice this long drop out of the working set.",
+							&guc_sample_half_life,
+							guc_sample_half_life,
+							1,
+							INT_MAX / 1000,
+							PGC_SIGHUP,
+							GUC_UNIT_S,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("pg_hibernator.save_working_set",
+							"Save the working set sampled over time, instead of the contents of shared buffers.",
+							"Has no effect until the first sample; see pg_hibernator.sample_interval.",
+							&guc_save_working_set,
+							guc_save_working_set,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomStringVariable("pg_hibernator.publish_snapshot",
+							"Snapshot to save the buffers to, whenever they are saved.",
+							"Standbys can follow the snapshot; see pg_hibernator.follow_snapshot. Empty disables publishing.",
+							&guc_publish_snapshot,
+							guc_publish_snapshot,
+							PGC_SIGHUP,
+							0,
+							check_snapshot_guc,
+							NULL,
+							NULL);
+
+	DefineCustomStringVariable("pg_hibernator.follow_snapshot",
+							"Snapshot to restore, whenever it changes, while in recovery.",
+							"Empty disables following.",
+							&guc_follow_snapshot,
+							guc_follow_snapshot,
+							PGC_SIGHUP,
+							0,
+							check_snapshot_guc,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_hibernator.follow_interval",
+							"Interval between checks of the followed snapshot for changes.",
+							"Each change is restored at most once per interval.",
+							&guc_follow_interval,
+							guc_follow_interval,
+							1,
+							INT_MAX / 1000,
+							PGC_SIGHUP,
+							GUC_UNIT_S,
+							NULL,
+							NULL,
+							NULL);
+}
+
+/* GUC check hook for the names of snapshots; an empty name is allowed. */
+static bool
+check_snapshot_guc(char **newval, void **extra, GucSource source)
+{
+	if (**newval != '\0' && !isValidSnapshotName(*newval))
+	{
+		GUC_check_errdetail("Snapshot names consist of at most %d letters, digits, underscores and dashes.",
+							NAMEDATALEN - 1);
+		return false;
+	}
+
+	return true;
+}
+
+static void
+SharedStateSetup(void)
+{
+	RequestAddinShmemSpace(SharedStateSize());
+	RequestNamedLWLockTranche("pg_hibernator", 1);
+
+	/* Register our hook for Shared Memory initialization */
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = shmem_startup;
+}
+
+/*
+ * Every save-file being restored needs at least one BlockReader, so we can't
+ * be restoring more save-files at a time than there are worker processes.
+ */
+static Size
+SharedStateSize(void)
+{
+	Size	size;
+
+	size = add_size(offsetof(SharedState, slots),
+					mul_size(max_worker_processes, sizeof(RestoreSlot)));
+	size = MAXALIGN(size);
+	size = add_size(size, mul_size(max_worker_processes, sizeof(ReaderStats)));
+	size = MAXALIGN(size);
+
+	return add_size(size, mul_size(max_worker_processes, sizeof(IdleReader)));
+}
+
+static void
+shmem_startup(void)
+{
+	bool	found;
+
+	/* reset in case this is a restart within the postmaster */
+	shared_mem = NULL;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+	shared_mem = ShmemInitStruct("pg_hibernator",
+								SharedStateSize(),
+								&found);
+	if (!found)
+	{
+		int		i;
+
+		/* First time through */
+		shared_mem->lock = &(GetNamedLWLockTranche("pg_hibernator"))->lock;
+		shared_mem->saver_latch = NULL;
+		shared_mem->last_restore_id = 0;
+		pg_atomic_init_u64(&shared_mem->throttle_tat, 0);
+		pg_atomic_init_u32(&shared_mem->next_numa_node, 0);
+		MemSet(&shared_mem->last_save, 0, sizeof(SaveStats));
+		shared_mem->request = REQUEST_NONE;
+		shared_mem->request_latch = NULL;
+		shared_mem->request_seq = 0;
+		shared_mem->completed_seq = 0;
+		shared_mem->request_result = -1;
+		shared_mem->nslots = max_worker_processes;
+		shared_mem->readers = (ReaderStats *)
+			((char *) shared_mem + MAXALIGN(offsetof(SharedState, slots) +
+											shared_mem->nslots * sizeof(RestoreSlot)));
+		MemSet(shared_mem->readers, 0, shared_mem->nslots * sizeof(ReaderStats));
+		shared_mem->idle_readers = (IdleReader *)
+			((char *) shared_mem->readers + MAXALIGN(shared_mem->nslots * sizeof(ReaderStats)));
+		MemSet(shared_mem->idle_readers, 0, shared_mem->nslots * sizeof(IdleReader));
+
+		for (i = 0; i < shared_mem->nslots; ++i)
+		{
+			shared_mem->slots[i].filenum = 0;
+			shared_mem->slots[i].level = SAVEFILE_ALL_LEVELS;
+			shared_mem->slots[i].structure_first = false;
+			shared_mem->slots[i].remove_file = false;
+			shared_mem->slots[i].nreaders = 0;
+			shared_mem->slots[i].npending = 0;
+			shared_mem->slots[i].generation = 0;
+			shared_mem->slots[i].failed = false;
+			pg_atomic_init_u32(&shared_mem->slots[i].next_unit, 0);
+			pg_atomic_init_u32(&shared_mem->slots[i].blocks_restored, 0);
+			shared_mem->slots[i].restore_id = 0;
+			pg_atomic_init_u32(&shared_mem->slots[i].restore_base, 0);
+		}
+	}
+
+	LWLockRelease(AddinShmemInitLock);
 }
 
 /*
@@ -225,18 +1144,58 @@ CreateDirectory(void)
 	/* XXX: Should we make sure we have write permissions on this directory? */
 }
 
-static void
-RegisterBlockReaders(void)
+/*
+ * Queue the restore jobs for the save-files of the snapshot; see RestoreJob.
+ * Returns the number of save-files queued.
+ */
+static int
+RegisterBlockReaders(const char *snapshot)
 {
 	DIR			   *dir;
-	const char	   *hibernate_dir;
+	char			hibernate_dir[MAXPGPATH];
 	struct dirent   *dent;
+	uint32			level_blocks[SAVEFILE_USAGE_LEVELS];
+	Oid				database;
+	Oid				tablespace;
+	uint64			generation;
+	uint64			file_generation;
+	int				nfiles = 0;
+	uint32			restore_id;
+	RestoreBudgetUse *use;
+	MemoryContext	oldContext;
+
+	strlcpy(hibernate_dir, getSnapshotDirectory(snapshot), sizeof(hibernate_dir));
+
+	/* The jobs queued below make a restore, with a budget of its own. */
+	LWLockAcquire(shared_mem->lock, LW_EXCLUSIVE);
+	if (++shared_mem->last_restore_id == 0)
+		++shared_mem->last_restore_id;
+	restore_id = shared_mem->last_restore_id;
+	LWLockRelease(shared_mem->lock);
+
+	oldContext = MemoryContextSwitchTo(TopMemoryContext);
+	use = palloc(sizeof(RestoreBudgetUse));
+	use->restore_id = restore_id;
+	use->blocks_restored = 0;
+	restores = lappend(restores, use);
+	MemoryContextSwitchTo(oldContext);
 
-	/* Don't create BlockReaders if the extension is disabled. */
-	if (!guc_enabled)
-		return;
+	/*
+	 * The save-files restored are removed, so the next save can't be a delta
+	 * save; and the BlockReaders need the delta files folded in.
+	 */
+	if (snapshot[0] == '\0')
+	{
+		DiscardDeltaBase();
+		FoldDeltaFiles(hibernate_dir);
+	}
 
-	hibernate_dir = SAVE_LOCATION;
+	/*
+	 * Restore only the save-files of the last complete save; see
+	 * WriteSaveGeneration(). Without its generation, the save-files are of a
+	 * version that had none.
+	 */
+	(void) ReadSaveGeneration(hibernate_dir, &generation);
 
 	dir = opendir(hibernate_dir);
 	if (dir == NULL)
@@ -248,12 +1207,90 @@ RegisterBlockReaders(void)
 	while ((dent = readdir(dir)) != NULL)
 	{
 		int		filenum;
+		bool	has_levels;
 
 		/* Skip worker creation if we can't parse the file name. */
 		if (!parseSavefileName(dent->d_name, &filenum))
 			continue;
 
-		addPendingWorker(filenum);
+		/*
+		 * If we've been restarted after an error, BlockReaders launched by our
+		 * previous incarnation may still be at work; leave their files alone.
+		 * Likewise for the files of a snapshot asked to be restored again.
+		 */
+		if (IsBeingRestored(snapshot, filenum) || IsPending(snapshot, filenum))
+			continue;
+
+		/*
+		 * Don't launch BlockReaders for a save-file that was truncated, or
+		 * corrupted, they'd only get as far as the damage. It's no use for the
+		 * next startup either.
+		 */
+		if (!savefileVerify(getSavefilePath(hibernate_dir, filenum)))
+		{
+			const char *filepath = getSavefilePath(hibernate_dir, filenum);
+
+			ereport(WARNING,
+					(errmsg("skipping save-file \"%s\", which failed its checksum test",
+							filepath)));
+
+			if (remove(filepath) != 0)
+				ereport(WARNING,
+						(errcode_for_file_access(),
+						errmsg("error removing file \"%s\" : %m", filepath)));
+
+			continue;
+		}
+
+		has_levels = savefileReadUsageLevels(getSavefilePath(hibernate_dir, filenum),
+											 level_blocks, &database, &tablespace,
+											 &file_generation);
+
+		if (file_generation != generation)
+		{
+			const char *filepath = getSavefilePath(hibernate_dir, filenum);
+
+			ereport(WARNING,
+					(errmsg("skipping save-file \"%s\", left behind by an incomplete save",
+							filepath)));
+
+			/* The next save replaces it anyway; but a snapshot isn't saved again. */
+			if (snapshot[0] == '\0' && remove(filepath) != 0)
+				ereport(WARNING,
+						(errcode_for_file_access(),
+						errmsg("error removing file \"%s\" : %m", filepath)));
+
+			continue;
+		}
+
+		++nfiles;
+
+		if (guc_structure_first)
+			addPendingJob(snapshot, filenum, SAVEFILE_STRUCTURE_LEVEL, database, tablespace,
+						  true, restore_id);
+
+		/* Queue a job for each usage count the save-file has blocks of. */
+		if (has_levels)
+		{
+			int		level;
+			bool	queued = false;
+
+			for (level = SAVEFILE_USAGE_LEVELS - 1; level >= 0; --level)
+			{
+				if (level_blocks[level] == 0)
+					continue;
+
+				addPendingJob(snapshot, filenum, level, database, tablespace,
+							  guc_structure_first, restore_id);
+				queued = true;
+			}
+
+			if (queued)
+				continue;
+		}
+
+		addPendingJob(snapshot, filenum, SAVEFILE_ALL_LEVELS, database, tablespace,
+					  guc_structure_first, restore_id);
 	}
 
 	if (errno != 0)
@@ -262,770 +1299,5838 @@ RegisterBlockReaders(void)
 				errmsg("error encountered during readdir \"%s\": %m", hibernate_dir)));
 
 	closedir(dir);
+
+	SortPendingJobs();
+
+	return nfiles;
 }
 
 static void
-addPendingWorker(int filenum)
+addPendingJob(const char *snapshot, int filenum, int level, Oid database,
+			  Oid tablespace, bool structure_first, uint32 restore_id)
 {
 	MemoryContext oldContext = MemoryContextSwitchTo(TopMemoryContext);
+	RestoreJob *job = palloc(sizeof(RestoreJob));
+
+	strlcpy(job->snapshot, snapshot, sizeof(job->snapshot));
+	job->filenum = filenum;
+	job->level = level;
+	job->database = database;
+	job->tablespace = tablespace;
+	job->structure_first = structure_first;
+	job->restore_id = restore_id;
 
-	pendingWorkers = lappend_int(pendingWorkers, filenum);
+	pendingJobs = lappend(pendingJobs, job);
 
 	MemoryContextSwitchTo(oldContext);
 }
 
+/* Order the pending jobs hottest first; see RestoreJob. */
 static void
-processOnePendingWorker()
+SortPendingJobs(void)
 {
-	static BackgroundWorkerHandle *last_worker = NULL;
+	int			njobs = list_length(pendingJobs);
+	RestoreJob **jobs;
+	ListCell   *lc;
+	int			i;
 
-	/* Nothing to do if the list is empty. */
-	if (list_length(pendingWorkers) == 0)
+	if (njobs < 2)
 		return;
 
-	if (last_worker != NULL)
-	{
-		pid_t pid;
-		BgwHandleStatus status = GetBackgroundWorkerPid(last_worker, &pid);
+	jobs = palloc(sizeof(RestoreJob *) * njobs);
 
-		switch (status)
-		{
-			case BGWH_STARTED:
-			case BGWH_NOT_YET_STARTED:
-				/* Do nothing if parallelism is disabled */
-				if (!guc_parallel_enabled)
-					return;
+	i = 0;
+	foreach(lc, pendingJobs)
+		jobs[i++] = (RestoreJob *) lfirst(lc);
 
-				/* Fall through */
-			case BGWH_STOPPED:
-				last_worker = NULL;
-				break;
-			default:
-				Assert(false);
-				break;
-		}
-	}
+	pg_qsort(jobs, njobs, sizeof(RestoreJob *), RestoreJobCmp);
 
-	if (!RegisterWorker(linitial_int(pendingWorkers), &last_worker))
-	{
-		ereport(LOG, (errmsg("registration of background worker failed")));
-		return;
-	}
+	i = 0;
+	foreach(lc, pendingJobs)
+		lfirst(lc) = jobs[i++];
 
-	/* Remove the element from pending list iff we could register a worker successfully. */
-	pendingWorkers = list_delete_first(pendingWorkers);
+	pfree(jobs);
 }
 
-static bool
-RegisterWorker(int id, BackgroundWorkerHandle **handle)
+/*
+ * The structure jobs first, then higher usage counts, then the save-files in
+ * the order they were saved; so the global catalogs of save-file 1 go first.
+ */
+static int
+RestoreJobCmp(const void *p, const void *q)
 {
-	BackgroundWorker	worker;
-
-	/*
-	 * Protect against the possibility of more members being added to the
-	 * structure than we are using below.
-	 */
-	MemSet(&worker, 0, sizeof(worker));
+	RestoreJob *a = *(RestoreJob **) p;
+	RestoreJob *b = *(RestoreJob **) q;
+	bool		a_structure = (a->level == SAVEFILE_STRUCTURE_LEVEL);
+	bool		b_structure = (b->level == SAVEFILE_STRUCTURE_LEVEL);
 
-	worker.bgw_main_arg = Int32GetDatum(id);
-	worker.bgw_flags		= BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+	if (a_structure != b_structure)
+		return a_structure ? -1 : 1;
 
-	if (id == 0)
-	{
-		/* Register the BufferSaver background worker */
-		worker.bgw_start_time	= BgWorkerStart_ConsistentState;
-		worker.bgw_restart_time	= 0;	/* Keep the BufferSaver running */
-		worker.bgw_main			= BufferSaverMain;
-		snprintf(worker.bgw_name, BGW_MAXLEN, "Buffer Saver");
-		RegisterBackgroundWorker(&worker);
-		return true;
-	}
-	else
-	{
-		/* Register a BlockReader background worker process */
-		worker.bgw_start_time	= BgWorkerStart_ConsistentState;
-		worker.bgw_restart_time	= BGW_NEVER_RESTART;	/* Don't restart BlockReaders upon error */
-		worker.bgw_main			= BlockReaderMain;
-		worker.bgw_notify_pid	= MyProcPid;			/* Send me SIGUSR1 when a BGWorker is created or dies. */
-		snprintf(worker.bgw_name, BGW_MAXLEN, "Block Reader %d", id);
-		return RegisterDynamicBackgroundWorker(&worker, handle);
-	}
-}
+	if (a->level != b->level)
+		return a->level > b->level ? -1 : 1;
 
-static void
-WorkerCommon(void)
-{
-	/* Establish signal handlers before unblocking signals. */
-	pqsignal(SIGHUP, sighupHandler);
-	pqsignal(SIGTERM, sigtermHandler);
-	pqsignal(SIGUSR1, sigusr1Handler);
+	if (a->filenum != b->filenum)
+		return a->filenum < b->filenum ? -1 : 1;
 
-	/* We're now ready to receive signals */
-	BackgroundWorkerUnblockSignals();
+	return 0;
 }
 
+/*
+ * Forget the pending jobs of the save-file, so that the save-file is kept for
+ * the next startup.
+ */
 static void
-BlockReaderMain(Datum main_arg)
+DropPendingJobs(const char *snapshot, int filenum)
 {
-	int					id = DatumGetInt32(main_arg);
-	DIR				   *dir;
-	const char		   *hibernate_dir = SAVE_LOCATION;
-	struct dirent	   *dent;
-	int					filenum;
-
-	WorkerCommon();
-
-	dir = opendir(hibernate_dir);
-	if (dir == NULL)
-		ereport(ERROR,
-				(errcode_for_file_access(),
-				 errmsg("Block Reader %d: could not open directory \"%s\": %m",
-						id, hibernate_dir)));
-
-	/*
-	 * Reset errno before making system call, so that we don't trip over an
-	 * error that occurred earlier.
-	 */
-	errno = 0;
-
-	/* Scan the directory looking for file this worker is assigned to. */
-	while ((dent = readdir(dir)) != NULL)
-	{
-		if (!parseSavefileName(dent->d_name, &filenum))
-			continue;
+	ListCell   *lc;
+	ListCell   *prev = NULL;
+	ListCell   *next;
 
-		/* Stop if this is the file assigned to this worker. */
-		if (filenum == id)
-			break;
-	}
-
-	if (dent == NULL)
+	for (lc = list_head(pendingJobs); lc != NULL; lc = next)
 	{
-		closedir(dir);
+		RestoreJob *job = (RestoreJob *) lfirst(lc);
 
-		if (errno != 0)
-			ereport(ERROR,
-					(errcode_for_file_access(),
-					errmsg("Block Reader %d: encountered error during readdir \"%s\": %m",
-							filenum, hibernate_dir)));
+		next = lnext(lc);
 
-		ereport(ERROR,
-				(errmsg("Block Reader %d: could not find its save-file", filenum)));
+		if (job->filenum == filenum && strcmp(job->snapshot, snapshot) == 0)
+		{
+			pendingJobs = list_delete_cell(pendingJobs, lc, prev);
+			pfree(job);
+		}
+		else
+			prev = lc;
 	}
-	closedir(dir);
-
-	/* We found the file we're supposed to restore. */
-
-	ReadBlocks(filenum);
-
-	/*
-	 * Exit with non-zero status to ensure that this worker is not restarted.
-	 *
-	 * For any backend connected to shared-buffers, an exit code other than 0 or 1
-	 * causes a system-wide restart, so we have no choice but to use 1. Since an
-	 * ERROR also causes exit code 1, it would've been nice if we could use some
-	 * other code to signal normal exit, so that a monitor could differentiate
-	 * between a successful exit, and an exit due to an ERROR.
-	 *
-	 * To get around this ambiguity we resort to logging a message to server log;
-	 * this message should console the user that everything went okay, even though
-	 * the exit code is 1.
-	 */
-	ereport(LOG, (errmsg("Block Reader %d: all blocks read successfully", filenum)));
-	proc_exit(1);
 }
 
+/*
+ * Launch BlockReaders for as many pending jobs as we can.
+ *
+ * This is called whenever the BufferSaver's latch is set, which the
+ * BlockReaders do when they exit, so a new job is dispatched as soon as the
+ * workers become available.
+ */
 static void
-ReadBlocks(int filenum)
+DispatchBlockReaders(void)
 {
-	FILE	   *file;
-	char		record_type;
-	char	   *dbname;
-	Oid			record_filenode;
-	ForkNumber	record_forknum;
-	BlockNumber	record_blocknum;
-	BlockNumber	record_range;
+	ListCell   *uc;
 
-	int			log_level		= DEBUG3;
-	Oid			relOid			= InvalidOid;
-	Relation	rel				= NULL;
-	bool		skip_relation	= false;
-	bool		skip_fork		= false;
-	bool		skip_block		= false;
-	BlockNumber	nblocks			= 0;
-	BlockNumber	blocks_restored	= 0;
-	const char *filepath;
+	ReapBlockReaders();
+	ForgetFinishedRestores();
 
 	/*
-	 * If this condition changes, then this code, and the code in the writer
-	 * will need to be changed; especially the format specifiers in log and
-	 * error messages.
+	 * Once a restore's budget is used up, the blocks it has left to restore are
+	 * colder than the ones restored so far, and would only evict them.
 	 */
-	StaticAssertStmt(MaxBlockNumber == 0xFFFFFFFE, "Code may need review.");
+	foreach(uc, restores)
+	{
+		RestoreBudgetUse *use = (RestoreBudgetUse *) lfirst(uc);
 
-	filepath = getSavefileName(filenum);
-	file = fileOpen(filepath, PG_BINARY_R);
-	dbname = readDBName(file, filepath);
+		if (RestoreBlocksSpent(use->restore_id, use->blocks_restored) >= RestoreBudget()
+			&& DiscardPendingJobs(use->restore_id) > 0)
+			ereport(LOG,
+					(errmsg("Buffer Saver: restore budget of %u blocks used up, skipping the remaining save-files",
+							RestoreBudget())));
+	}
 
-	/*
-	 * When restoring global objects, the dbname is zero-length string, and non-
-	 * zero length otherwise. And filenum is never expected to be smaller than 1.
-	 */
-	Assert(filenum >= 1);
-	Assert(filenum == 1 ? strlen(dbname) == 0 : strlen(dbname) > 0);
+	while (list_length(pendingJobs) > 0)
+	{
+		MemoryContext oldContext;
+		RestoreJob *job = NULL;
+		ListCell   *job_cell = NULL;
+		ListCell   *lc;
+		ListCell   *prev = NULL;
+		bool		last_job = true;
+		int			filenum;
+		int			nreaders;
+		int			nregistered;
+		int			nadopted;
+		int			nidle;
+		int			free_workers;
+		int			slotno;
+		int			i;
+		int			active_files	= 0;
+		int			active_readers	= 0;
+
+		LWLockAcquire(shared_mem->lock, LW_SHARED);
+		for (i = 0; i < shared_mem->nslots; ++i)
+		{
+			if (shared_mem->slots[i].filenum != 0)
+			{
+				++active_files;
+				active_readers += shared_mem->slots[i].nreaders;
+			}
+		}
+		LWLockRelease(shared_mem->lock);
 
-	/* To restore the global objects, use default database */
-	BackgroundWorkerInitializeConnection(filenum == 1 ? guc_default_database : dbname, NULL);
-	SetCurrentStatementStartTimestamp();
-	StartTransactionCommand();
-	SPI_connect();
-	PushActiveSnapshot(GetTransactionSnapshot());
-	pgstat_report_activity(STATE_RUNNING, "restoring buffers");
+		/* Wait for the current save-file to finish, if parallelism is disabled. */
+		if (!guc_parallel_enabled && active_files > 0)
+			return;
 
-	/*
-	 * Note that in case of a read error, we will leak relcache entry that we may
-	 * currently have open. In case of EOF, we close the relation after the loop.
-	 */
-	while (fileRead(&record_type, 1, file, true, filepath))
-	{
 		/*
-		 * If we want to process the signals, this seems to be the best place
-		 * to do it. Generally the backends refrain from processing config file
-		 * while in transaction, but that's more for the fear of allowing GUC
-		 * changes to affect expression evaluation, causing different results
-		 * for the same expression in a transaction. Since this worker is not
-		 * processing any queries, it is okay to process the config file here.
+		 * Don't ask for more workers than max_worker_processes allows, leaving
+		 * room for us, the BufferSaver, and for the idle BlockReaders. Other
+		 * extensions' workers may still make the registration fail, in which
+		 * case we retry when a worker exits.
+		 */
+		nidle = CountIdleReaders(NULL);
+		free_workers = Max(max_worker_processes - 1 - active_readers - nidle, 0);
+		if (free_workers == 0 && nidle == 0)
+			return;
+
+		/*
+		 * Pick the hottest job whose save-file isn't being restored already.
+		 * The jobs of a save-file run one after the other, so that the last one
+		 * can remove the save-file once all of them are done.
 		 *
-		 * Even though it's okay to process SIGHUP here, doing so doesn't add
-		 * any value. The only reason we might want to process config file here
-		 * would be to allow the user to interrupt the BlockReader's operation
-		 * by changing this extenstion's GUC parameter. But the user can do that
-		 * anyway, using SIGTERM or pg_terminate_backend().
+		 * Each save-file holds the blocks of one tablespace, so skipping the
+		 * jobs of the tablespaces that have as many readers as they may have
+		 * interleaves the restore across the tablespaces, and their devices.
 		 */
+		foreach(lc, pendingJobs)
+		{
+			RestoreJob *candidate = (RestoreJob *) lfirst(lc);
 
-		/* Stop processing the save-file if the Postmaster wants us to die. */
-		if (got_sigterm)
-			break;
+			if (!IsBeingRestored(candidate->snapshot, candidate->filenum))
+			{
+				int		room = Min(guc_max_readers, free_workers + CountIdleReaders(candidate));
 
-		ereport(log_level,
-				(errmsg("record type %x - %c", record_type, record_type)));
+				if (guc_max_tablespace_readers > 0 && OidIsValid(candidate->tablespace))
+					room = Min(room, guc_max_tablespace_readers
+									 - TablespaceReaders(candidate->tablespace));
 
-		switch (record_type)
-		{
-			case 'r':
-			{
-				/* Close the previous relation, if any. */
-				if (rel)
+				if (room > 0)
 				{
-					relation_close(rel, AccessShareLock);
-					rel = NULL;
+					job = candidate;
+					job_cell = lc;
+					nreaders = room;
+					break;
 				}
+			}
 
-				record_forknum = InvalidForkNumber;
-				record_blocknum = InvalidBlockNumber;
-				nblocks = 0;
+			prev = lc;
+		}
 
-				fileRead(&record_filenode, sizeof(Oid), file, false, filepath);
+		if (job == NULL)
+			return;
 
-				relOid = GetRelOid(record_filenode);
+		filenum = job->filenum;
 
-				ereport(log_level, (errmsg("processing filenode %u, relation %u",
-										record_filenode, relOid)));
-				/*
-				 * If the relation has been rewritten/dropped since we saved it,
-				 * just skip it and process the next relation.
-				 */
-				if (relOid == InvalidOid)
-					skip_relation = true;
-				else
-				{
-					skip_relation = false;
+		for (lc = lnext(job_cell); lc != NULL; lc = lnext(lc))
+		{
+			RestoreJob *other = (RestoreJob *) lfirst(lc);
 
-					/* Open the relation */
-					rel = relation_open(relOid, AccessShareLock);
-					RelationOpenSmgr(rel);
-				}
-			}
-			break;
-			case 'f':
+			if (other->filenum == filenum && strcmp(other->snapshot, job->snapshot) == 0)
 			{
-				record_blocknum = InvalidBlockNumber;
-				nblocks = 0;
+				last_job = false;
+				break;
+			}
+		}
 
-				fileRead(&record_forknum, sizeof(ForkNumber), file, false, filepath);
+		slotno = AcquireRestoreSlot(job, last_job, nreaders);
+		if (slotno < 0)
+			return;
 
-				if (skip_relation)
-					continue;
+		slot_jobs[slotno] = *job;
 
-				if (rel == NULL)
-					ereport(ERROR,
-							(errmsg("found a fork record without a preceeding relation record")));
+		/* Put the idle readers of the job's database to work before launching more. */
+		nadopted = AdoptIdleReaders(job, slotno, nreaders);
 
-				ereport(log_level, (errmsg("processing fork %d", record_forknum)));
+		oldContext = MemoryContextSwitchTo(TopMemoryContext);
 
-				if (!smgrexists(rel->rd_smgr, record_forknum))
-					skip_fork = true;
-				else
-				{
-					skip_fork = false;
+		for (nregistered = nadopted; nregistered < nreaders; ++nregistered)
+		{
+			BackgroundWorkerHandle *handle;
 
-					nblocks = RelationGetNumberOfBlocksInFork(rel, record_forknum);
-				}
-			}
-			break;
-			case 'b':
-			{
-				if (record_forknum == InvalidForkNumber)
-					ereport(ERROR,
-							(errmsg("found a block record without a preceeding fork record")));
+			if (!RegisterWorker(filenum, slotno, &handle))
+				break;
 
-				fileRead(&record_blocknum, sizeof(BlockNumber), file, false, filepath);
+			slot_handles[slotno] = lappend(slot_handles[slotno], handle);
+		}
 
-				if (skip_relation || skip_fork)
-					continue;
+		MemoryContextSwitchTo(oldContext);
 
-				/*
-				 * Don't try to read past the file; the file may have been shrunk
-				 * by a vaccum/truncate operation.
-				 */
-				if (record_blocknum >= nblocks)
-				{
-					ereport(log_level,
-							(errmsg("reader %d skipping block filenode %u forknum %d blocknum %u",
-									filenum, record_filenode, record_forknum, record_blocknum)));
+		if (nregistered == 0)
+		{
+			/* No reader could have attached to the slot, so just give it up. */
+			LWLockAcquire(shared_mem->lock, LW_EXCLUSIVE);
+			shared_mem->slots[slotno].filenum = 0;
+			shared_mem->slots[slotno].nreaders = 0;
+			RetireSlotBudget(slotno);
+			LWLockRelease(shared_mem->lock);
+
+			ereport(LOG, (errmsg("registration of background worker failed")));
+			return;
+		}
 
-					skip_block = true;
-					continue;
-				}
-				else
-				{
-					Buffer	buf;
+		/*
+		 * Let go of the share of the slot reserved for the readers we couldn't
+		 * register; the ones we did register will restore the whole save-file.
+		 */
+		if (nregistered < nreaders)
+		{
+			ereport(LOG,
+					(errmsg("registered only %d of %d Block Readers for save-file %d",
+							nregistered, nreaders, filenum)));
 
-					skip_block = false;
+			ReleaseRestoreSlot(&shared_mem->slots[slotno], nreaders - nregistered, false, true);
+		}
 
-					ereport(log_level,
-							(errmsg("reader %d reading block filenode %u forknum %d blocknum %u",
-									filenum, record_filenode, record_forknum, record_blocknum)));
+		ereport(DEBUG1,
+				(errmsg("Buffer Saver: launched %d Block Readers, %d of them idle ones, for save-file %d, usage count %d",
+						nregistered, nadopted, filenum, job->level)));
 
-					buf = ReadBufferExtended(rel, record_forknum, record_blocknum, RBM_NORMAL, NULL);
-					ReleaseBuffer(buf);
+		/* Remove the job from pending list iff we could register a worker successfully. */
+		pendingJobs = list_delete_cell(pendingJobs, job_cell, prev);
+		pfree(job);
+	}
+}
 
-					++blocks_restored;
-				}
-			}
-			break;
-			case 'N':
+/*
+ * Forget the handles of the BlockReaders that have exited.
+ *
+ * A BlockReader detaches from its slot on exit, but one that failed to start,
+ * or died before it could attach, never will; once all the BlockReaders of a
+ * slot have stopped, we detach whatever share of the slot is left on their
+ * behalf. Since the work units are claimed on the fly, the readers that did
+ * run have restored the whole save-file.
+ */
+static void
+ReapBlockReaders(void)
+{
+	int		i;
+
+	for (i = 0; i < shared_mem->nslots; ++i)
+	{
+		ListCell   *lc;
+		int			nreaders;
+		int			filenum;
+		bool		failed;
+		bool		all_stopped = true;
+
+		if (slot_handles[i] == NIL)
+			continue;
+
+		foreach(lc, slot_handles[i])
+		{
+			pid_t pid;
+			BgwHandleStatus status = GetBackgroundWorkerPid(lfirst(lc), &pid);
+
+			switch (status)
+			{
+				case BGWH_STARTED:
+				case BGWH_NOT_YET_STARTED:
+					all_stopped = false;
+					break;
+				case BGWH_STOPPED:
+				case BGWH_POSTMASTER_DIED:
+					break;
+				default:
+					Assert(false);
+					break;
+			}
+		}
+
+		if (!all_stopped)
+			continue;
+
+		/*
+		 * The slot can't have been reused since the readers stopped, because
+		 * AcquireRestoreSlot() skips slots whose handles we still have.
+		 */
+		LWLockAcquire(shared_mem->lock, LW_SHARED);
+		filenum = shared_mem->slots[i].filenum;
+		nreaders = filenum != 0 ? shared_mem->slots[i].nreaders : 0;
+		LWLockRelease(shared_mem->lock);
+
+		if (nreaders > 0)
+		{
+			ereport(LOG,
+					(errmsg("%d Block Readers for save-file %d exited without detaching",
+							nreaders, filenum)));
+
+			ReleaseRestoreSlot(&shared_mem->slots[i], nreaders, false, true);
+		}
+
+		/* Keep the save-file around if the job failed; see ReleaseRestoreSlot(). */
+		LWLockAcquire(shared_mem->lock, LW_SHARED);
+		failed = shared_mem->slots[i].failed;
+		LWLockRelease(shared_mem->lock);
+
+		if (failed)
+			DropPendingJobs(slot_jobs[i].snapshot, slot_jobs[i].filenum);
+
+		LWLockAcquire(shared_mem->lock, LW_EXCLUSIVE);
+		RetireSlotBudget(i);
+		LWLockRelease(shared_mem->lock);
+
+		list_free_deep(slot_handles[i]);
+		slot_handles[i] = NIL;
+	}
+}
+
+/* Is any RestoreSlot in use for the save-file of the snapshot? */
+static bool
+IsBeingRestored(const char *snapshot, int filenum)
+{
+	int		i;
+	bool	found = false;
+
+	LWLockAcquire(shared_mem->lock, LW_SHARED);
+
+	for (i = 0; i < shared_mem->nslots; ++i)
+	{
+		if (shared_mem->slots[i].filenum == filenum
+			&& strcmp(shared_mem->slots[i].snapshot, snapshot) == 0)
+		{
+			found = true;
+			break;
+		}
+	}
+
+	LWLockRelease(shared_mem->lock);
+
+	return found;
+}
+
+/* Number of BlockReaders restoring save-files of the tablespace */
+static int
+TablespaceReaders(Oid tablespace)
+{
+	int		i;
+	int		nreaders = 0;
+
+	LWLockAcquire(shared_mem->lock, LW_SHARED);
+
+	for (i = 0; i < shared_mem->nslots; ++i)
+	{
+		if (shared_mem->slots[i].filenum != 0
+			&& shared_mem->slots[i].tablespace == tablespace)
+			nreaders += shared_mem->slots[i].nreaders;
+	}
+
+	LWLockRelease(shared_mem->lock);
+
+	return nreaders;
+}
+
+/* Is there a pending job for the save-file of the snapshot? */
+static bool
+IsPending(const char *snapshot, int filenum)
+{
+	ListCell   *lc;
+
+	foreach(lc, pendingJobs)
+	{
+		RestoreJob *job = (RestoreJob *) lfirst(lc);
+
+		if (job->filenum == filenum && strcmp(job->snapshot, snapshot) == 0)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Find a free RestoreSlot and reserve it for 'nreaders' BlockReaders of the
+ * job. Returns the slot number, or -1 if there's no free slot.
+ *
+ * Used only in BufferSaver.
+ */
+static int
+AcquireRestoreSlot(RestoreJob *job, bool last_job, int nreaders)
+{
+	int		i;
+	int		slotno = -1;
+
+	LWLockAcquire(shared_mem->lock, LW_EXCLUSIVE);
+
+	for (i = 0; i < shared_mem->nslots; ++i)
+	{
+		RestoreSlot *slot = &shared_mem->slots[i];
+
+		/* Skip the slots whose readers we haven't reaped yet. */
+		if (slot->filenum == 0 && slot_handles[i] == NIL)
+		{
+			RestoreBudgetUse *use = GetRestoreBudgetUse(job->restore_id);
+
+			/* Its readers may have been handed other jobs before we reaped it. */
+			RetireSlotBudget(i);
+
+			slot->filenum = job->filenum;
+			strlcpy(slot->snapshot, job->snapshot, sizeof(slot->snapshot));
+			slot->level = job->level;
+			slot->tablespace = job->tablespace;
+			slot->structure_first = job->structure_first;
+			/* A snapshot is kept until it's replaced; see pg_hibernator_save(). */
+			slot->remove_file = last_job && job->snapshot[0] == '\0';
+			slot->nreaders = nreaders;
+			slot->npending = nreaders;
+			++slot->generation;
+			slot->failed = false;
+			pg_atomic_write_u32(&slot->next_unit, 0);
+			pg_atomic_write_u32(&slot->blocks_restored, 0);
+			slot->restore_id = job->restore_id;
+			pg_atomic_write_u32(&slot->restore_base, use ? use->blocks_restored : 0);
+
+			slotno = i;
+			break;
+		}
+	}
+
+	LWLockRelease(shared_mem->lock);
+
+	return slotno;
+}
+
+/* Can a BlockReader connected to the database restore the job? See IdleReader. */
+static bool
+ReaderCanRestore(Oid database, RestoreJob *job)
+{
+	/* A save-file older than version 6 doesn't say; its global objects are in 1. */
+	if (!OidIsValid(job->database))
+		return job->filenum == 1;
+
+	return job->database == database;
+}
+
+/*
+ * Count the idle BlockReaders that could restore the job, or all of them if
+ * job is NULL.
+ */
+static int
+CountIdleReaders(RestoreJob *job)
+{
+	int		i;
+	int		count = 0;
+
+	LWLockAcquire(shared_mem->lock, LW_SHARED);
+
+	for (i = 0; i < shared_mem->nslots; ++i)
+	{
+		IdleReader *idle = &shared_mem->idle_readers[i];
+
+		if (idle->pid != 0 && idle->slotno == IDLE_READER_WAITING
+			&& (job == NULL || ReaderCanRestore(idle->database, job)))
+			++count;
+	}
+
+	LWLockRelease(shared_mem->lock);
+
+	return count;
+}
+
+/*
+ * Hand the job, which has been given the slot, to up to 'max_readers' idle
+ * BlockReaders that can restore it. Returns the number of readers handed the
+ * job; their handles are moved over to the slot.
+ *
+ * Used only in BufferSaver.
+ */
+static int
+AdoptIdleReaders(RestoreJob *job, int slotno, int max_readers)
+{
+	int		i;
+	int		count = 0;
+
+	LWLockAcquire(shared_mem->lock, LW_EXCLUSIVE);
+
+	for (i = 0; i < shared_mem->nslots && count < max_readers; ++i)
+	{
+		IdleReader			   *idle = &shared_mem->idle_readers[i];
+		BackgroundWorkerHandle *handle;
+		MemoryContext			oldContext;
+
+		if (idle->pid == 0 || idle->slotno != IDLE_READER_WAITING
+			|| !ReaderCanRestore(idle->database, job))
+			continue;
+
+		/* Not one of ours, e.g. launched by our previous incarnation. */
+		handle = TakeReaderHandle(idle->pid);
+		if (handle == NULL)
+			continue;
+
+		oldContext = MemoryContextSwitchTo(TopMemoryContext);
+		slot_handles[slotno] = lappend(slot_handles[slotno], handle);
+		MemoryContextSwitchTo(oldContext);
+
+		idle->slotno = slotno;
+		SetLatch(idle->latch);
+		++count;
+	}
+
+	/* They are running already, so they needn't attach; see BlockReaderMain(). */
+	shared_mem->slots[slotno].npending -= count;
+
+	LWLockRelease(shared_mem->lock);
+
+	return count;
+}
+
+/* Remove the handle of the BlockReader from its old slot's list, and return it. */
+static BackgroundWorkerHandle *
+TakeReaderHandle(pid_t pid)
+{
+	int		i;
+
+	for (i = 0; i < shared_mem->nslots; ++i)
+	{
+		ListCell   *lc;
+
+		foreach(lc, slot_handles[i])
+		{
+			BackgroundWorkerHandle *handle = lfirst(lc);
+			pid_t		handle_pid;
+
+			if (GetBackgroundWorkerPid(handle, &handle_pid) == BGWH_STARTED
+				&& handle_pid == pid)
+			{
+				slot_handles[i] = list_delete_ptr(slot_handles[i], handle);
+				return handle;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Let the idle BlockReaders exit, unless there's a pending job they could
+ * restore once its turn comes.
+ *
+ * Used only in BufferSaver.
+ */
+static void
+RetireIdleReaders(void)
+{
+	int		i;
+
+	LWLockAcquire(shared_mem->lock, LW_EXCLUSIVE);
+
+	for (i = 0; i < shared_mem->nslots; ++i)
+	{
+		IdleReader *idle = &shared_mem->idle_readers[i];
+		ListCell   *lc;
+		bool		wanted = false;
+
+		if (idle->pid == 0 || idle->slotno != IDLE_READER_WAITING)
+			continue;
+
+		foreach(lc, pendingJobs)
+		{
+			if (ReaderCanRestore(idle->database, (RestoreJob *) lfirst(lc)))
+			{
+				wanted = true;
+				break;
+			}
+		}
+
+		if (!wanted)
+		{
+			idle->slotno = IDLE_READER_RETIRE;
+			SetLatch(idle->latch);
+		}
+	}
+
+	LWLockRelease(shared_mem->lock);
+}
+
+/*
+ * Detach 'nreaders' BlockReaders from the slot. When the last one detaches, the
+ * slot is freed, and if this was the save-file's last job and none of the
+ * readers failed, the save-file is removed.
+ *
+ * The BufferSaver detaches the readers that never attached themselves, e.g.
+ * those it couldn't launch, with attached = false.
+ */
+static void
+ReleaseRestoreSlot(RestoreSlot *slot, int nreaders, bool attached, bool success)
+{
+	bool		last;
+	bool		remove_file = false;
+	int			filenum;
+	char		snapshot[NAMEDATALEN];
+
+	LWLockAcquire(shared_mem->lock, LW_EXCLUSIVE);
+
+	Assert(slot->nreaders >= nreaders);
+
+	if (!success)
+		slot->failed = true;
+
+	slot->nreaders -= nreaders;
+	if (!attached)
+		slot->npending = Max(slot->npending - nreaders, 0);
+	last = (slot->nreaders == 0);
+	filenum = slot->filenum;
+	strlcpy(snapshot, slot->snapshot, sizeof(snapshot));
+
+	if (last)
+	{
+		remove_file = slot->remove_file && !slot->failed;
+		slot->filenum = 0;
+	}
+
+	LWLockRelease(shared_mem->lock);
+
+	/* Let the BufferSaver know that it can launch more BlockReaders. */
+	if (shared_mem->saver_latch)
+		SetLatch(shared_mem->saver_latch);
+
+	if (remove_file)
+	{
+		const char *filepath = getSavefilePath(getSnapshotDirectory(snapshot), filenum);
+
+		/* Remove the save-file */
+		if (remove(filepath) != 0)
+			ereport(WARNING,
+					(errcode_for_file_access(),
+					errmsg("error removing file \"%s\" : %m", filepath)));
+	}
+}
+
+/*
+ * Detach from the slots the BlockReaders that our previous incarnation
+ * launched, but that haven't started yet. We don't have their handles, so
+ * we'd never know if they failed to start, and we'd keep their slots forever.
+ * Bumping the generation makes them exit, should they start after all.
+ *
+ * A slot none of whose readers have started is marked failed, so that its
+ * save-file is kept, and restored again; see RegisterBlockReaders().
+ */
+static void
+ReleaseUnstartedReaders(void)
+{
+	int		i;
+
+	for (i = 0; i < shared_mem->nslots; ++i)
+	{
+		RestoreSlot *slot = &shared_mem->slots[i];
+		int			npending;
+		int			filenum;
+		bool		started;
+
+		LWLockAcquire(shared_mem->lock, LW_EXCLUSIVE);
+		filenum = slot->filenum;
+		npending = filenum != 0 ? slot->npending : 0;
+		started = slot->nreaders > npending;
+		if (npending > 0)
+			++slot->generation;
+		LWLockRelease(shared_mem->lock);
+
+		if (npending == 0)
+			continue;
+
+		ereport(LOG,
+				(errmsg("Buffer Saver: releasing %d Block Readers of save-file %d that haven't started",
+						npending, filenum)));
+
+		ReleaseRestoreSlot(slot, npending, false, started);
+	}
+}
+
+/* before_shmem_exit callback of BufferSaver */
+static void
+BufferSaverExit(int code, Datum arg)
+{
+	LWLockAcquire(shared_mem->lock, LW_EXCLUSIVE);
+	shared_mem->saver_latch = NULL;
+	LWLockRelease(shared_mem->lock);
+
+	/* Don't leave a backend waiting for a request we failed to serve. */
+	CompleteRequest(-1);
+}
+
+/*
+ * before_shmem_exit callback of BlockReaders, to detach from the slot in case
+ * we exit due to an error.
+ */
+static void
+BlockReaderExit(int code, Datum arg)
+{
+	if (!slot_detached && my_slot != NULL)
+	{
+		ReleaseReaderStats(false);
+		ReleaseRestoreSlot(my_slot, 1, true, false);
+	}
+
+	slot_detached = true;
+}
+
+/*
+ * Claim an entry for our progress; a never used one, or else the one that has
+ * been done the longest. There's always one, since the entries outnumber the
+ * BlockReaders that can be running at a time.
+ */
+static ReaderStats *
+AcquireReaderStats(int filenum, const char *snapshot, int level)
+{
+	ReaderStats *entry = NULL;
+	int			i;
+
+	LWLockAcquire(shared_mem->lock, LW_EXCLUSIVE);
+
+	for (i = 0; i < shared_mem->nslots; ++i)
+	{
+		ReaderStats *candidate = &shared_mem->readers[i];
+
+		if (candidate->state == READER_RUNNING)
+			continue;
+
+		if (entry == NULL
+			|| candidate->state == READER_FREE
+			|| (entry->state != READER_FREE && candidate->end_time < entry->end_time))
+			entry = candidate;
+
+		if (entry->state == READER_FREE)
+			break;
+	}
+
+	Assert(entry != NULL);
+
+	MemSet(entry, 0, sizeof(ReaderStats));
+	entry->state		= READER_RUNNING;
+	entry->pid			= MyProcPid;
+	entry->filenum		= filenum;
+	strlcpy(entry->snapshot, snapshot, sizeof(entry->snapshot));
+	entry->level		= level;
+	entry->start_time	= GetCurrentTimestamp();
+
+	LWLockRelease(shared_mem->lock);
+
+	return entry;
+}
+
+static void
+ReleaseReaderStats(bool success)
+{
+	if (my_stats == NULL)
+		return;
+
+	LWLockAcquire(shared_mem->lock, LW_EXCLUSIVE);
+	my_stats->state			= success ? READER_DONE : READER_FAILED;
+	my_stats->end_time		= GetCurrentTimestamp();
+	my_stats->current_relid	= InvalidOid;
+	LWLockRelease(shared_mem->lock);
+
+	my_stats = NULL;
+}
+
+static bool
+RegisterWorker(int id, int slotno, BackgroundWorkerHandle **handle)
+{
+	BackgroundWorker	worker;
+
+	/*
+	 * Protect against the possibility of more members being added to the
+	 * structure than we are using below.
+	 */
+	MemSet(&worker, 0, sizeof(worker));
+
+	worker.bgw_main_arg = Int32GetDatum(id);
+	worker.bgw_flags		= BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+
+	if (id == 0)
+	{
+		/*
+		 * Register the BufferSaver background worker. It doesn't need a
+		 * database connection, since the save-files name their databases by
+		 * OID; see SaveBuffers().
+		 */
+		worker.bgw_flags		= BGWORKER_SHMEM_ACCESS;
+		worker.bgw_start_time	= BgWorkerStart_ConsistentState;
+		worker.bgw_restart_time	= 0;	/* Keep the BufferSaver running */
+		worker.bgw_main			= BufferSaverMain;
+		snprintf(worker.bgw_name, BGW_MAXLEN, "Buffer Saver");
+		RegisterBackgroundWorker(&worker);
+		return true;
+	}
+	else
+	{
+		/* Register a BlockReader background worker process */
+		worker.bgw_start_time	= BgWorkerStart_ConsistentState;
+		worker.bgw_restart_time	= BGW_NEVER_RESTART;	/* Don't restart BlockReaders upon error */
+		worker.bgw_main			= BlockReaderMain;
+		worker.bgw_notify_pid	= MyProcPid;			/* Send me SIGUSR1 when a BGWorker is created or dies. */
+		snprintf(worker.bgw_name, BGW_MAXLEN, "Block Reader %d", id);
+		memcpy(worker.bgw_extra, &slotno, sizeof(slotno));	/* The RestoreSlot to attach to */
+		memcpy(worker.bgw_extra + sizeof(slotno), &shared_mem->slots[slotno].generation,
+			   sizeof(uint32));
+		return RegisterDynamicBackgroundWorker(&worker, handle);
+	}
+}
+
+static void
+WorkerCommon(void)
+{
+	/* Establish signal handlers before unblocking signals. */
+	pqsignal(SIGHUP, sighupHandler);
+	pqsignal(SIGTERM, sigtermHandler);
+	pqsignal(SIGUSR1, sigusr1Handler);
+
+	/* We're now ready to receive signals */
+	BackgroundWorkerUnblockSignals();
+}
+
+/*
+ * With pg_hibernator.numa_placement, bind the BlockReader to the CPUs of a
+ * NUMA node. The readers take the nodes in turn, so the restore is spread
+ * across all of them: with shared_buffers interleaved across the nodes, as
+ * it usually is on such machines, that spreads the copying of blocks into
+ * shared buffers across all the memory controllers, rather than funnelling it
+ * through the interconnect of whichever node the scheduler favours. And since
+ * the kernel allocates memory on the node of the CPU that first touches it,
+ * the reader's page cache copies and its private memory stay on its node.
+ *
+ * The readers of a save-file still share its work units (see WorkUnitClaim),
+ * so a slower node doesn't hold up the others.
+ *
+ * The node's CPUs are taken from /sys/devices/system/node/, and intersected
+ * with the CPUs we may run on, e.g. those of the container's cpuset. If any of
+ * that fails, the reader runs unbound, as it does without numa_placement.
+ */
+static void
+PinToNumaNode(void)
+{
+#ifdef __linux__
+	int		   *nodes;
+	int			nnodes;
+	int		   *cpus;
+	int			ncpus;
+	int			node;
+	int			nbound = 0;
+	int			i;
+	char		path[MAXPGPATH];
+	cpu_set_t	allowed;
+	cpu_set_t	mask;
+
+	if (!ReadSysfsList("/sys/devices/system/node/online", &nodes, &nnodes))
+		return;
+
+	/* Nothing to spread across */
+	if (nnodes < 2)
+	{
+		pfree(nodes);
+		return;
+	}
+
+	node = nodes[pg_atomic_fetch_add_u32(&shared_mem->next_numa_node, 1) % nnodes];
+	pfree(nodes);
+
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+	if (!ReadSysfsList(path, &cpus, &ncpus))
+		return;
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+	{
+		pfree(cpus);
+		return;
+	}
+
+	CPU_ZERO(&mask);
+	for (i = 0; i < ncpus; ++i)
+	{
+		if (cpus[i] < CPU_SETSIZE && CPU_ISSET(cpus[i], &allowed))
+		{
+			CPU_SET(cpus[i], &mask);
+			++nbound;
+		}
+	}
+	pfree(cpus);
+
+	if (nbound == 0)
+	{
+		ereport(DEBUG1,
+				(errmsg("Block Reader: may not run on any CPU of NUMA node %d, not binding", node)));
+		return;
+	}
+
+	if (sched_setaffinity(0, sizeof(mask), &mask) != 0)
+	{
+		ereport(LOG,
+				(errmsg("Block Reader: could not bind to the CPUs of NUMA node %d: %m", node)));
+		return;
+	}
+
+	ereport(DEBUG1,
+			(errmsg("Block Reader: bound to the %d CPUs of NUMA node %d", nbound, node)));
+#else
+	ereport(DEBUG1,
+			(errmsg("Block Reader: pg_hibernator.numa_placement is not supported on this platform")));
+#endif
+}
+
+#ifdef __linux__
+/*
+ * Parse a sysfs list of CPUs or nodes, like "0-3,8-11", into a palloc'd
+ * array. Returns false if the file can't be read or parsed.
+ */
+static bool
+ReadSysfsList(const char *path, int **ids, int *nids)
+{
+	FILE	   *file;
+	char		buf[4096];
+	char	   *p;
+	int			maxids = 64;
+
+	file = fopen(path, "r");
+	if (file == NULL)
+		return false;
+
+	if (fgets(buf, sizeof(buf), file) == NULL)
+	{
+		fclose(file);
+		return false;
+	}
+	fclose(file);
+
+	*ids = palloc(sizeof(int) * maxids);
+	*nids = 0;
+
+	for (p = buf; *p != '\0' && *p != '\n'; )
+	{
+		char   *end;
+		long	first = strtol(p, &end, 10);
+		long	last = first;
+		long	id;
+
+		if (end == p || first < 0)
+			goto bad;
+
+		p = end;
+		if (*p == '-')
+		{
+			last = strtol(p + 1, &end, 10);
+			if (end == p + 1 || last < first)
+				goto bad;
+			p = end;
+		}
+
+		for (id = first; id <= last && id <= INT_MAX; ++id)
+		{
+			if (*nids == maxids)
+			{
+				maxids *= 2;
+				*ids = repalloc(*ids, sizeof(int) * maxids);
+			}
+			(*ids)[(*nids)++] = (int) id;
+		}
+
+		if (*p == ',')
+			++p;
+		else if (*p != '\0' && *p != '\n')
+			goto bad;
+	}
+
+	if (*nids > 0)
+		return true;
+
+bad:
+	pfree(*ids);
+	return false;
+}
+#endif
+
+static void
+BlockReaderMain(Datum main_arg)
+{
+	int					slotno;
+	uint32				generation;
+	bool				attached;
+
+	WorkerCommon();
+
+	/*
+	 * Find the slot we share with the other BlockReaders of our save-file, and
+	 * make sure we detach from it however we exit.
+	 */
+	memcpy(&slotno, MyBgworkerEntry->bgw_extra, sizeof(slotno));
+	memcpy(&generation, MyBgworkerEntry->bgw_extra + sizeof(slotno), sizeof(generation));
+	before_shmem_exit(BlockReaderExit, (Datum) 0);
+
+	/*
+	 * If the BufferSaver that launched us has been restarted since, its
+	 * successor has given up on us, and the slot may have been reassigned; see
+	 * ReleaseUnstartedReaders().
+	 */
+	Assert(slotno >= 0 && slotno < shared_mem->nslots);
+	LWLockAcquire(shared_mem->lock, LW_EXCLUSIVE);
+	attached = (shared_mem->slots[slotno].filenum != 0
+				&& shared_mem->slots[slotno].generation == generation
+				&& shared_mem->slots[slotno].npending > 0);
+	if (attached)
+		--shared_mem->slots[slotno].npending;
+	LWLockRelease(shared_mem->lock);
+
+	if (!attached)
+	{
+		ereport(LOG,
+				(errmsg("Block Reader: restore slot %d was released before we started, exiting",
+						slotno)));
+		proc_exit(1);	/* not 0; see the end of this function */
+	}
+
+	/* Once for all the jobs we may be handed; see AwaitNextJob(). */
+	if (guc_numa_placement)
+		PinToNumaNode();
+
+	/* Restore save-files for as long as the BufferSaver has jobs for us. */
+	do
+	{
+		DIR			   *dir;
+		char			hibernate_dir[MAXPGPATH];
+		struct dirent  *dent;
+		int				filenum;
+		int				id;
+
+		Assert(slotno >= 0 && slotno < shared_mem->nslots);
+		my_slot = &shared_mem->slots[slotno];
+		slot_detached = false;
+		id = my_slot->filenum;
+		my_stats = AcquireReaderStats(id, my_slot->snapshot, my_slot->level);
+
+		strlcpy(hibernate_dir, getSnapshotDirectory(my_slot->snapshot), sizeof(hibernate_dir));
+
+		dir = opendir(hibernate_dir);
+		if (dir == NULL)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("Block Reader %d: could not open directory \"%s\": %m",
+							id, hibernate_dir)));
+
+		/*
+		 * Reset errno before making system call, so that we don't trip over an
+		 * error that occurred earlier.
+		 */
+		errno = 0;
+
+		/* Scan the directory looking for file this worker is assigned to. */
+		while ((dent = readdir(dir)) != NULL)
+		{
+			if (!parseSavefileName(dent->d_name, &filenum))
+				continue;
+
+			/* Stop if this is the file assigned to this worker. */
+			if (filenum == id)
+				break;
+		}
+
+		if (dent == NULL)
+		{
+			closedir(dir);
+
+			if (errno != 0)
+				ereport(ERROR,
+						(errcode_for_file_access(),
+						errmsg("Block Reader %d: encountered error during readdir \"%s\": %m",
+								id, hibernate_dir)));
+
+			ereport(ERROR,
+					(errmsg("Block Reader %d: could not find its save-file", id)));
+		}
+		closedir(dir);
+
+		/* We found the file we're supposed to restore. */
+
+		ReadBlocks(filenum, my_slot);
+
+		ReleaseReaderStats(true);
+		ReleaseRestoreSlot(my_slot, 1, true, true);
+		slot_detached = true;
+
+		ereport(LOG, (errmsg("Block Reader %d: all blocks read successfully", filenum)));
+
+		slotno = AwaitNextJob();
+	} while (slotno >= 0);
+
+	/*
+	 * Exit with non-zero status to ensure that this worker is not restarted.
+	 *
+	 * For any backend connected to shared-buffers, an exit code other than 0 or 1
+	 * causes a system-wide restart, so we have no choice but to use 1. Since an
+	 * ERROR also causes exit code 1, it would've been nice if we could use some
+	 * other code to signal normal exit, so that a monitor could differentiate
+	 * between a successful exit, and an exit due to an ERROR.
+	 *
+	 * To get around this ambiguity we resort to logging a message to server log;
+	 * this message should console the user that everything went okay, even though
+	 * the exit code is 1.
+	 */
+	proc_exit(1);
+}
+
+/*
+ * Wait for the BufferSaver to hand us another job; see IdleReader. Returns the
+ * slot of the job, or -1 if there's none for us.
+ */
+static int
+AwaitNextJob(void)
+{
+	IdleReader *entry = NULL;
+	int			slotno = IDLE_READER_RETIRE;
+	int			i;
+
+	if (got_sigterm)
+		return -1;
+
+	LWLockAcquire(shared_mem->lock, LW_EXCLUSIVE);
+
+	if (shared_mem->saver_latch != NULL)
+	{
+		for (i = 0; i < shared_mem->nslots; ++i)
+		{
+			if (shared_mem->idle_readers[i].pid == 0)
+			{
+				entry = &shared_mem->idle_readers[i];
+				entry->pid = MyProcPid;
+				entry->database = MyDatabaseId;
+				entry->latch = MyLatch;
+				entry->slotno = IDLE_READER_WAITING;
+				break;
+			}
+		}
+	}
+
+	LWLockRelease(shared_mem->lock);
+
+	if (entry == NULL)
+		return -1;
+
+	pgstat_report_activity(STATE_IDLE, "waiting for a save-file to restore");
+
+	/* We may have detached after the BufferSaver looked for idle readers. */
+	if (shared_mem->saver_latch)
+		SetLatch(shared_mem->saver_latch);
+
+	for (;;)
+	{
+		int		rc;
+		bool	done;
+
+		rc = WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+					   READER_IDLE_TIMEOUT_MS);
+		ResetLatch(MyLatch);
+
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+
+		/* A job handed to us just as we gave up waiting is still ours. */
+		LWLockAcquire(shared_mem->lock, LW_EXCLUSIVE);
+		slotno = entry->slotno;
+		done = (slotno != IDLE_READER_WAITING || got_sigterm || (rc & WL_TIMEOUT));
+		if (done)
+			entry->pid = 0;
+		LWLockRelease(shared_mem->lock);
+
+		if (done)
+			break;
+	}
+
+	return slotno >= 0 ? slotno : -1;
+}
+
+static void
+ReadBlocks(int filenum, RestoreSlot *slot)
+{
+	SavefileReader *reader;
+	char		record_type;
+	uint32		record_value;
+	char	   *dbname;
+	bool		global;
+	BlockNumber	record_blocknum	= InvalidBlockNumber;
+	BlockNumber	record_range;
+	uint32		usage			= 0;
+	int			level			= slot->level;
+
+	int			log_level		= DEBUG3;
+	bool		skip_block		= false;
+	BlockNumber	blocks_restored	= 0;
+	BlockNumber	blocks_reported	= 0;
+	BlockNumber	blocks_skipped	= 0;
+	BlockNumber	blocks_cached	= 0;
+	bool		cache_section	= false;
+	bool		restore_cache;
+	const char *filepath;
+	ReaderFork	fork;
+	WorkUnitClaim claim;
+	PrefetchQueue queue;
+	SegmentFile	segfile;
+
+	/*
+	 * If this condition changes, then this code, and the code in the writer
+	 * will need to be changed; especially the format specifiers in log and
+	 * error messages.
+	 */
+	StaticAssertStmt(MaxBlockNumber == 0xFFFFFFFE, "Code may need review.");
+
+	filepath = getSavefilePath(getSnapshotDirectory(slot->snapshot), filenum);
+	reader = savefileOpenRead(filepath);
+
+	/*
+	 * Skip the save-files we can't use. Returning normally lets the save-file
+	 * be removed, as there's no point in trying again at next startup.
+	 */
+	if (reader->version > SAVEFILE_VERSION)
+	{
+		ereport(WARNING,
+				(errmsg("Block Reader %d: skipping save-file of unsupported format version %u",
+						filenum, reader->version)));
+		savefileCloseRead(reader);
+		return;
+	}
+
+	if (reader->blcksz != BLCKSZ)
+	{
+		ereport(WARNING,
+				(errmsg("Block Reader %d: skipping save-file saved with block size %u",
+						filenum, reader->blcksz)));
+		savefileCloseRead(reader);
+		return;
+	}
+
+	if (reader->nbuffers > (uint32) NBuffers)
+		ereport(LOG,
+				(errmsg("Block Reader %d: save-file was saved with shared_buffers of %u blocks, now %d blocks; restoring at most %u blocks",
+						filenum, reader->nbuffers, NBuffers, RestoreBudget())));
+
+	dbname = reader->dbname;
+	my_stats->tablespace = reader->tablespace;
+
+	/*
+	 * The page cache section, if any, is restored by the save-file's coldest
+	 * job, i.e. after all the blocks of the save-file in shared buffers.
+	 */
+	restore_cache = (level == SAVEFILE_ALL_LEVELS);
+	if (!restore_cache)
+	{
+		int		i;
+
+		for (i = 0; i < SAVEFILE_USAGE_LEVELS; ++i)
+			if (reader->level_blocks[i] > 0)
+				break;
+
+		restore_cache = (i == level);
+	}
+
+	/* Let pg_hibernator_progress know what we're up to. */
+	if (reader->version >= 3)
+	{
+		int		i;
+
+		for (i = 0; i < SAVEFILE_USAGE_LEVELS; ++i)
+			if (level == SAVEFILE_ALL_LEVELS || level == i)
+				my_stats->blocks_planned += reader->level_blocks[i];
+	}
+
+	fork.tablespace		= reader->tablespace;
+	fork.filenode		= InvalidOid;
+	fork.forknum		= InvalidForkNumber;
+	fork.rel_checked	= false;
+	fork.fork_checked	= false;
+	fork.rel			= NULL;
+	fork.fork_exists	= false;
+	fork.nblocks		= 0;
+	fork.block_records	= 0;
+	blocks_resident		= 0;
+
+	/* Claim our first work unit; see WorkUnitClaim. */
+	claim.next_unit	= &slot->next_unit;
+	claim.nunits	= 0;
+	claim.claimed	= pg_atomic_fetch_add_u32(claim.next_unit, 1);
+	claim.chunk		= InvalidBlockNumber;
+	claim.owned		= false;
+
+	queue.size	= guc_prefetch_distance;
+	queue.head	= 0;
+	queue.count	= 0;
+	queue.blocks = queue.size > 0 ? palloc(sizeof(BlockNumber) * queue.size) : NULL;
+	segfile.fd	= -1;
+
+	/*
+	 * When restoring global objects, the database is InvalidOid, and the dbname
+	 * is zero-length string. Otherwise save-files of version 6 and later name
+	 * the database by OID, and older ones by name. That, not the number of the
+	 * save-file, tells them apart: a save of the sampled working set may have
+	 * no global objects, and then save-file 1 is that of a database.
+	 */
+	Assert(filenum >= 1);
+	global = (reader->database == InvalidOid && dbname[0] == '\0');
+
+	/*
+	 * To restore the global objects, use default database. A reader handed
+	 * another job stays connected; see IdleReader.
+	 */
+	if (reader_connected)
+	{
+		if (!global && reader->database != MyDatabaseId)
+			ereport(ERROR,
+					(errmsg("Block Reader %d: save-file of database %u handed to a reader connected to database %u",
+							filenum, reader->database, MyDatabaseId)));
+	}
+	else if (global)
+		BackgroundWorkerInitializeConnection(guc_default_database, NULL);
+	else if (reader->database != InvalidOid)
+		BackgroundWorkerInitializeConnectionByOid(reader->database, InvalidOid);
+	else
+		BackgroundWorkerInitializeConnection(dbname, NULL);
+
+	reader_connected = true;
+
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+	SPI_connect();
+	PushActiveSnapshot(GetTransactionSnapshot());
+	pgstat_report_activity(STATE_RUNNING, "restoring buffers");
+
+	if (reader->database != InvalidOid)
+	{
+		char   *name = get_database_name(MyDatabaseId);
+
+		if (name != NULL)
+			strlcpy(my_stats->database, name, sizeof(my_stats->database));
+	}
+	else
+		strlcpy(my_stats->database, dbname, sizeof(my_stats->database));
+
+	/*
+	 * Note that in case of a read error, we will leak relcache entry that we may
+	 * currently have open. In case of EOF, we close the relation after the loop.
+	 */
+	while (savefileReadRecord(reader, &record_type, &record_value))
+	{
+		/*
+		 * If we want to process the signals, this seems to be the best place
+		 * to do it. Generally the backends refrain from processing config file
+		 * while in transaction, but that's more for the fear of allowing GUC
+		 * changes to affect expression evaluation, causing different results
+		 * for the same expression in a transaction. Since this worker is not
+		 * processing any queries, it is okay to process the config file here.
+		 *
+		 * Doing so lets the DBA change the rate limit of a restore in progress,
+		 * e.g. once the server starts serving traffic.
+		 */
+		if (got_sighup)
+		{
+			got_sighup = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		/* Stop processing the save-file if the Postmaster wants us to die. */
+		if (got_sigterm)
+			break;
+
+		/* Leave the page cache section to another job; see above. */
+		if (cache_section && !restore_cache)
+			break;
+
+		/*
+		 * Publish our progress every now and then, and stop once the readers
+		 * have restored as many blocks as the budget allows.
+		 */
+		if (blocks_restored - blocks_reported >= BLOCKS_PER_WORK_UNIT)
+		{
+			pg_atomic_fetch_add_u32(&slot->blocks_restored, blocks_restored - blocks_reported);
+			blocks_reported = blocks_restored;
+
+			my_stats->blocks_read = blocks_restored;
+			my_stats->blocks_skipped = blocks_skipped;
+
+			if (RestoreBudgetExhausted())
+			{
+				ereport(LOG,
+						(errmsg("Block Reader %d: restore budget of %u blocks used up, skipping the rest of the save-file",
+								filenum, RestoreBudget())));
+				break;
+			}
+		}
+
+		ereport(log_level,
+				(errmsg("record type %x - %c", record_type, record_type)));
+
+		switch (record_type)
+		{
+			case 'r':
+			{
+				/* Close the previous relation, if any. */
+				if (fork.rel)
+				{
+					blocks_restored += DrainPrefetchQueue(&queue, fork.rel, fork.forknum);
+					CloseSegmentFile(&segfile);
+					relation_close(fork.rel, AccessShareLock);
+					fork.rel = NULL;
+				}
+
+				fork.filenode = (Oid) record_value;
+
+				/*
+				 * The relation is looked up when we come across the first block
+				 * we've claimed; see PrepareFork().
+				 */
+				fork.forknum		= InvalidForkNumber;
+				fork.rel_checked	= false;
+				fork.fork_checked	= false;
+				fork.block_records	= 0;
+				record_blocknum		= InvalidBlockNumber;
+				claim.chunk			= InvalidBlockNumber;
+			}
+			break;
+			case 'f':
+			{
+				/* Finish reading the blocks of the previous fork, if any. */
+				if (fork.rel)
+					blocks_restored += DrainPrefetchQueue(&queue, fork.rel, fork.forknum);
+
+				fork.forknum = (ForkNumber) record_value;
+
+				if (fork.filenode == InvalidOid)
+					ereport(ERROR,
+							(errmsg("found a fork record without a preceeding relation record")));
+
+				fork.fork_checked	= false;
+				fork.block_records	= 0;
+				record_blocknum		= InvalidBlockNumber;
+				claim.chunk			= InvalidBlockNumber;
+			}
+			break;
+			case 'u':
+			{
+				usage = record_value;
+			}
+			break;
+			case 'c':
+			{
+				/* Done with the blocks in shared buffers; see the save-file format. */
+				if (fork.rel)
+				{
+					blocks_restored += DrainPrefetchQueue(&queue, fork.rel, fork.forknum);
+					CloseSegmentFile(&segfile);
+					relation_close(fork.rel, AccessShareLock);
+					fork.rel = NULL;
+				}
+
+				cache_section		= true;
+				fork.filenode		= InvalidOid;
+				fork.forknum		= InvalidForkNumber;
+				record_blocknum		= InvalidBlockNumber;
+				claim.chunk			= InvalidBlockNumber;
+			}
+			break;
+			case 'b':
+			{
+				if (fork.forknum == InvalidForkNumber)
+					ereport(ERROR,
+							(errmsg("found a block record without a preceeding fork record")));
+
+				record_blocknum = (BlockNumber) record_value;
+				++fork.block_records;
+
+				skip_block = false;
+
+				/*
+				 * Leave the blocks of other usage counts to the other jobs. All
+				 * the readers of the slot skip the same blocks here, so they
+				 * still agree on the work units. The page cache section has no
+				 * usage counts.
+				 */
+				if (!cache_section && level >= 0 && usage != level)
+					continue;
+
+				if (!ClaimBlock(&claim, record_blocknum))
+					continue;
+
+				if (!PrepareFork(&fork))
+				{
+					++blocks_skipped;
+					continue;
+				}
+
+				if (!cache_section &&
+					!WantFork(&fork, level, slot->structure_first, &blocks_restored))
+					continue;
+
+				/*
+				 * Don't try to read past the file; the file may have been shrunk
+				 * by a vaccum/truncate operation.
+				 */
+				if (record_blocknum >= fork.nblocks)
+				{
+					ereport(log_level,
+							(errmsg("reader %d skipping block filenode %u forknum %d blocknum %u",
+									filenum, fork.filenode, fork.forknum, record_blocknum)));
+
+					skip_block = true;
+					++blocks_skipped;
+					continue;
+				}
+				else
+				{
+					ereport(log_level,
+							(errmsg("reader %d reading block filenode %u forknum %d blocknum %u",
+									filenum, fork.filenode, fork.forknum, record_blocknum)));
+
+					if (cache_section)
+					{
+						PrefetchRange(&segfile, fork.rel, fork.forknum, record_blocknum, 1);
+						++blocks_cached;
+					}
+					else
+						blocks_restored += QueueBlock(&queue, fork.rel, fork.forknum, record_blocknum, true);
+				}
+			}
+			break;
+			case 'N':
+			{
+				BlockNumber block;
+				BlockNumber	first_block;
+				BlockNumber	last_block;
+
+				Assert(record_blocknum != InvalidBlockNumber);
+
+				if (record_blocknum == InvalidBlockNumber)
+					ereport(ERROR,
+							(errmsg("found a block range record without a preceeding block record")));
+
+				record_range = (BlockNumber) record_value;
+				++fork.block_records;
+
+				/* A range has the usage count of its 'b' record; see above. */
+				if (!cache_section && level >= 0 && usage != level)
+					continue;
+
+				first_block = record_blocknum + 1;
+				last_block = record_blocknum + record_range;
+
+				/*
+				 * Walk the range one work unit at a time. Note that we can't
+				 * bail out of this loop early; see WorkUnitClaim.
+				 */
+				block = first_block;
+				while (block <= last_block)
+				{
+					BlockNumber	unit_last;
+
+					/* The last block of this chunk; wraps around for the last chunk. */
+					unit_last = (block / BLOCKS_PER_WORK_UNIT + 1) * BLOCKS_PER_WORK_UNIT - 1;
+					unit_last = Min(unit_last, last_block);
+
+					if (!ClaimBlock(&claim, block))
+						;	/* Another reader's unit */
+					else if (skip_block || !PrepareFork(&fork))
+						blocks_skipped += unit_last - block + 1;
+					else if (!cache_section &&
+							 !WantFork(&fork, level, slot->structure_first, &blocks_restored))
+						;	/* Another job's blocks */
+					else
+					{
+						/*
+						 * Don't try to read past the file; the file may have been
+						 * shrunk by a vaccum operation.
+						 */
+						if (unit_last >= fork.nblocks)
+						{
+							ereport(log_level,
+									(errmsg("reader %d skipping block range filenode %u forknum %d start %u end %u",
+											filenum, fork.filenode, fork.forknum,
+											Max(block, fork.nblocks), unit_last)));
+
+							blocks_skipped += unit_last - Max(block, fork.nblocks) + 1;
+						}
+
+						if (block < fork.nblocks)
+						{
+							ereport(log_level,
+									(errmsg("reader %d reading range filenode %u forknum %d blocknum %u end %u",
+											filenum, fork.filenode, fork.forknum, block,
+											Min(unit_last, fork.nblocks - 1))));
+
+							if (cache_section)
+							{
+								BlockNumber	count = Min(unit_last, fork.nblocks - 1) - block + 1;
+
+								PrefetchRange(&segfile, fork.rel, fork.forknum, block, count);
+								blocks_cached += count;
+							}
+							else
+								blocks_restored += RestoreRange(&queue, &segfile, fork.rel, fork.forknum,
+																block, Min(unit_last, fork.nblocks - 1));
+						}
+					}
+
+					if (unit_last == last_block)
+						break;
+
+					block = unit_last + 1;
+				}
+			}
+			break;
+			default:
+			{
+				ereport(ERROR,
+						(errmsg("found unexpected save-file marker %x - %c)", record_type, record_type)));
+				Assert(false);
+			}
+			break;
+		}
+	}
+
+	if (fork.rel)
+	{
+		/*
+		 * Finish reading the blocks we've prefetched, unless we've been asked
+		 * to stop; an outstanding prefetch request does no harm.
+		 */
+		if (!got_sigterm && !RestoreBudgetExhausted())
+			blocks_restored += DrainPrefetchQueue(&queue, fork.rel, fork.forknum);
+
+		CloseSegmentFile(&segfile);
+		relation_close(fork.rel, AccessShareLock);
+	}
+
+	if (queue.blocks)
+		pfree(queue.blocks);
+
+	pg_atomic_fetch_add_u32(&slot->blocks_restored, blocks_restored - blocks_reported);
+
+	my_stats->blocks_read = blocks_restored;
+	my_stats->blocks_skipped = blocks_skipped;
+	my_stats->current_relid = InvalidOid;
+
+	if (level == SAVEFILE_ALL_LEVELS)
+		ereport(LOG,
+				(errmsg("Block Reader %d: restored %u blocks",
+						filenum, blocks_restored)));
+	else if (level == SAVEFILE_STRUCTURE_LEVEL)
+		ereport(LOG,
+				(errmsg("Block Reader %d: restored %u blocks of catalogs, maps and index upper levels",
+						filenum, blocks_restored)));
+	else
+		ereport(LOG,
+				(errmsg("Block Reader %d: restored %u blocks of usage count %d",
+						filenum, blocks_restored, level)));
+
+	if (blocks_resident > 0)
+		ereport(LOG,
+				(errmsg("Block Reader %d: skipped %u blocks that were in shared buffers already",
+						filenum, blocks_resident)));
+
+	if (blocks_cached > 0)
+		ereport(LOG,
+				(errmsg("Block Reader %d: asked the kernel to read ahead %u blocks that were in the page cache",
+						filenum, blocks_cached)));
+
+	/* The map was built in this job's snapshot; see GetRelOid(). */
+	if (filenode_map)
+	{
+		hash_destroy(filenode_map);
+		filenode_map = NULL;
+	}
+
+	SPI_finish();
+	PopActiveSnapshot();
+	CommitTransactionCommand();
+	pgstat_report_activity(STATE_IDLE, NULL);
+
+	savefileCloseRead(reader);
+}
+
+static void
+BufferSaverMain(Datum main_arg)
+{
+	TimestampTz	last_save_time;
+	TimestampTz	last_sample_check;
+
+	WorkerCommon();
+
+	slot_handles = (List **) MemoryContextAllocZero(TopMemoryContext,
+												sizeof(List *) * shared_mem->nslots);
+	slot_jobs = (RestoreJob *) MemoryContextAllocZero(TopMemoryContext,
+												sizeof(RestoreJob) * shared_mem->nslots);
+
+	/*
+	 * Let the BlockReaders wake us up when they exit, and the backends when they
+	 * make a request. A request outstanding at this point was being served by
+	 * our previous incarnation, which died before it could complete it.
+	 */
+	LWLockAcquire(shared_mem->lock, LW_EXCLUSIVE);
+	shared_mem->saver_latch = &MyProc->procLatch;
+	LWLockRelease(shared_mem->lock);
+	before_shmem_exit(BufferSaverExit, (Datum) 0);
+
+	CompleteRequest(-1);
+	ReleaseUnstartedReaders();
+
+	/* Don't create BlockReaders if the extension is disabled. */
+	if (guc_enabled)
+		RegisterBlockReaders("");
+
+	last_save_time = GetCurrentTimestamp();
+	last_sample_check = last_save_time;
+
+	/*
+	 * Main loop: do this until the SIGTERM handler tells us to terminate
+	 */
+	while (!got_sigterm)
+	{
+		int		rc;
+		long	timeout = 10 * 1000L;
+
+		ResetLatch(&MyProc->procLatch);
+		ServeRequest();
+		DispatchBlockReaders();
+		RetireIdleReaders();
+
+		/*
+		 * Sample the buffers periodically, if asked to, to follow the working
+		 * set over time; see SampleBuffers(). The blocks the BlockReaders are
+		 * restoring say nothing about the workload, so we don't sample while
+		 * they are at it.
+		 */
+		if (guc_enabled && guc_sample_interval > 0)
+		{
+			TimestampTz	now = GetCurrentTimestamp();
+			TimestampTz	next_sample_time;
+
+			next_sample_time = TimestampTzPlusMilliseconds(last_sample_check,
+														guc_sample_interval * 1000L);
+
+			if (now >= next_sample_time)
+			{
+				if (!RestoreInProgress())
+					SampleBuffers();
+
+				last_sample_check = now;
+			}
+			else
+			{
+				long	secs;
+				int		usecs;
+
+				TimestampDifference(now, next_sample_time, &secs, &usecs);
+				timeout = Min(timeout, secs * 1000L + usecs / 1000 + 1);
+			}
+		}
+
+		/*
+		 * Save the buffers periodically, if asked to, so that we have a recent
+		 * list to restore from even if the server crashes. We don't save while
+		 * the save-files are still being restored, since the new save-files
+		 * would take the place of the ones being read.
+		 */
+		if (guc_enabled && guc_save_interval > 0)
+		{
+			TimestampTz	now = GetCurrentTimestamp();
+			TimestampTz	next_save_time;
+
+			next_save_time = TimestampTzPlusMilliseconds(last_save_time,
+														guc_save_interval * 1000L);
+
+			if (now >= next_save_time)
+			{
+				if (!RestoreInProgress())
+				{
+					SaveBuffers("", guc_publish_snapshot);
+				}
+
+				last_save_time = now;
+			}
+			else
+			{
+				long	secs;
+				int		usecs;
+
+				TimestampDifference(now, next_save_time, &secs, &usecs);
+				timeout = Min(timeout, secs * 1000L + usecs / 1000 + 1);
+			}
+		}
+
+		/* Prewarm toward the snapshot published by the primary. */
+		if (guc_enabled && guc_follow_snapshot[0] != '\0' && RecoveryInProgress())
+			timeout = Min(timeout, FollowSnapshot());
+
+		/*
+		 * Wait on the process latch, which sleeps as necessary, but is awakened
+		 * if postmaster dies. This way the background process goes away
+		 * immediately in case of an emergency.
+		 *
+		 * The BlockReaders set our latch when they exit, and the postmaster
+		 * sends us SIGUSR1 when they start or stop, so the timeout is only a
+		 * safety net.
+		 */
+		rc = WaitLatch(&MyProc->procLatch,
+					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+					   timeout);
+
+		/* emergency bailout if postmaster has died */
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+
+		/*
+		 * In case of a SIGHUP, just reload the configuration.
+		 */
+		if (got_sighup)
+		{
+			got_sighup = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+	}
+
+	/*
+	 * We recieved the SIGTERM; Shutdown is in progress, so save the
+	 * shared-buffer contents.
+	 */
+
+	/* Save the buffers only if the extension is enabled. */
+	if (guc_enabled)
+	{
+		/* Publish the final list too, so that a switchover lands on it. */
+		SaveBuffers("", guc_publish_snapshot);
+	}
+
+	/*
+	 * The worker exits here. A proc_exit(0) is not necessary, we'll let the
+	 * caller do that.
+	 */
+}
+
+/*
+ * Save the list of blocks in shared buffers to the snapshot's directory; see
+ * getSnapshotDirectory(). Unless 'publish' is empty, the same list is saved as
+ * that snapshot too. Returns the number of blocks saved.
+ */
+static int
+SaveBuffers(const char *snapshot, const char *publish)
+{
+	int						i;
+	int						num_buffers;
+	SavedBuffer			   *saved_buffers	= NULL;
+	int						database_counter= 0;	/* actually, save-file counter */
+	int						ndatabases		= 0;
+	TimestampTz				save_start;
+	TimestampTz				scan_end;
+	TimestampTz				sort_end;
+	double					scan_ms;
+	double					sort_ms;
+	double					fsync_ms		= 0;
+	SaveStats			   *stats;
+	int						comp_level		= got_sigterm ? LOG : DEBUG1;
+	char					dir[MAXPGPATH];
+	bool					delta			= false;
+	bool					chunked;
+	bool					working_set;
+	uint64					generation		= 0;
+
+	strlcpy(dir, getSnapshotDirectory(snapshot), sizeof(dir));
+
+	/* The directory of the shutdown save-files is created by _PG_init(). */
+	if (snapshot[0] != '\0' && mkdir(dir, S_IRWXU) != 0 && errno != EEXIST)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				errmsg("could not create directory \"%s\": %m", dir)));
+
+	/* A full save starts a new generation of save-files; see WriteSaveGeneration(). */
+	(void) ReadSaveGeneration(dir, &generation);
+	++generation;
+
+	/* Put together in local memory, and then copied to shared memory in one go */
+	stats = (SaveStats *) palloc0(sizeof(SaveStats));
+	save_start = GetCurrentTimestamp();
+
+	/*
+	 * With pg_hibernator.save_working_set, save the blocks that the samples
+	 * found hot, rather than those in shared buffers just now; see
+	 * CollectWorkingSet().
+	 */
+	working_set = guc_save_working_set && hot_ranges != NULL;
+
+	/*
+	 * If the list of all the buffers wouldn't fit in the memory we may use,
+	 * save it in chunks instead; see SaveBuffersChunked(). That can't keep
+	 * the list for the delta saves, so the next periodic save is a full one.
+	 */
+	chunked = !working_set && guc_save_memory_limit > 0
+		&& (Size) NBuffers * sizeof(SavedBuffer) > (Size) guc_save_memory_limit * 1024;
+
+	if (chunked)
+	{
+		ChunkedSave	cs;
+
+		pgstat_report_activity(STATE_RUNNING, "saving buffers");
+
+		if (snapshot[0] == '\0')
+		{
+			DiscardDeltaBase();
+			RemoveDeltaFiles(dir);
+		}
+
+		memset(&cs, 0, sizeof(cs));
+		cs.dir = dir;
+		cs.stats = stats;
+		cs.generation = generation;
+
+		num_buffers = SaveBuffersChunked(&cs);
+
+		database_counter = cs.ngroups;
+		ndatabases = cs.ndatabases;
+		scan_ms = cs.scan_ms;
+		sort_ms = cs.sort_ms;
+		fsync_ms = cs.fsync_ms;
+	}
+	else
+	{
+		int		max_buffers = NBuffers;
+
+		/*
+		 * The working set isn't saved in chunks, so the memory limit caps the
+		 * number of its blocks instead; the coldest are left out.
+		 */
+		if (working_set && guc_save_memory_limit > 0)
+			max_buffers = (int) Min((Size) NBuffers,
+									(Size) guc_save_memory_limit * 1024 / sizeof(SavedBuffer));
+
+		/* Only a packed copy is kept after a full save; see KeepDeltaBase(). */
+		saved_buffers = (SavedBuffer *) MemoryContextAllocHuge(CurrentMemoryContext,
+															   sizeof(SavedBuffer) * max_buffers);
+
+		if (working_set)
+			num_buffers = CollectWorkingSet(saved_buffers, max_buffers);
+		else
+		{
+			BeginBufferScan();
+
+			for (num_buffers = 0, i = 0; i < NBuffers; ++i)
+				if (ScanBuffer(i, &saved_buffers[num_buffers]))
+					++num_buffers;
+
+			EndBufferScan();
+		}
+
+		/*
+		 * Sort the list, so that we can optimize the storage of these buffers.
+		 *
+		 * The side-effect of this storage optimization is that when reading
+		 * the blocks back from relation forks, it leads to sequential reads,
+		 * which improve the restore speeds quite considerably as compared to
+		 * random reads from different blocks all over the data directory.
+		 */
+		scan_end = GetCurrentTimestamp();
+		num_buffers = SortSavedBuffers(saved_buffers, num_buffers);
+		sort_end = GetCurrentTimestamp();
+
+		scan_ms = ElapsedMs(save_start, scan_end);
+		sort_ms = ElapsedMs(scan_end, sort_end);
+	}
+
+	/*
+	 * The save-files name their databases by OID, and the BlockReaders resolve
+	 * them, so from here on it's just writing out the list; no catalog access,
+	 * which could block, or fail, at shutdown.
+	 */
+	pgstat_report_activity(STATE_RUNNING, "saving buffers");
+
+	/*
+	 * A periodic save may get away with writing only what has changed. A full
+	 * save replaces the save-files the delta files apply to, so it removes them
+	 * before it touches any save-file.
+	 */
+	if (snapshot[0] == '\0' && !chunked)
+	{
+		delta = SaveDelta(dir, saved_buffers, num_buffers, stats, &ndatabases, &fsync_ms);
+
+		if (!delta)
+			RemoveDeltaFiles(dir);
+	}
+
+	if (!delta && !chunked)
+		database_counter = WriteSavefiles(dir, saved_buffers, num_buffers, generation,
+										  stats, &ndatabases, &fsync_ms);
+
+	stats->end_time			= GetCurrentTimestamp();
+	stats->num_buffers		= num_buffers;
+	stats->num_databases	= ndatabases;
+	stats->scan_ms			= scan_ms;
+	stats->sort_ms			= sort_ms;
+	stats->fsync_ms			= fsync_ms;
+	stats->total_ms			= ElapsedMs(save_start, stats->end_time);
+	stats->write_ms			= stats->total_ms - scan_ms - sort_ms - fsync_ms;
+
+	ereport(LOG,
+			(errmsg("Buffer Saver: saved metadata of %d blocks of %d databases in %.3f ms",
+					num_buffers, ndatabases, stats->total_ms),
+			 errdetail("scan %.3f ms, sort %.3f ms, write %.3f ms, fsync %.3f ms",
+					   stats->scan_ms, stats->sort_ms, stats->write_ms,
+					   stats->fsync_ms)));
+
+	for (i = 0; i < stats->ncomposition; ++i)
+	{
+		DatabaseComposition *c = &stats->composition[i];
+		char		name[32];
+
+		if (stats->overflow && i == stats->ncomposition - 1)
+			strlcpy(name, "(other databases)", sizeof(name));
+		else if (c->database == InvalidOid)
+			strlcpy(name, "(global objects)", sizeof(name));
+		else
+			snprintf(name, sizeof(name), "database %u", c->database);
+
+		ereport(comp_level,
+				(errmsg("Buffer Saver: saved %u main, %u fsm, %u vm, %u init blocks of %s",
+						c->blocks[MAIN_FORKNUM], c->blocks[FSM_FORKNUM],
+						c->blocks[VISIBILITYMAP_FORKNUM], c->blocks[INIT_FORKNUM],
+						name)));
+	}
+
+	LWLockAcquire(shared_mem->lock, LW_EXCLUSIVE);
+	memcpy(&shared_mem->last_save, stats, sizeof(SaveStats));
+	LWLockRelease(shared_mem->lock);
+
+	pfree(stats);
+
+	/*
+	 * Remove the save-files of the databases that we didn't see this time, and
+	 * then commit the save.
+	 */
+	if (!delta)
+	{
+		RemoveStaleSavefiles(dir, database_counter);
+		WriteSaveGeneration(dir, generation);
+	}
+
+	/*
+	 * Publish the same list for the standbys. A chunked save never has all of
+	 * it in memory, so that takes a save of its own.
+	 */
+	if (publish[0] != '\0')
+	{
+		if (saved_buffers != NULL)
+			PublishSnapshot(publish, saved_buffers, num_buffers);
+		else
+			SaveBuffers(publish, "");
+	}
+
+	/* The delta saves to come are computed against the last full save. */
+	if (snapshot[0] == '\0' && !delta && !chunked && guc_max_delta_saves > 0)
+	{
+		DiscardDeltaBase();
+		KeepDeltaBase(saved_buffers, num_buffers);
+	}
+	else if (snapshot[0] == '\0' && guc_max_delta_saves == 0)
+		DiscardDeltaBase();
+
+	if (saved_buffers != NULL)
+		pfree(saved_buffers);
+
+	pgstat_report_activity(STATE_IDLE, NULL);
+
+	return num_buffers;
+}
+
+/*
+ * Save the list of blocks that a save has built as the snapshot too, replacing
+ * its earlier save-files like a full save does; see
+ * pg_hibernator.publish_snapshot.
+ */
+static void
+PublishSnapshot(const char *snapshot, SavedBuffer *buffers, int num_buffers)
+{
+	char		dir[MAXPGPATH];
+	uint64		generation = 0;
+	int			nfiles;
+	double		fsync_ms = 0;
+
+	strlcpy(dir, getSnapshotDirectory(snapshot), sizeof(dir));
+
+	if (mkdir(dir, S_IRWXU) != 0 && errno != EEXIST)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				errmsg("could not create directory \"%s\": %m", dir)));
+
+	(void) ReadSaveGeneration(dir, &generation);
+	++generation;
+
+	nfiles = WriteSavefiles(dir, buffers, num_buffers, generation, NULL, NULL, &fsync_ms);
+	RemoveStaleSavefiles(dir, nfiles);
+	WriteSaveGeneration(dir, generation);
+
+	ereport(DEBUG1,
+			(errmsg("Buffer Saver: published %d blocks as snapshot \"%s\"",
+					num_buffers, snapshot)));
+}
+
+/*
+ * Write the sorted list of buffers out to the directory, one save-file per
+ * database and tablespace, of the given generation; see WriteSaveGeneration().
+ * Returns the number of save-files written. Unless stats is NULL, the blocks
+ * are added to its composition, and the databases counted in *ndatabases.
+ */
+static int
+WriteSavefiles(const char *dir, SavedBuffer *saved_buffers, int num_buffers,
+			   uint64 generation, SaveStats *stats, int *ndatabases, double *fsync_ms)
+{
+	int						i;
+	int						log_level		= DEBUG3;
+	SavefileWriter		   *writer			= NULL;
+	int						database_counter= 0;	/* actually, save-file counter */
+	Oid						prev_database	= InvalidOid;
+	Oid						prev_tablespace	= InvalidOid;
+	Oid						prev_filenode	= InvalidOid;
+	ForkNumber				prev_forknum	= InvalidForkNumber;
+	BlockNumber				prev_blocknum	= InvalidBlockNumber;
+	BlockNumber				range_counter	= 0;
+	TimestampTz				fsync_start;
+	DatabaseComposition	   *comp			= NULL;
+
+	for (i = 0; i < num_buffers; ++i)
+	{
+		int j;
+		SavedBuffer *buf = &saved_buffers[i];
+
+		if (i == 0 || buf->database != prev_database || buf->tablespace != prev_tablespace)
+		{
+			/*
+			 * We are beginning to process a different database, or tablespace,
+			 * than the previous one; close the save-file of previous one, and
+			 * open a new one. A save-file per tablespace lets the BufferSaver
+			 * spread the restore across tablespaces; see DispatchBlockReaders().
+			 *
+			 * The sort brings the global objects to the front, so they usually
+			 * go to save-file 1; but a sampled working set may have none. The
+			 * header names the database, so nothing relies on the numbering;
+			 * see ReadBlocks().
+			 */
+			++database_counter;
+
+			if ((i == 0 || buf->database != prev_database) && stats != NULL)
+			{
+				comp = AddDatabaseComposition(stats, buf->database);
+				++*ndatabases;
+			}
+
+			if (writer != NULL)
+			{
+				if (guc_save_page_cache)
+					SavePageCache(writer, prev_database, prev_tablespace);
+
+				fsync_start = GetCurrentTimestamp();
+				savefileCloseWrite(writer);
+				PublishSavefile(dir, database_counter - 1);
+				*fsync_ms += ElapsedMs(fsync_start, GetCurrentTimestamp());
+			}
+
+			writer = savefileOpenWrite(getTempSavefilePath(dir, database_counter),
+									   buf->database, buf->tablespace, generation);
+
+			/* Reset trackers appropriately */
+			prev_database	= buf->database;
+			prev_tablespace	= buf->tablespace;
+			prev_filenode	= InvalidOid;
+			prev_forknum	= InvalidForkNumber;
+			prev_blocknum	= InvalidBlockNumber;
+			range_counter	= 0;
+		}
+
+		if (buf->filenode != prev_filenode)
+		{
+			/* We're beginning to process a new relation; emit a record for it. */
+			savefileWriteRelation(writer, buf->filenode);
+
+			/* Reset trackers appropriately */
+			prev_filenode	= buf->filenode;
+			prev_forknum	= InvalidForkNumber;
+			prev_blocknum	= InvalidBlockNumber;
+			range_counter	= 0;
+		}
+
+		if (buf->forknum != prev_forknum)
+		{
+			/*
+			 * We're beginning to process a new fork of this relation; add a
+			 * record for it.
+			 */
+			savefileWriteFork(writer, buf->forknum);
+
+			/* Reset trackers appropriately */
+			prev_forknum	= buf->forknum;
+			prev_blocknum	= InvalidBlockNumber;
+			range_counter	= 0;
+		}
+
+		ereport(log_level,
+				(errmsg("writer: writing block db %d filenode %d forknum %d blocknum %d",
+						database_counter, prev_filenode, prev_forknum, buf->blocknum)));
+
+		prev_blocknum = buf->blocknum;
+
+		/*
+		 * If a continuous range of blocks of the same usage count follows this
+		 * block, then emit one entry for the range, instead of one for each
+		 * block.
+		 */
+		range_counter = 0;
+
+		for ( j = i+1; j < num_buffers; ++j)
+		{
+			SavedBuffer *tmp = &saved_buffers[j];
+
+			if (tmp->database		== prev_database
+				&& tmp->tablespace	== prev_tablespace
+				&& tmp->filenode	== prev_filenode
+				&& tmp->forknum		== prev_forknum
+				&& tmp->blocknum	== (prev_blocknum + range_counter + 1)
+				&& tmp->usage		== buf->usage)
+			{
+				++range_counter;
+			}
+			else
+			{
+				break;
+			}
+		}
+
+		if (range_counter != 0)
+			ereport(log_level,
+				(errmsg("writer: writing range db %d filenode %d forknum %d blocknum %d range %d",
+						database_counter, prev_filenode, prev_forknum, prev_blocknum, range_counter)));
+
+		savefileWriteBlocks(writer, prev_blocknum, range_counter, buf->usage);
+
+		if (comp != NULL)
+			comp->blocks[buf->forknum] += range_counter + 1;
+
+		i += range_counter;
+	}
+
+	if (writer != NULL)
+	{
+		if (guc_save_page_cache)
+			SavePageCache(writer, prev_database, prev_tablespace);
+
+		fsync_start = GetCurrentTimestamp();
+		savefileCloseWrite(writer);
+		PublishSavefile(dir, database_counter);
+		*fsync_ms += ElapsedMs(fsync_start, GetCurrentTimestamp());
+	}
+
+	return database_counter;
+}
+
+/*
+ * Lock the buffer mapping partitions for a scan of the buffer headers, unless
+ * the scan is lockless; see ScanBuffer().
+ */
+static void
+BeginBufferScan(void)
+{
+	int		i;
+
+	if (guc_lockless_scan)
+		return;
+
+	for (i = 0; i < NUM_BUFFER_PARTITIONS; ++i)
+		LWLockAcquire(BufMappingPartitionLockByIndex(i), LW_SHARED);
+}
+
+static void
+EndBufferScan(void)
+{
+	int		i;
+
+	if (guc_lockless_scan)
+		return;
+
+	/* Unlock the buffer partitions in reverse order, to avoid a deadlock. */
+	for (i = NUM_BUFFER_PARTITIONS - 1; i >= 0; --i)
+		LWLockRelease(BufMappingPartitionLockByIndex(i));
+}
+
+/*
+ * Fill in *buf from the buffer's header. Returns false if the buffer doesn't
+ * hold a valid block.
+ *
+ * With pg_hibernator.lockless_scan, that's without holding the buffer mapping
+ * locks, or the buffer header lock, so that we don't hold up the buffer
+ * replacement while we scan; see ReadBufferTagLockless(). Otherwise the caller
+ * holds the buffer mapping locks; see BeginBufferScan().
+ */
+static inline bool
+ScanBuffer(int buf_id, SavedBuffer *buf)
+{
+	BufferDesc *bufHdr = &BufferDescriptors[buf_id].bufferdesc;
+	BufferTag	tag;
+	uint32		bufstate;
+
+	if (guc_lockless_scan)
+	{
+		if (!ReadBufferTagLockless(bufHdr, &tag, &bufstate))
+			return false;
+	}
+	else
+	{
+		/* Lock each buffer header before inspecting. */
+		bufstate = LockBufHdr(bufHdr);
+		tag = bufHdr->tag;
+		UnlockBufHdr(bufHdr, bufstate);
+
+		if (!(bufstate & BM_VALID) || !(bufstate & BM_TAG_VALID))
+			return false;
+	}
+
+	buf->database	= tag.rnode.dbNode;
+	buf->tablespace	= tag.rnode.spcNode;
+	buf->filenode	= tag.rnode.relNode;
+	buf->forknum	= tag.forkNum;
+	buf->blocknum	= tag.blockNum;
+	buf->usage		= BUF_STATE_GET_USAGECOUNT(bufstate);
+
+	return true;
+}
+
+/*
+ * Take a sample of shared buffers, for pg_hibernator.save_working_set, and add
+ * the usage counts of their blocks to the hotness of the blocks' ranges.
+ *
+ * What is in shared buffers at any one time, at shutdown say, often says more
+ * about the last maintenance job, a VACUUM or a pg_dump, than about the
+ * workload. Hooking the buffer accesses would cost every backend on every
+ * read, so instead we look at the buffer headers every
+ * pg_hibernator.sample_interval. Each sample adds the usage count, plus one,
+ * of every block to the hotness of its range, and the hotness decays with a
+ * half-life of pg_hibernator.sample_half_life; so a range that has been in
+ * use all day outweighs one that a sequential scan went through an hour ago.
+ * The masks of a range remember which of its blocks the samples came across,
+ * in the current generation, of a half-life, and the one before it; a range
+ * none of whose blocks have been seen for that long is dropped.
+ *
+ * A sample needn't be exact, so the scan is always lockless; see
+ * ReadBufferTagLockless(). There are at most as many ranges as shared
+ * buffers; past that, the blocks of ranges we don't have yet are left out,
+ * until old ranges are dropped.
+ */
+static void
+SampleBuffers(void)
+{
+	TimestampTz		start = GetCurrentTimestamp();
+	double			decay = 1.0;
+	HotRange	   *range = NULL;
+	HASH_SEQ_STATUS	status;
+	int				nsampled = 0;
+	int				nmissed = 0;
+	int				i;
+
+	if (hot_ranges == NULL)
+	{
+		HASHCTL		ctl;
+
+		MemSet(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(HotRangeKey);
+		ctl.entrysize = sizeof(HotRange);
+
+		hot_ranges = hash_create("pg_hibernator hot ranges", 1024, &ctl,
+								 HASH_ELEM | HASH_BLOBS);
+		generation_start = start;
+	}
+	else
+	{
+		double	half_life_ms = guc_sample_half_life * 1000.0;
+
+		decay = pow(0.5, ElapsedMs(last_sample_time, start) / half_life_ms);
+
+		while (ElapsedMs(generation_start, start) >= half_life_ms)
+		{
+			++hot_generation;
+			generation_start = TimestampTzPlusMilliseconds(generation_start,
+														   guc_sample_half_life * 1000L);
+		}
+	}
+
+	last_sample_time = start;
+
+	for (i = 0; i < NBuffers; ++i)
+	{
+		BufferDesc *bufHdr = &BufferDescriptors[i].bufferdesc;
+		BufferTag	tag;
+		uint32		bufstate;
+
+		if (!ReadBufferTagLockless(bufHdr, &tag, &bufstate))
+			continue;
+
+		/* Neighbouring buffers often hold neighbouring blocks; skip the lookup. */
+		if (range == NULL
+			|| range->key.database != tag.rnode.dbNode
+			|| range->key.tablespace != tag.rnode.spcNode
+			|| range->key.filenode != tag.rnode.relNode
+			|| range->key.forknum != tag.forkNum
+			|| range->key.range != tag.blockNum / HOT_RANGE_BLOCKS)
+		{
+			HotRangeKey	key;
+			bool		found;
+
+			MemSet(&key, 0, sizeof(key));
+			key.database	= tag.rnode.dbNode;
+			key.tablespace	= tag.rnode.spcNode;
+			key.filenode	= tag.rnode.relNode;
+			key.forknum		= tag.forkNum;
+			key.range		= tag.blockNum / HOT_RANGE_BLOCKS;
+
+			range = (HotRange *) hash_search(hot_ranges, &key,
+											 hash_get_num_entries(hot_ranges) < NBuffers
+												? HASH_ENTER : HASH_FIND,
+											 &found);
+
+			if (range == NULL)
+			{
+				++nmissed;
+				continue;
+			}
+
+			if (!found)
+			{
+				range->seen			= 0;
+				range->seen_before	= 0;
+				range->generation	= hot_generation;
+				range->sample		= 0;
+				range->hotness		= 0;
+				range->heat			= 0;
+				range->nblocks		= 0;
+			}
+			else
+				AgeHotRange(range);
+		}
+
+		range->seen |= UINT64CONST(1) << (tag.blockNum % HOT_RANGE_BLOCKS);
+		range->sample += BUF_STATE_GET_USAGECOUNT(bufstate) + 1;
+		++nsampled;
+	}
+
+	/* Decay all the ranges, and add this sample to them. */
+	hash_seq_init(&status, hot_ranges);
+
+	while ((range = (HotRange *) hash_seq_search(&status)) != NULL)
+	{
+		uint64	blocks;
+
+		AgeHotRange(range);
+
+		range->hotness = range->hotness * decay + range->sample;
+		range->sample = 0;
+
+		range->nblocks = 0;
+		for (blocks = range->seen | range->seen_before; blocks != 0; blocks &= blocks - 1)
+			++range->nblocks;
+
+		/* Removing the entry just returned doesn't upset the scan. */
+		if (range->nblocks == 0)
+		{
+			hash_search(hot_ranges, &range->key, HASH_REMOVE, NULL);
+			continue;
+		}
+
+		range->heat = range->hotness / range->nblocks;
+	}
+
+	ereport(DEBUG1,
+			(errmsg("Buffer Saver: sampled %d buffers into %ld ranges of blocks in %.3f ms",
+					nsampled, hash_get_num_entries(hot_ranges),
+					ElapsedMs(start, GetCurrentTimestamp())),
+			 errdetail("%d buffers left out, for want of room for their ranges", nmissed)));
+}
+
+/* Bring the masks of the range up to the current generation. */
+static void
+AgeHotRange(HotRange *range)
+{
+	if (range->generation == hot_generation)
+		return;
+
+	range->seen_before = (range->generation + 1 == hot_generation) ? range->seen : 0;
+	range->seen = 0;
+	range->generation = hot_generation;
+}
+
+/*
+ * Fill in buffers with the hottest max_buffers blocks of the sampled working
+ * set, after one last sample. Returns the number of blocks.
+ *
+ * A block's heat is that of its range, spread over the blocks of the range
+ * the samples came across. The usage counts in the list rank the blocks,
+ * rather than repeat any sample: the hottest fifth of them get usage count
+ * BM_MAX_USAGE_COUNT, the next fifth one less, and so on down to 1, so that
+ * the restore brings them back in that order.
+ */
+static int
+CollectWorkingSet(SavedBuffer *buffers, int max_buffers)
+{
+	HotRange	  **ranges;
+	HotRange	   *range;
+	HASH_SEQ_STATUS	status;
+	long			nranges = 0;
+	int64			total = 0;
+	int				num_buffers = 0;
+	long			i;
+
+	SampleBuffers();
+
+	ranges = (HotRange **) MemoryContextAllocHuge(CurrentMemoryContext,
+												  sizeof(HotRange *) * Max(hash_get_num_entries(hot_ranges), 1));
+
+	hash_seq_init(&status, hot_ranges);
+
+	while ((range = (HotRange *) hash_seq_search(&status)) != NULL)
+	{
+		ranges[nranges++] = range;
+		total += range->nblocks;
+	}
+
+	qsort(ranges, nranges, sizeof(HotRange *), HotRangeCmp);
+
+	total = Min(total, max_buffers);
+
+	for (i = 0; i < nranges && num_buffers < total; ++i)
+	{
+		uint64	blocks = ranges[i]->seen | ranges[i]->seen_before;
+		int		bit;
+
+		for (bit = 0; bit < HOT_RANGE_BLOCKS && num_buffers < total; ++bit)
+		{
+			SavedBuffer *buf = &buffers[num_buffers];
+
+			if (!(blocks & (UINT64CONST(1) << bit)))
+				continue;
+
+			buf->database	= ranges[i]->key.database;
+			buf->tablespace	= ranges[i]->key.tablespace;
+			buf->filenode	= ranges[i]->key.filenode;
+			buf->forknum	= ranges[i]->key.forknum;
+			buf->blocknum	= ranges[i]->key.range * HOT_RANGE_BLOCKS + bit;
+			buf->usage		= BM_MAX_USAGE_COUNT
+				- (int) ((int64) num_buffers * BM_MAX_USAGE_COUNT / total);
+
+			++num_buffers;
+		}
+	}
+
+	ereport(DEBUG1,
+			(errmsg("Buffer Saver: collected %d blocks of the working set from %ld ranges of blocks",
+					num_buffers, nranges)));
+
+	pfree(ranges);
+
+	return num_buffers;
+}
+
+/* qsort comparator: the hottest range first */
+static int
+HotRangeCmp(const void *a, const void *b)
+{
+	const HotRange *ra = *(HotRange *const *) a;
+	const HotRange *rb = *(HotRange *const *) b;
+
+	if (ra->heat != rb->heat)
+		return ra->heat > rb->heat ? -1 : 1;
+
+	return 0;
+}
+
+/*
+ * Save the list of shared buffers within pg_hibernator.save_memory_limit.
+ * Returns the number of blocks saved.
+ *
+ * A first scan of the buffer headers counts the buffers of each save-file,
+ * i.e. of each (database, tablespace). Then the save-files are written in
+ * order, as many at a time as fit in a chunk of the memory limit: a scan
+ * gathers their buffers, as PackedBuffers, into their part of the chunk, and
+ * each part is sorted and written out. A save-file with more buffers than the
+ * chunk holds is sorted in runs instead, which are spilled to temporary files
+ * and merged into the save-file; see SaveLargeGroup().
+ *
+ * So it takes a scan of the headers per chunk, rather than one in all; that's
+ * cheap next to the writing. A buffer read in after the counting scan may be
+ * left out, as if the save had been done a little earlier; it's no worse than
+ * the blocks read in while the sort of a one-shot save runs.
+ */
+static int
+SaveBuffersChunked(ChunkedSave *cs)
+{
+	Size		limit = (Size) Max(guc_save_memory_limit, 1024) * 1024;
+	int			num_buffers = 0;
+	int			g;
+
+	cs->chunk_size = (int) Min(limit / sizeof(PackedBuffer), (Size) NBuffers);
+	cs->chunk = MemoryContextAllocHuge(CurrentMemoryContext,
+									   sizeof(PackedBuffer) * cs->chunk_size);
+
+	CountSaveGroups(cs);
+
+	for (g = 0; g < cs->ngroups; )
+	{
+		int		end;
+		int		total = 0;
+
+		if (cs->groups[g].count > cs->chunk_size)
+		{
+			SaveLargeGroup(cs, g);
+			++g;
+			continue;
+		}
+
+		for (end = g; end < cs->ngroups; ++end)
+		{
+			SaveGroup  *group = &cs->groups[end];
+
+			if (total + group->count > cs->chunk_size)
+				break;
+
+			group->offset = total;
+			group->filled = 0;
+			total += group->count;
+		}
+
+		SaveGroupBatch(cs, g, end);
+		g = end;
+	}
+
+	for (g = 0; g < cs->ngroups; ++g)
+		num_buffers += cs->groups[g].filled;
+
+	ereport(got_sigterm ? LOG : DEBUG1,
+			(errmsg("Buffer Saver: saved the list of buffers in %d scans and %d sorted runs, within %d kB",
+					cs->npasses, cs->nruns, guc_save_memory_limit),
+			 cs->nmissed > 0 ? errdetail("%d buffers read into shared buffers during the save were left out.",
+										  cs->nmissed) : 0));
+
+	pfree(cs->chunk);
+	pfree(cs->groups);
+
+	return num_buffers;
+}
+
+/* Count the buffers of each save-file, into cs->groups, in save-file order. */
+static void
+CountSaveGroups(ChunkedSave *cs)
+{
+	int			maxgroups = 16;
+	int			last = -1;
+	int			i;
+	TimestampTz	start = GetCurrentTimestamp();
+
+	cs->groups = palloc(sizeof(SaveGroup) * maxgroups);
+	cs->ngroups = 0;
+
+	BeginBufferScan();
+
+	for (i = 0; i < NBuffers; ++i)
+	{
+		SavedBuffer	buf;
+
+		if (!ScanBuffer(i, &buf))
+			continue;
+
+		/* Neighbouring buffers often belong to the same save-file. */
+		if (last < 0 || cs->groups[last].database != buf.database
+			|| cs->groups[last].tablespace != buf.tablespace)
+		{
+			last = FindSaveGroup(cs->groups, cs->ngroups, buf.database, buf.tablespace);
+
+			if (last >= cs->ngroups || cs->groups[last].database != buf.database
+				|| cs->groups[last].tablespace != buf.tablespace)
+			{
+				if (cs->ngroups == maxgroups)
+				{
+					maxgroups *= 2;
+					cs->groups = repalloc(cs->groups, sizeof(SaveGroup) * maxgroups);
+				}
+
+				memmove(&cs->groups[last + 1], &cs->groups[last],
+						sizeof(SaveGroup) * (cs->ngroups - last));
+				++cs->ngroups;
+
+				memset(&cs->groups[last], 0, sizeof(SaveGroup));
+				cs->groups[last].database = buf.database;
+				cs->groups[last].tablespace = buf.tablespace;
+			}
+		}
+
+		++cs->groups[last].count;
+	}
+
+	EndBufferScan();
+
+	++cs->npasses;
+	cs->scan_ms += ElapsedMs(start, GetCurrentTimestamp());
+}
+
+/*
+ * Returns the index of the group of the database and tablespace in the sorted
+ * array, or the index it should be inserted at if there's none.
+ */
+static int
+FindSaveGroup(SaveGroup *groups, int ngroups, Oid database, Oid tablespace)
+{
+	int		lo = 0;
+	int		hi = ngroups;
+
+	while (lo < hi)
+	{
+		int		mid = lo + (hi - lo) / 2;
+
+		if (groups[mid].database < database
+			|| (groups[mid].database == database && groups[mid].tablespace < tablespace))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/* Gather, sort and write out the groups from 'first' up to 'end', which fit in the chunk. */
+static void
+SaveGroupBatch(ChunkedSave *cs, int first, int end)
+{
+	TimestampTz	start = GetCurrentTimestamp();
+	TimestampTz	scan_end;
+	int			last = -1;
+	int			g;
+	int			i;
+
+	BeginBufferScan();
+
+	for (i = 0; i < NBuffers; ++i)
+	{
+		SavedBuffer	buf;
+		SaveGroup  *group;
+		PackedBuffer *packed;
+
+		if (!ScanBuffer(i, &buf))
+			continue;
+
+		if (last < 0 || cs->groups[last].database != buf.database
+			|| cs->groups[last].tablespace != buf.tablespace)
+			last = FindSaveGroup(cs->groups, cs->ngroups, buf.database, buf.tablespace);
+
+		/* A save-file that the counting scan didn't see */
+		if (last >= cs->ngroups || cs->groups[last].database != buf.database
+			|| cs->groups[last].tablespace != buf.tablespace)
+		{
+			++cs->nmissed;
+			last = -1;
+			continue;
+		}
+
+		/* Not one of this batch's */
+		if (last < first || last >= end)
+			continue;
+
+		group = &cs->groups[last];
+
+		if (group->filled == group->count)
+		{
+			++cs->nmissed;
+			continue;
+		}
+
+		packed = &cs->chunk[group->offset + group->filled++];
+		packed->filenode	= buf.filenode;
+		packed->blocknum	= buf.blocknum;
+		packed->forknum		= buf.forknum;
+		packed->usage		= buf.usage;
+	}
+
+	EndBufferScan();
+
+	++cs->npasses;
+	scan_end = GetCurrentTimestamp();
+	cs->scan_ms += ElapsedMs(start, scan_end);
+
+	for (g = first; g < end; ++g)
+	{
+		SaveGroup  *group = &cs->groups[g];
+		PackedBuffer *buffers = &cs->chunk[group->offset];
+		BlockStream	stream;
+		TimestampTz	sort_start = GetCurrentTimestamp();
+
+		pg_qsort(buffers, group->filled, sizeof(PackedBuffer), PackedBufferCmp);
+		cs->sort_ms += ElapsedMs(sort_start, GetCurrentTimestamp());
+
+		OpenGroupSavefile(cs, g, &stream);
+		for (i = 0; i < group->filled; ++i)
+			StreamBlock(&stream, &buffers[i]);
+		CloseGroupSavefile(cs, g, &stream);
+	}
+}
+
+/*
+ * Save the group that doesn't fit in the chunk: fill the chunk with its
+ * buffers, sort it, and spill it to a temporary file, as many times as it
+ * takes, and then merge the sorted runs into the save-file.
+ */
+static void
+SaveLargeGroup(ChunkedSave *cs, int g)
+{
+	SaveGroup  *group = &cs->groups[g];
+	MergeRun   *runs;
+	int			maxruns = group->count / cs->chunk_size + 2;
+	int			nruns = 0;
+	int			n = 0;
+	int			i;
+	TimestampTz	start = GetCurrentTimestamp();
+	binaryheap *heap;
+	BlockStream	stream;
+
+	runs = palloc(sizeof(MergeRun) * maxruns);
+
+	BeginBufferScan();
+
+	for (i = 0; i < NBuffers; ++i)
+	{
+		SavedBuffer	buf;
+		PackedBuffer *packed;
+
+		if (!ScanBuffer(i, &buf) || buf.database != group->database
+			|| buf.tablespace != group->tablespace)
+			continue;
+
+		packed = &cs->chunk[n++];
+		packed->filenode	= buf.filenode;
+		packed->blocknum	= buf.blocknum;
+		packed->forknum		= buf.forknum;
+		packed->usage		= buf.usage;
+
+		if (n == cs->chunk_size)
+		{
+			/* Don't hold the buffer mapping locks while we sort and write. */
+			EndBufferScan();
+			cs->scan_ms += ElapsedMs(start, GetCurrentTimestamp());
+
+			if (nruns == maxruns)
+			{
+				maxruns *= 2;
+				runs = repalloc(runs, sizeof(MergeRun) * maxruns);
+			}
+			runs[nruns++] = SpillRun(cs, n);
+			n = 0;
+
+			start = GetCurrentTimestamp();
+			BeginBufferScan();
+		}
+	}
+
+	EndBufferScan();
+
+	++cs->npasses;
+	cs->scan_ms += ElapsedMs(start, GetCurrentTimestamp());
+
+	if (n > 0)
+	{
+		if (nruns == maxruns)
+		{
+			maxruns *= 2;
+			runs = repalloc(runs, sizeof(MergeRun) * maxruns);
+		}
+		runs[nruns++] = SpillRun(cs, n);
+	}
+
+	/*
+	 * Merge the runs. binaryheap is a max-heap, so MergeRunCmp() puts the run
+	 * with the smallest next buffer on top.
+	 */
+	heap = binaryheap_allocate(Max(nruns, 1), MergeRunCmp, runs);
+
+	for (i = 0; i < nruns; ++i)
+	{
+		if (BufFileSeek(runs[i].file, 0, 0L, SEEK_SET) != 0)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not rewind temporary file: %m")));
+
+		if (ReadMergeRun(&runs[i]))
+			binaryheap_add_unordered(heap, Int32GetDatum(i));
+	}
+
+	binaryheap_build(heap);
+
+	OpenGroupSavefile(cs, g, &stream);
+
+	while (!binaryheap_empty(heap))
+	{
+		int		r = DatumGetInt32(binaryheap_first(heap));
+
+		StreamBlock(&stream, &runs[r].current);
+
+		if (ReadMergeRun(&runs[r]))
+			binaryheap_replace_first(heap, Int32GetDatum(r));
+		else
+			binaryheap_remove_first(heap);
+	}
+
+	CloseGroupSavefile(cs, g, &stream);
+
+	for (i = 0; i < nruns; ++i)
+		BufFileClose(runs[i].file);
+
+	binaryheap_free(heap);
+	pfree(runs);
+
+	cs->nruns += nruns;
+}
+
+/* Sort the first 'nbuffers' buffers of the chunk, and write them to a temporary file. */
+static MergeRun
+SpillRun(ChunkedSave *cs, int nbuffers)
+{
+	MergeRun	run;
+	Size		len = sizeof(PackedBuffer) * nbuffers;
+	TimestampTz	sort_start = GetCurrentTimestamp();
+
+	pg_qsort(cs->chunk, nbuffers, sizeof(PackedBuffer), PackedBufferCmp);
+	cs->sort_ms += ElapsedMs(sort_start, GetCurrentTimestamp());
+
+	/* Not tied to a transaction; it's closed by SaveLargeGroup() or at exit. */
+	run.file = BufFileCreateTemp(true);
+
+	if (BufFileWrite(run.file, cs->chunk, len) != len)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not write to temporary file: %m")));
+
+	return run;
+}
+
+/* Read the next buffer of the run into run->current. Returns false at its end. */
+static bool
+ReadMergeRun(MergeRun *run)
+{
+	size_t	nread = BufFileRead(run->file, &run->current, sizeof(PackedBuffer));
+
+	if (nread == 0)
+		return false;
+
+	if (nread != sizeof(PackedBuffer))
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not read from temporary file: %m")));
+
+	return true;
+}
+
+static int
+MergeRunCmp(Datum a, Datum b, void *arg)
+{
+	MergeRun   *runs = (MergeRun *) arg;
+
+	return PackedBufferCmp(&runs[DatumGetInt32(b)].current,
+						   &runs[DatumGetInt32(a)].current);
+}
+
+/* Like SavedBufferCmp(), for the buffers of one save-file. */
+static int
+PackedBufferCmp(const void *p, const void *q)
+{
+	const PackedBuffer *a = (const PackedBuffer *) p;
+	const PackedBuffer *b = (const PackedBuffer *) q;
+
+	if (a->filenode != b->filenode)
+		return a->filenode < b->filenode ? -1 : 1;
+	if (a->forknum != b->forknum)
+		return a->forknum < b->forknum ? -1 : 1;
+	if (a->blocknum != b->blocknum)
+		return a->blocknum < b->blocknum ? -1 : 1;
+
+	return 0;
+}
+
+/*
+ * Start the save-file of the group; save-file 1 is that of the first group, etc.
+ * That's the global objects if the scan found any, like in WriteSavefiles().
+ */
+static void
+OpenGroupSavefile(ChunkedSave *cs, int g, BlockStream *stream)
+{
+	SaveGroup  *group = &cs->groups[g];
+
+	if (g == 0 || group->database != cs->groups[g - 1].database)
+	{
+		cs->comp = AddDatabaseComposition(cs->stats, group->database);
+		++cs->ndatabases;
+	}
+
+	memset(stream, 0, sizeof(BlockStream));
+	stream->writer = savefileOpenWrite(getTempSavefilePath(cs->dir, g + 1),
+									   group->database, group->tablespace,
+									   cs->generation);
+	stream->comp = cs->comp;
+	stream->filenode = InvalidOid;
+	stream->forknum = InvalidForkNumber;
+}
+
+static void
+CloseGroupSavefile(ChunkedSave *cs, int g, BlockStream *stream)
+{
+	SaveGroup  *group = &cs->groups[g];
+	TimestampTz	fsync_start;
+
+	StreamFlush(stream);
+
+	/* The stream counts the duplicates of the lockless scan as one block. */
+	group->filled = stream->nblocks;
+
+	if (guc_save_page_cache)
+		SavePageCache(stream->writer, group->database, group->tablespace);
+
+	fsync_start = GetCurrentTimestamp();
+	savefileCloseWrite(stream->writer);
+	PublishSavefile(cs->dir, g + 1);
+	cs->fsync_ms += ElapsedMs(fsync_start, GetCurrentTimestamp());
+}
+
+/*
+ * Add the next buffer, in sort order, to the save-file, with one record per
+ * range of blocks of the same usage count; like SaveBuffers() does.
+ */
+static void
+StreamBlock(BlockStream *stream, const PackedBuffer *buf)
+{
+	if (stream->pending && buf->filenode == stream->filenode
+		&& buf->forknum == stream->forknum)
+	{
+		/* The lockless scan may find a block twice, if it moved meanwhile. */
+		if (buf->blocknum <= stream->start + stream->range)
+			return;
+
+		if (buf->blocknum == stream->start + stream->range + 1
+			&& buf->usage == stream->usage)
+		{
+			++stream->range;
+			return;
+		}
+	}
+
+	StreamFlush(stream);
+
+	if (buf->filenode != stream->filenode)
+	{
+		savefileWriteRelation(stream->writer, buf->filenode);
+		stream->filenode = buf->filenode;
+		stream->forknum = InvalidForkNumber;
+	}
+
+	if (buf->forknum != stream->forknum)
+	{
+		savefileWriteFork(stream->writer, buf->forknum);
+		stream->forknum = buf->forknum;
+	}
+
+	stream->start = buf->blocknum;
+	stream->range = 0;
+	stream->usage = buf->usage;
+	stream->pending = true;
+}
+
+/* Write out the pending range of blocks, if any. */
+static void
+StreamFlush(BlockStream *stream)
+{
+	if (!stream->pending)
+		return;
+
+	savefileWriteBlocks(stream->writer, stream->start, stream->range, stream->usage);
+
+	stream->comp->blocks[stream->forknum] += stream->range + 1;
+	stream->nblocks += stream->range + 1;
+	stream->pending = false;
+}
+
+/*
+ * Record the blocks of the relations of the database in the tablespace that
+ * are in the OS page cache, in the page cache section of their save-file; see
+ * savefile.c. Returns the number of blocks recorded.
+ *
+ * A block counts as cached if the first OS page of it is. The blocks that are
+ * in shared buffers (and likely in the page cache too) are recorded again;
+ * asking the kernel to read them ahead on restore is harmless.
+ */
+static BlockNumber
+SavePageCache(SavefileWriter *writer, Oid database, Oid tablespace)
+{
+	CacheSegment   *segments = NULL;
+	int				nsegments = 0;
+	int				maxsegments = 0;
+	BlockNumber		nblocks = 0;
+	char			path[MAXPGPATH];
+	int				i;
+
+	if (tablespace == GLOBALTABLESPACE_OID)
+		strlcpy(path, "global", sizeof(path));
+	else if (tablespace == DEFAULTTABLESPACE_OID)
+		snprintf(path, sizeof(path), "base/%u", database);
+	else
+		snprintf(path, sizeof(path), "pg_tblspc/%u/%s/%u",
+				 tablespace, TABLESPACE_VERSION_DIRECTORY, database);
+
+	CollectSegments(path, &segments, &nsegments, &maxsegments);
+
+	/* The relfilenodes have to be in ascending order; see savefileWriteRelation() */
+	if (nsegments > 1)
+		qsort(segments, nsegments, sizeof(CacheSegment), CacheSegmentCmp);
+
+	savefileWriteCacheSection(writer);
+
+	for (i = 0; i < nsegments; ++i)
+	{
+		CacheSegment   *seg = &segments[i];
+		CacheSegment   *prev = i > 0 ? &segments[i - 1] : NULL;
+
+		if (prev == NULL || prev->filenode != seg->filenode)
+			savefileWriteRelation(writer, seg->filenode);
+
+		if (prev == NULL || prev->filenode != seg->filenode
+			|| prev->forknum != seg->forknum)
+			savefileWriteFork(writer, seg->forknum);
+
+		nblocks += WriteSegmentResidency(writer, seg);
+
+		pfree(seg->path);
+	}
+
+	if (segments)
+		pfree(segments);
+
+	ereport(DEBUG1,
+			(errmsg("Buffer Saver: saved %u blocks of %d relation segment files in the page cache of database %u, tablespace %u",
+					nblocks, nsegments, database, tablespace)));
+
+	return nblocks;
+}
+
+/* Add the relation segment files found in the directory, if it exists */
+static void
+CollectSegments(const char *dirpath, CacheSegment **segments, int *nsegments, int *maxsegments)
+{
+	DIR			   *dir;
+	struct dirent  *dent;
+
+	dir = AllocateDir(dirpath);
+	if (dir == NULL)
+		return;
+
+	while ((dent = ReadDir(dir, dirpath)) != NULL)
+	{
+		CacheSegment   *seg;
+		Oid				filenode;
+		ForkNumber		forknum;
+		BlockNumber		segno;
+
+		if (!ParseSegmentName(dent->d_name, &filenode, &forknum, &segno))
+			continue;
+
+		if (*nsegments == *maxsegments)
+		{
+			*maxsegments = Max(*maxsegments * 2, 1024);
+			*segments = *segments == NULL
+						? palloc(sizeof(CacheSegment) * *maxsegments)
+						: repalloc(*segments, sizeof(CacheSegment) * *maxsegments);
+		}
+
+		seg = &(*segments)[(*nsegments)++];
+		seg->filenode = filenode;
+		seg->forknum = forknum;
+		seg->segno = segno;
+		seg->path = psprintf("%s/%s", dirpath, dent->d_name);
+	}
+
+	FreeDir(dir);
+}
+
+/*
+ * Parse the name of a relation segment file: <relfilenode>[_<fork>][.<segno>].
+ * Returns false for other files, including temporary relations'.
+ */
+static bool
+ParseSegmentName(const char *name, Oid *filenode, ForkNumber *forknum, BlockNumber *segno)
+{
+	const char *p = name;
+	char	   *end;
+
+	if (*p < '0' || *p > '9')
+		return false;
+
+	*filenode = (Oid) strtoul(p, &end, 10);
+	p = end;
+
+	*forknum = MAIN_FORKNUM;
+	if (*p == '_')
+	{
+		int		len = forkname_chars(p + 1, forknum);
+
+		if (len == 0)
+			return false;
+
+		p += 1 + len;
+	}
+
+	*segno = 0;
+	if (*p == '.')
+	{
+		++p;
+		if (*p < '0' || *p > '9')
+			return false;
+
+		*segno = (BlockNumber) strtoul(p, &end, 10);
+		p = end;
+	}
+
+	return *p == '\0' && *filenode != InvalidOid;
+}
+
+static int
+CacheSegmentCmp(const void *a, const void *b)
+{
+	const CacheSegment *s1 = (const CacheSegment *) a;
+	const CacheSegment *s2 = (const CacheSegment *) b;
+
+	if (s1->filenode != s2->filenode)
+		return s1->filenode < s2->filenode ? -1 : 1;
+
+	if (s1->forknum != s2->forknum)
+		return s1->forknum < s2->forknum ? -1 : 1;
+
+	if (s1->segno != s2->segno)
+		return s1->segno < s2->segno ? -1 : 1;
+
+	return 0;
+}
+
+/*
+ * Record the ranges of blocks of the segment file that are in the page cache,
+ * using mincore() on a mapping of the file; the mapping is never touched, so
+ * this doesn't read anything in. Returns the number of blocks recorded. The
+ * file is skipped if it's gone, e.g. dropped since we listed it.
+ */
+static BlockNumber
+WriteSegmentResidency(SavefileWriter *writer, CacheSegment *seg)
+{
+	int				fd;
+	struct stat		st;
+	void		   *addr;
+	unsigned char  *vec;
+	long			pagesize = sysconf(_SC_PAGESIZE);
+	BlockNumber		nblocks;
+	BlockNumber		block;
+	BlockNumber		recorded = 0;
+
+	fd = OpenTransientFile(seg->path, O_RDONLY | PG_BINARY, 0);
+	if (fd < 0)
+		return 0;
+
+	if (fstat(fd, &st) != 0 || st.st_size < BLCKSZ)
+	{
+		CloseTransientFile(fd);
+		return 0;
+	}
+
+	nblocks = Min(st.st_size / BLCKSZ, (off_t) RELSEG_SIZE);
+
+	addr = mmap(NULL, (size_t) nblocks * BLCKSZ, PROT_READ, MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED)
+	{
+		CloseTransientFile(fd);
+		return 0;
+	}
+
+	vec = palloc(((size_t) nblocks * BLCKSZ + pagesize - 1) / pagesize);
+
+	if (mincore(addr, (size_t) nblocks * BLCKSZ, (void *) vec) == 0)
+	{
+		for (block = 0; block < nblocks; ++block)
+		{
+			BlockNumber	last;
+
+			if (!(vec[(size_t) block * BLCKSZ / pagesize] & 1))
+				continue;
+
+			for (last = block; last + 1 < nblocks; ++last)
+				if (!(vec[(size_t) (last + 1) * BLCKSZ / pagesize] & 1))
+					break;
+
+			savefileWriteBlocks(writer, seg->segno * ((BlockNumber) RELSEG_SIZE) + block,
+								last - block, 0);
+			recorded += last - block + 1;
+			block = last;
+		}
+	}
+
+	pfree(vec);
+	munmap(addr, (size_t) nblocks * BLCKSZ);
+	CloseTransientFile(fd);
+
+	return recorded;
+}
+
+/*
+ * Move the freshly written save-file into place. rename() replaces an existing
+ * save-file atomically, so a reader never sees a partially written file, and
+ * durable_rename() fsyncs the file before, and the directory after, so that
+ * after a crash we find either the old or the new save-file.
+ */
+static void
+PublishSavefile(const char *dir, int filenum)
+{
+	char		tmppath[MAXPGPATH];
+	const char *path;
+
+	strlcpy(tmppath, getTempSavefilePath(dir, filenum), sizeof(tmppath));
+	path = getSavefilePath(dir, filenum);
+
+	durable_rename(tmppath, path, ERROR);
+}
+
+/*
+ * Remove the save-files numbered above max_filenum, left behind by an earlier
+ * save that saw more databases than the latest one.
+ */
+static void
+RemoveStaleSavefiles(const char *hibernate_dir, int max_filenum)
+{
+	DIR			   *dir;
+	struct dirent  *dent;
+
+	dir = opendir(hibernate_dir);
+	if (dir == NULL)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not open directory \"%s\": %m", hibernate_dir)));
+
+	errno = 0;
+	while ((dent = readdir(dir)) != NULL)
+	{
+		int			filenum;
+		const char *filepath;
+
+		if (!parseSavefileName(dent->d_name, &filenum) || filenum <= max_filenum)
+			continue;
+
+		filepath = getSavefilePath(hibernate_dir, filenum);
+		if (remove(filepath) != 0)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					errmsg("error removing file \"%s\" : %m", filepath)));
+
+		errno = 0;
+	}
+
+	if (errno != 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				errmsg("error encountered during readdir \"%s\": %m", hibernate_dir)));
+
+	closedir(dir);
+
+	/* Make the removals durable, lest the stale files come back after a crash. */
+	fsync_fname(hibernate_dir, true);
+}
+
+/*
+ * Read the generation of the last complete full save in the directory. Returns
+ * false if there's none, as before the first save, or in a directory written
+ * before save-files had generations.
+ */
+static bool
+ReadSaveGeneration(const char *dir, uint64 *generation)
+{
+	const char *path = getGenerationFilePath(dir);
+	int			fd;
+	int			nread;
+
+	*generation = 0;
+
+	fd = OpenTransientFile((char *) path, O_RDONLY | PG_BINARY, 0);
+	if (fd < 0)
+	{
+		if (errno == ENOENT)
+			return false;
+
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				errmsg("could not open file \"%s\": %m", path)));
+	}
+
+	nread = read(fd, generation, sizeof(*generation));
+	if (nread < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				errmsg("error reading from \"%s\": %m", path)));
+
+	CloseTransientFile(fd);
+
+	if (nread != sizeof(*generation))
+	{
+		ereport(WARNING,
+				(errmsg("ignoring truncated file \"%s\"", path)));
+		*generation = 0;
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Commit a full save: record its generation, with a single durable rename.
+ *
+ * Every save-file, and delta file, carries the generation of the full save it
+ * belongs to in its header, and the BlockReaders ignore the files that don't
+ * match the generation recorded here. A crash in the middle of a save may
+ * leave the save-files published so far next to those of the save before; the
+ * former aren't committed yet, and both are ignored rather than restoring a
+ * mix of two saves, or a save-file with delta files meant for another.
+ */
+static void
+WriteSaveGeneration(const char *dir, uint64 generation)
+{
+	char		tmppath[MAXPGPATH];
+	int			fd;
+
+	strlcpy(tmppath, getTempGenerationFilePath(dir), sizeof(tmppath));
+
+	fd = OpenTransientFile(tmppath, O_WRONLY | O_CREAT | O_TRUNC | PG_BINARY,
+						   S_IRUSR | S_IWUSR);
+	if (fd < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				errmsg("could not create file \"%s\": %m", tmppath)));
+
+	errno = 0;
+	if (write(fd, &generation, sizeof(generation)) != sizeof(generation))
+	{
+		/* If write didn't set errno, assume the problem is no disk space. */
+		if (errno == 0)
+			errno = ENOSPC;
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				errmsg("error writing to \"%s\": %m", tmppath)));
+	}
+
+	CloseTransientFile(fd);
+
+	/* durable_rename() fsyncs the file, and the directory. */
+	durable_rename(tmppath, getGenerationFilePath(dir), ERROR);
+}
+
+/*
+ * Delta saves
+ * -----------
+ *
+ * With pg_hibernator.max_delta_saves, the BufferSaver keeps the sorted list of
+ * the last full save in memory, and a periodic save that finds the same save-
+ * files (databases and tablespaces) as that list merely compares the two
+ * lists. For every save-file whose blocks have changed it writes a delta file
+ * holding the changes since the full save (see the save-file format in
+ * savefile.c), and it leaves the save-files themselves alone; on a large pool
+ * that changes slowly, that's a fraction of the writes of a full save. The
+ * delta files are folded into their save-files before they are restored.
+ *
+ * Since every delta file is computed against the full save, rather than the
+ * previous delta save, a save-file has only ever one delta file, and the
+ * delta files grow as shared buffers drift away from the full save. We fall
+ * back to a full save after pg_hibernator.max_delta_saves delta saves, or
+ * once the changes add up to half the blocks of the full save, or when the
+ * set of save-files has changed.
+ *
+ * The page cache sections of the save-files are not kept up to date by the
+ * delta saves, and not kept by the folding.
+ *
+ * Returns true if it did a delta save, or false if the caller should do a full
+ * save.
+ */
+static bool
+SaveDelta(const char *dir, SavedBuffer *buffers, int num_buffers, SaveStats *stats,
+		  int *ndatabases, double *fsync_ms)
+{
+	int			g;
+	int			c;
+	int			filenum;
+	int			nchanged = 0;
+	int			ndeltas = 0;
+	bool		removed_any = false;
+	Oid			prev_database = InvalidOid;
+	uint64		generation;
+	DatabaseComposition *comp = NULL;
+	TimestampTz	fsync_start;
+
+	if (guc_max_delta_saves == 0 || base_buffers == NULL || got_sigterm
+		|| num_delta_saves >= guc_max_delta_saves)
+		return false;
+
+	/* The delta files belong to the generation of the full save. */
+	if (!ReadSaveGeneration(dir, &generation))
+		return false;
+
+	/* The save-files must match the groups of the full save, one to one. */
+	for (g = 0, c = 0, filenum = 1; g < base_ngroups || c < num_buffers; ++g, ++filenum)
+	{
+		int		cend;
+
+		if (g >= base_ngroups || c >= num_buffers
+			|| base_groups[g].database != buffers[c].database
+			|| base_groups[g].tablespace != buffers[c].tablespace
+			|| access(getSavefilePath(dir, filenum), F_OK) != 0)
+			return false;
+
+		cend = GroupEnd(buffers, num_buffers, c);
+
+		nchanged += DiffGroup(&base_groups[g], &buffers[c], cend - c,
+							  NULL, NULL, NULL, NULL);
+
+		c = cend;
+	}
+
+	if (nchanged > base_num_buffers / 2)
+		return false;
+
+	for (g = 0, c = 0, filenum = 1; c < num_buffers; ++g, ++filenum)
+	{
+		int				cend = GroupEnd(buffers, num_buffers, c);
+		SavedBuffer	   *added = palloc(sizeof(SavedBuffer) * (cend - c));
+		SavedBuffer	   *removed = palloc(sizeof(SavedBuffer) * base_groups[g].count);
+		int				nadded;
+		int				nremoved;
+		int				i;
+
+		/* The composition of the save, as a full save would have counted it. */
+		for (i = c; i < cend; ++i)
+		{
+			if (i == 0 || buffers[i].database != prev_database)
+			{
+				comp = AddDatabaseComposition(stats, buffers[i].database);
+				prev_database = buffers[i].database;
+				++*ndatabases;
+			}
+
+			comp->blocks[buffers[i].forknum] += 1;
+		}
+
+		if (DiffGroup(&base_groups[g], &buffers[c], cend - c,
+					  added, &nadded, removed, &nremoved) == 0)
+		{
+			/* Back to what the save-file says. */
+			if (unlink(getDeltaFilePath(dir, filenum)) == 0)
+				removed_any = true;
+			else if (errno != ENOENT)
+				ereport(ERROR,
+						(errcode_for_file_access(),
+						errmsg("error removing file \"%s\" : %m",
+								getDeltaFilePath(dir, filenum))));
+		}
+		else
+		{
+			SavefileWriter *writer;
+			char			tmppath[MAXPGPATH];
+
+			strlcpy(tmppath, getTempDeltaFilePath(dir, filenum), sizeof(tmppath));
+			writer = savefileOpenWrite(tmppath, buffers[c].database, buffers[c].tablespace,
+									   generation);
+
+			WriteBufferList(writer, added, nadded);
+			savefileWriteRemovedSection(writer);
+			WriteBufferList(writer, removed, nremoved);
+
+			fsync_start = GetCurrentTimestamp();
+			savefileCloseWrite(writer);
+			durable_rename(tmppath, getDeltaFilePath(dir, filenum), ERROR);
+			*fsync_ms += ElapsedMs(fsync_start, GetCurrentTimestamp());
+
+			++ndeltas;
+		}
+
+		pfree(added);
+		pfree(removed);
+
+		c = cend;
+	}
+
+	if (removed_any)
+		fsync_fname(dir, true);
+
+	++num_delta_saves;
+
+	ereport(LOG,
+			(errmsg("Buffer Saver: saved %d changes since the last full save, to %d delta files",
+					nchanged, ndeltas)));
+
+	return true;
+}
+
+/* Returns the index past the last buffer of the same save-file as 'start'. */
+static int
+GroupEnd(SavedBuffer *buffers, int num_buffers, int start)
+{
+	int		end;
+
+	for (end = start + 1; end < num_buffers; ++end)
+		if (buffers[end].database != buffers[start].database
+			|| buffers[end].tablespace != buffers[start].tablespace)
+			break;
+
+	return end;
+}
+
+/*
+ * Keep the list of the full save for the delta saves to come, packed: the
+ * database and tablespace of the buffers go to base_groups, once per save-file,
+ * which halves the memory the list takes for as long as it's kept. A list of
+ * no more than save_memory_limit was saved unchunked, so it's bounded by that.
+ */
+static void
+KeepDeltaBase(SavedBuffer *buffers, int num_buffers)
+{
+	int		i;
+
+	base_buffers = MemoryContextAllocHuge(TopMemoryContext,
+										  sizeof(PackedBuffer) * Max(num_buffers, 1));
+	base_num_buffers = num_buffers;
+
+	for (i = 0; i < num_buffers; i = GroupEnd(buffers, num_buffers, i))
+		++base_ngroups;
+
+	base_groups = MemoryContextAlloc(TopMemoryContext,
+									 sizeof(SaveGroup) * Max(base_ngroups, 1));
+	base_ngroups = 0;
+
+	for (i = 0; i < num_buffers; ++i)
+	{
+		PackedBuffer *packed = &base_buffers[i];
+
+		if (i == 0 || buffers[i].database != buffers[i - 1].database
+			|| buffers[i].tablespace != buffers[i - 1].tablespace)
+		{
+			SaveGroup  *group = &base_groups[base_ngroups++];
+
+			group->database = buffers[i].database;
+			group->tablespace = buffers[i].tablespace;
+			group->count = 0;
+			group->offset = i;
+			group->filled = 0;
+		}
+
+		packed->filenode = buffers[i].filenode;
+		packed->blocknum = buffers[i].blocknum;
+		packed->forknum = (uint8) buffers[i].forknum;
+		packed->usage = buffers[i].usage;
+
+		base_groups[base_ngroups - 1].count += 1;
+		base_groups[base_ngroups - 1].filled += 1;
+	}
+}
+
+/*
+ * Compare the blocks of a save-file in the full save, and now. Returns the
+ * number of blocks added, removed, or whose usage count has changed; and if
+ * 'added' is not NULL, collects the added and changed blocks in 'added', and
+ * the removed ones in 'removed', which have room for 'ncur' and group->count
+ * blocks.
+ */
+static int
+DiffGroup(const SaveGroup *group, SavedBuffer *cur, int ncur,
+		  SavedBuffer *added, int *nadded, SavedBuffer *removed, int *nremoved)
+{
+	PackedBuffer *base = &base_buffers[group->offset];
+	int		nbase = group->count;
+	int		b = 0;
+	int		c = 0;
+	int		nchanged = 0;
+
+	if (added)
+		*nadded = *nremoved = 0;
+
+	while (b < nbase || c < ncur)
+	{
+		int		cmp;
+
+		if (b >= nbase)
+			cmp = 1;
+		else if (c >= ncur)
+			cmp = -1;
+		else
+		{
+			PackedBuffer key;
+
+			key.filenode = cur[c].filenode;
+			key.blocknum = cur[c].blocknum;
+			key.forknum = (uint8) cur[c].forknum;
+			key.usage = cur[c].usage;
+
+			cmp = PackedBufferCmp(&base[b], &key);
+		}
+
+		if (cmp < 0)
+		{
+			if (removed)
+			{
+				SavedBuffer *buf = &removed[(*nremoved)++];
+
+				buf->database = group->database;
+				buf->tablespace = group->tablespace;
+				buf->filenode = base[b].filenode;
+				buf->forknum = (ForkNumber) base[b].forknum;
+				buf->blocknum = base[b].blocknum;
+				buf->usage = 0;
+			}
+			++b;
+			++nchanged;
+		}
+		else if (cmp > 0 || base[b].usage != cur[c].usage)
+		{
+			if (added)
+				added[(*nadded)++] = cur[c];
+			if (cmp == 0)
+				++b;
+			++c;
+			++nchanged;
+		}
+		else
+		{
+			++b;
+			++c;
+		}
+	}
+
+	return nchanged;
+}
+
+/* Like SavedBufferCmp(), but for blocks that may be the same. */
+static int
+BlockKeyCmp(const SavedBuffer *a, const SavedBuffer *b)
+{
+	if (a->filenode != b->filenode)
+		return a->filenode < b->filenode ? -1 : 1;
+	if (a->forknum != b->forknum)
+		return a->forknum < b->forknum ? -1 : 1;
+	if (a->blocknum != b->blocknum)
+		return a->blocknum < b->blocknum ? -1 : 1;
+
+	return 0;
+}
+
+/* Remove the delta files, durably, before a full save replaces the save-files. */
+static void
+RemoveDeltaFiles(const char *hibernate_dir)
+{
+	DIR			   *dir;
+	struct dirent  *dent;
+	bool			removed_any = false;
+
+	dir = opendir(hibernate_dir);
+	if (dir == NULL)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not open directory \"%s\": %m", hibernate_dir)));
+
+	while ((dent = readdir(dir)) != NULL)
+	{
+		int			filenum;
+		const char *filepath;
+
+		if (!parseDeltaFileName(dent->d_name, &filenum))
+			continue;
+
+		filepath = getDeltaFilePath(hibernate_dir, filenum);
+		if (remove(filepath) != 0)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					errmsg("error removing file \"%s\" : %m", filepath)));
+
+		removed_any = true;
+	}
+
+	closedir(dir);
+
+	if (removed_any)
+		fsync_fname(hibernate_dir, true);
+}
+
+/* Forget the full save kept for the delta saves; see SaveDelta(). */
+static void
+DiscardDeltaBase(void)
+{
+	if (base_buffers != NULL)
+		pfree(base_buffers);
+	if (base_groups != NULL)
+		pfree(base_groups);
+
+	base_buffers = NULL;
+	base_num_buffers = 0;
+	base_groups = NULL;
+	base_ngroups = 0;
+	num_delta_saves = 0;
+}
+
+/*
+ * Fold the delta files into their save-files, and remove them; see SaveDelta().
+ * A delta file that's broken, or whose save-file is, is just removed, leaving
+ * the save-file as of the last full save.
+ */
+static void
+FoldDeltaFiles(const char *hibernate_dir)
+{
+	DIR			   *dir;
+	struct dirent  *dent;
+	List		   *filenums = NIL;
+	ListCell	   *lc;
+	uint64			generation;
+
+	dir = opendir(hibernate_dir);
+	if (dir == NULL)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not open directory \"%s\": %m", hibernate_dir)));
+
+	/* Collect the names first, since folding adds and removes files. */
+	while ((dent = readdir(dir)) != NULL)
+	{
+		int		filenum;
+
+		if (parseDeltaFileName(dent->d_name, &filenum))
+			filenums = lappend_int(filenums, filenum);
+	}
+
+	closedir(dir);
+
+	if (filenums == NIL)
+		return;
+
+	/* Only the delta files of the last complete full save are folded. */
+	(void) ReadSaveGeneration(hibernate_dir, &generation);
+
+	foreach(lc, filenums)
+	{
+		int		filenum = lfirst_int(lc);
+		char	deltapath[MAXPGPATH];
+
+		strlcpy(deltapath, getDeltaFilePath(hibernate_dir, filenum), sizeof(deltapath));
+
+		if (!FoldDeltaFile(hibernate_dir, filenum, generation))
+			ereport(WARNING,
+					(errmsg("discarding delta file \"%s\", which could not be folded into its save-file",
+							deltapath)));
+
+		if (remove(deltapath) != 0)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					errmsg("error removing file \"%s\" : %m", deltapath)));
+	}
+
+	fsync_fname(hibernate_dir, true);
+	list_free(filenums);
+}
+
+/*
+ * Rewrite the save-file with its delta file applied. Both must belong to the
+ * given generation; see WriteSaveGeneration().
+ */
+static bool
+FoldDeltaFile(const char *dir, int filenum, uint64 generation)
+{
+	char			basepath[MAXPGPATH];
+	char			deltapath[MAXPGPATH];
+	SavedBuffer	   *base;
+	SavedBuffer	   *added;
+	SavedBuffer	   *removed;
+	SavedBuffer	   *merged;
+	int				nbase;
+	int				nadded;
+	int				nremoved;
+	int				nmerged = 0;
+	int				b = 0;
+	int				a = 0;
+	int				r = 0;
+	Oid				database;
+	Oid				tablespace;
+	uint64			base_generation;
+	uint64			delta_generation;
+	SavefileWriter *writer;
+
+	strlcpy(basepath, getSavefilePath(dir, filenum), sizeof(basepath));
+	strlcpy(deltapath, getDeltaFilePath(dir, filenum), sizeof(deltapath));
+
+	if (access(basepath, F_OK) != 0 || !savefileVerify(basepath) || !savefileVerify(deltapath))
+		return false;
+
+	if (!LoadSavefile(basepath, &base, &nbase, NULL, NULL, &database, &tablespace,
+					  &base_generation))
+		return false;
+
+	if (!LoadSavefile(deltapath, &added, &nadded, &removed, &nremoved, &database, &tablespace,
+					  &delta_generation))
+	{
+		pfree(base);
+		return false;
+	}
+
+	if (base_generation != generation || delta_generation != generation)
+	{
+		pfree(base);
+		pfree(added);
+		pfree(removed);
+		return false;
+	}
+
+	/* Merge the three sorted lists. */
+	merged = MemoryContextAllocHuge(CurrentMemoryContext,
+									sizeof(SavedBuffer) * ((Size) nbase + nadded));
+
+	while (b < nbase || a < nadded)
+	{
+		int		cmp;
+
+		if (b >= nbase)
+			cmp = 1;
+		else if (a >= nadded)
+			cmp = -1;
+		else
+			cmp = BlockKeyCmp(&base[b], &added[a]);
+
+		if (cmp >= 0)
+		{
+			/* Added, or with a new usage count. */
+			merged[nmerged++] = added[a++];
+			if (cmp == 0)
+				++b;
+			continue;
+		}
+
+		while (r < nremoved && BlockKeyCmp(&removed[r], &base[b]) < 0)
+			++r;
+
+		if (r < nremoved && BlockKeyCmp(&removed[r], &base[b]) == 0)
+			++r;
+		else
+			merged[nmerged++] = base[b];
+
+		++b;
+	}
+
+	writer = savefileOpenWrite(getTempSavefilePath(dir, filenum), database, tablespace,
+							   generation);
+	WriteBufferList(writer, merged, nmerged);
+	savefileCloseWrite(writer);
+	PublishSavefile(dir, filenum);
+
+	ereport(DEBUG1,
+			(errmsg("Buffer Saver: folded %d added and %d removed blocks into save-file %d",
+					nadded, nremoved, filenum)));
+
+	pfree(base);
+	pfree(added);
+	pfree(removed);
+	pfree(merged);
+
+	return true;
+}
+
+/*
+ * Read the blocks of a save-file, or a delta file, in the order they were
+ * written. The blocks of the removed section go to *removed, if the caller asks
+ * for them. The page cache section is skipped. Returns false if the file is of
+ * a version before 8, which had no delta files, or of an unsupported one; a
+ * version 8 file has generation 0, like those found with no generation.id.
+ */
+static bool
+LoadSavefile(const char *path, SavedBuffer **blocks, int *nblocks,
+			 SavedBuffer **removed, int *nremoved, Oid *database, Oid *tablespace,
+			 uint64 *generation)
+{
+	SavefileReader *reader = savefileOpenRead(path);
+	SavedBuffer	  **target = blocks;
+	int			   *ntarget = nblocks;
+	int				maxblocks = 1024;
+	int				maxremoved = 1024;
+	int			   *maxtarget = &maxblocks;
+	SavedBuffer		buf;
+	char			record_type;
+	uint32			record_value;
+
+	if (reader->version < 8 || reader->version > SAVEFILE_VERSION)
+	{
+		savefileCloseRead(reader);
+		return false;
+	}
+
+	*database = reader->database;
+	*tablespace = reader->tablespace;
+	*generation = reader->generation;
+
+	*blocks = palloc(sizeof(SavedBuffer) * maxblocks);
+	*nblocks = 0;
+	if (removed)
+	{
+		*removed = palloc(sizeof(SavedBuffer) * maxremoved);
+		*nremoved = 0;
+	}
+
+	buf.database = reader->database;
+	buf.tablespace = reader->tablespace;
+	buf.filenode = InvalidOid;
+	buf.forknum = InvalidForkNumber;
+	buf.blocknum = InvalidBlockNumber;
+	buf.usage = 0;
+
+	while (savefileReadRecord(reader, &record_type, &record_value))
+	{
+		BlockNumber	count = 0;
+		BlockNumber	i;
+
+		switch (record_type)
+		{
+			case 'r':
+				buf.filenode = (Oid) record_value;
+				break;
+			case 'f':
+				buf.forknum = (ForkNumber) record_value;
+				break;
+			case 'u':
+				buf.usage = (uint8) record_value;
+				break;
+			case 'b':
+				buf.blocknum = (BlockNumber) record_value;
+				count = 1;
+				break;
+			case 'N':
+				count = (BlockNumber) record_value;
+				break;
+			case 'd':
+				if (removed == NULL)
+					ereport(ERROR,
+							(errmsg("found a removed blocks section in save-file \"%s\"", path)));
+				target = removed;
+				ntarget = nremoved;
+				maxtarget = &maxremoved;
+				break;
+			case 'c':
+				/* Stop at the page cache section; see SaveDelta(). */
+				savefileCloseRead(reader);
+				return true;
+			default:
+				ereport(ERROR,
+						(errmsg("found unexpected save-file marker %x - %c) in \"%s\"",
+								record_type, record_type, path)));
+		}
+
+		for (i = 0; i < count; ++i)
+		{
+			if (*ntarget == *maxtarget)
+			{
+				*maxtarget *= 2;
+				*target = repalloc_huge(*target, sizeof(SavedBuffer) * (Size) *maxtarget);
+			}
+
+			/* An 'N' record follows the block of its 'b' record. */
+			if (record_type == 'N')
+				++buf.blocknum;
+
+			(*target)[(*ntarget)++] = buf;
+		}
+	}
+
+	savefileCloseRead(reader);
+
+	return true;
+}
+
+/* Are there save-files waiting for, or being restored by, BlockReaders? */
+static bool
+RestoreInProgress(void)
+{
+	int		i;
+	bool	found = false;
+
+	if (pendingJobs != NIL)
+		return true;
+
+	LWLockAcquire(shared_mem->lock, LW_SHARED);
+
+	for (i = 0; i < shared_mem->nslots; ++i)
+	{
+		if (shared_mem->slots[i].filenum != 0)
+		{
+			found = true;
+			break;
+		}
+	}
+
+	LWLockRelease(shared_mem->lock);
+
+	return found;
+}
+
+/*
+ * Copy the tag of the buffer, and its state in *state, without taking the
+ * buffer header lock. Returns false if the buffer doesn't hold a valid page.
+ *
+ * A buffer's tag changes only while its header is locked, and the change is
+ * accompanied by a change of the BM_VALID/BM_TAG_VALID flags. So we read the
+ * state, copy the tag, and read the state again; if the header wasn't locked
+ * either time, and the flags didn't change, then we most likely copied a
+ * consistent tag. The buffer could have been evicted and reloaded between the
+ * two reads, but the worst that can happen then is that we save the id of a
+ * block that was never in shared buffers, and the BlockReader either restores
+ * a block we didn't need, or skips a block that doesn't exist. That is not
+ * worth stalling the buffer replacement for.
+ *
+ * If the header keeps changing under us, we resort to locking it.
+ */
+static bool
+ReadBufferTagLockless(BufferDesc *bufHdr, BufferTag *tag, uint32 *state)
+{
+	int		tries;
+	uint32	bufstate;
+
+	for (tries = 0; tries < 3; ++tries)
+	{
+		uint32	state_before;
+		uint32	state_after;
+
+		state_before = pg_atomic_read_u32(&bufHdr->state);
+
+		if (!(state_before & BM_LOCKED))
+		{
+			if (!(state_before & BM_VALID) || !(state_before & BM_TAG_VALID))
+				return false;
+
+			pg_read_barrier();
+			*tag = bufHdr->tag;
+			pg_read_barrier();
+
+			state_after = pg_atomic_read_u32(&bufHdr->state);
+
+			if (!(state_after & BM_LOCKED)
+				&& (state_before & BUF_FLAG_MASK) == (state_after & BUF_FLAG_MASK))
+			{
+				*state = state_after;
+				return true;
+			}
+		}
+	}
+
+	bufstate = LockBufHdr(bufHdr);
+
+	if (!(bufstate & BM_VALID) || !(bufstate & BM_TAG_VALID))
+	{
+		UnlockBufHdr(bufHdr, bufstate);
+		return false;
+	}
+
+	*tag = bufHdr->tag;
+	*state = bufstate;
+	UnlockBufHdr(bufHdr, bufstate);
+
+	return true;
+}
+
+/*
+ * Look up the relation that the filenode belongs to, in the current database.
+ *
+ * On first call we build a map of all the filenodes of the database with a
+ * single scan of pg_class, instead of scanning pg_class for each filenode;
+ * with hundreds of thousands of relations the latter dominates the restore
+ * time. The map is built in the caller's snapshot, just as the per-filenode
+ * lookups were, so it's thrown away at the end of each job; a reader handed
+ * another job of the database builds it afresh.
+ *
+ * Save-files older than version 7 don't name the tablespace; for those the
+ * map is keyed on the filenode alone.
+ */
+static Oid
+GetRelOid(Oid tablespace, Oid filenode)
+{
+	FilenodeMapKey		key;
+	FilenodeMapEntry   *entry;
+
+	if (filenode_map == NULL)
+		BuildFilenodeMap(tablespace == InvalidOid);
+
+	MemSet(&key, 0, sizeof(key));
+	key.tablespace = tablespace;
+	key.filenode = filenode;
+
+	entry = (FilenodeMapEntry *) hash_search(filenode_map, &key, HASH_FIND, NULL);
+
+	if (entry == NULL)
+		return InvalidOid;
+
+	return entry->relid;
+}
+
+/*
+ * The relations without storage have a NULL filenode; they are skipped below,
+ * rather than in the query, which would compute the filenode twice per row.
+ * An error here ends the BlockReader, so the save-file's database is skipped,
+ * and the other databases are restored as usual.
+ */
+static void
+BuildFilenodeMap(bool any_tablespace)
+{
+	HASHCTL		ctl;
+	int			ret;
+	uint64		i;
+
+	ret = SPI_execute("select pg_relation_filenode(oid), oid, reltablespace from pg_class",
+					  true, 0);
+
+	if (ret != SPI_OK_SELECT)
+		ereport(ERROR,
+				(errmsg("Block Reader: could not map the filenodes of database %u: SPI_execute failed: error code %d",
+						MyDatabaseId, ret)));
+
+	MemSet(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(FilenodeMapKey);
+	ctl.entrysize = sizeof(FilenodeMapEntry);
+
+	filenode_map = hash_create("pg_hibernator filenode map",
+								Max(SPI_processed, 1024), &ctl,
+								HASH_ELEM | HASH_BLOBS);
+
+	for (i = 0; i < SPI_processed; ++i)
+	{
+		bool				isnull;
+		bool				found;
+		FilenodeMapKey		key;
+		FilenodeMapEntry   *entry;
+
+		MemSet(&key, 0, sizeof(key));
+		key.filenode = DatumGetObjectId(SPI_getbinval(SPI_tuptable->vals[i],
+													  SPI_tuptable->tupdesc, 1, &isnull));
+		if (isnull)
+			continue;
+
+		/* The save-files name the database's default tablespace explicitly. */
+		if (!any_tablespace)
+		{
+			key.tablespace = DatumGetObjectId(SPI_getbinval(SPI_tuptable->vals[i],
+															SPI_tuptable->tupdesc, 3, &isnull));
+			if (key.tablespace == InvalidOid)
+				key.tablespace = MyDatabaseTableSpace;
+		}
+
+		entry = (FilenodeMapEntry *) hash_search(filenode_map, &key, HASH_ENTER, &found);
+
+		/*
+		 * Without the tablespace, relations in different tablespaces can have
+		 * the same filenode; like the per-filenode lookup used to, pick any one
+		 * of them.
+		 */
+		if (!found)
+			entry->relid = DatumGetObjectId(SPI_getbinval(SPI_tuptable->vals[i],
+												SPI_tuptable->tupdesc, 2, &isnull));
+	}
+
+	SPI_freetuptable(SPI_tuptable);
+
+	ereport(DEBUG1,
+			(errmsg("BlockReader: mapped %ld filenodes", hash_get_num_entries(filenode_map))));
+}
+
+/*
+ * Read a block into shared buffers, and let go of it right away. Returns false,
+ * without touching the buffer, if the block is in shared buffers already.
+ *
+ * Pinning a resident block would bump its usage count, so the restore would
+ * make the blocks it comes across look hotter to the clock sweep than the
+ * queries have made them. A block read afresh gets the lowest usage count, as
+ * with any access without a strategy; a ring strategy would have the restored
+ * blocks evict each other. Only the blocks that weren't in shared buffers
+ * already count against the rate limit.
+ */
+static bool
+ReadOneBlock(Relation rel, ForkNumber forknum, BlockNumber blocknum)
+{
+	if (IsBlockResident(rel, forknum, blocknum))
+	{
+		++blocks_resident;
+		return false;
+	}
+
+	ReleaseBuffer(ReadThrottledBuffer(rel, forknum, blocknum));
+
+	return true;
+}
+
+/*
+ * Is the block in shared buffers? This only looks up the buffer mapping table,
+ * so the answer may be stale by the time the caller acts on it; that does no
+ * harm, a block loaded meanwhile is just read as a hit.
+ */
+static bool
+IsBlockResident(Relation rel, ForkNumber forknum, BlockNumber blocknum)
+{
+	BufferTag	tag;
+	uint32		hash;
+	LWLock	   *partition_lock;
+	int			buf_id;
+
+	/* rd_node, unlike rd_smgr, is valid even after a relcache flush. */
+	INIT_BUFFERTAG(tag, rel->rd_node, forknum, blocknum);
+	hash = BufTableHashCode(&tag);
+	partition_lock = BufMappingPartitionLock(hash);
+
+	LWLockAcquire(partition_lock, LW_SHARED);
+	buf_id = BufTableLookup(&tag, hash);
+	LWLockRelease(partition_lock);
+
+	return buf_id >= 0;
+}
+
+/* Read the block into shared buffers, and return it pinned; see ReadOneBlock. */
+static Buffer
+ReadThrottledBuffer(Relation rel, ForkNumber forknum, BlockNumber blocknum)
+{
+	Buffer		buf;
+	long		blks_read = pgBufferUsage.shared_blks_read;
+	TimestampTz	start = 0;
+
+	if (guc_max_restore_rate > 0)
+	{
+		ThrottleRead();
+		start = GetCurrentTimestamp();
+	}
+
+	buf = ReadBufferExtended(rel, forknum, blocknum, RBM_NORMAL, NULL);
+
+	if (start != 0 && pgBufferUsage.shared_blks_read != blks_read)
+		ChargeRead(start, GetCurrentTimestamp());
+
+	return buf;
+}
+
+/*
+ * Sleep until the token bucket has room for another read; see
+ * THROTTLE_BURST_US. The bucket may be many seconds behind, with several
+ * readers slowed down, so we sleep at most a second at a time, to notice
+ * SIGTERM, and the rate limit being lifted, soon enough.
+ */
+static void
+ThrottleRead(void)
+{
+	for (;;)
+	{
+		TimestampTz	now = GetCurrentTimestamp();
+		TimestampTz	tat = (TimestampTz) pg_atomic_read_u64(&shared_mem->throttle_tat);
+
+		if (tat <= now + THROTTLE_BURST_US)
+			break;
+
+		pg_usleep(Min(tat - now - THROTTLE_BURST_US, 1000 * 1000L));
+
+		CHECK_FOR_INTERRUPTS();
+
+		if (got_sighup)
+		{
+			got_sighup = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		if (got_sigterm || guc_max_restore_rate == 0)
+			break;
+	}
+}
+
+/*
+ * Charge the token bucket for a read from disk that took from start to end,
+ * and adjust our slowdown to the latency of the reads; see ReadThrottle.
+ */
+static void
+ChargeRead(TimestampTz start, TimestampTz end)
+{
+	double		latency_us = (double) (end - start);
+	uint64		cost;
+	uint64		tat;
+	uint64		new_tat;
+
+	if (my_throttle.latency_us == 0)
+		my_throttle.latency_us = latency_us;
+	else
+		my_throttle.latency_us = 0.9 * my_throttle.latency_us + 0.1 * latency_us;
+
+	if (++my_throttle.nreads >= THROTTLE_ADJUST_READS)
+	{
+		int		slowdown = my_throttle.slowdown;
+
+		my_throttle.nreads = 0;
+
+		if (guc_throttle_read_latency <= 0)
+			slowdown = 1;
+		else if (my_throttle.latency_us > guc_throttle_read_latency * 1000)
+			slowdown = Min(slowdown * 2, THROTTLE_MAX_SLOWDOWN);
+		else if (my_throttle.latency_us < guc_throttle_read_latency * 1000 / 2)
+			slowdown = Max(slowdown / 2, 1);
+
+		if (slowdown != my_throttle.slowdown)
+			ereport(DEBUG1,
+					(errmsg("Block Reader: read latency %.3f ms, reading at 1/%d of pg_hibernator.max_restore_mb_per_sec",
+							my_throttle.latency_us / 1000, slowdown)));
+
+		my_throttle.slowdown = slowdown;
+	}
+
+	/* Microseconds it takes to read a block at the rate limit, slowed down. */
+	cost = (uint64) ((double) BLCKSZ * USECS_PER_SEC * my_throttle.slowdown
+					 / ((double) guc_max_restore_rate * 1024 * 1024));
+
+	/* Idle time doesn't add up to more than a burst; see ThrottleRead(). */
+	tat = pg_atomic_read_u64(&shared_mem->throttle_tat);
+	do
+	{
+		new_tat = Max(tat, (uint64) end) + cost;
+	} while (!pg_atomic_compare_exchange_u64(&shared_mem->throttle_tat, &tat, new_tat));
+}
+
+/*
+ * Issue a prefetch request for the block, and add it to the tail of the queue.
+ * If that makes the queue longer than prefetch_distance, read the block at
+ * the head of the queue; by now its prefetch request has had the time to
+ * complete, or at least to be in flight alongside the other requests.
+ *
+ * When prefetching is disabled, the block is read right away. The caller passes
+ * prefetch = false if it has already asked the kernel to read ahead the block.
+ *
+ * Returns the number of blocks read into shared buffers.
+ */
+static BlockNumber
+QueueBlock(PrefetchQueue *queue, Relation rel, ForkNumber forknum, BlockNumber blocknum, bool prefetch)
+{
+	BlockNumber	nread = 0;
+
+	if (queue->size == 0)
+		return ReadOneBlock(rel, forknum, blocknum) ? 1 : 0;
+
+	/* Don't take up a place in the queue, or prefetch, for a resident block. */
+	if (IsBlockResident(rel, forknum, blocknum))
+	{
+		++blocks_resident;
+		return 0;
+	}
+
+	if (queue->count == queue->size)
+	{
+		if (ReadOneBlock(rel, forknum, queue->blocks[queue->head]))
+			nread = 1;
+		queue->head = (queue->head + 1) % queue->size;
+		--queue->count;
+	}
+
+	if (prefetch)
+		PrefetchBuffer(rel, forknum, blocknum);
+
+	queue->blocks[(queue->head + queue->count) % queue->size] = blocknum;
+	++queue->count;
+
+	return nread;
+}
+
+/*
+ * Read all the blocks in the queue, oldest first. Returns the number of blocks
+ * read into shared buffers.
+ */
+static BlockNumber
+DrainPrefetchQueue(PrefetchQueue *queue, Relation rel, ForkNumber forknum)
+{
+	BlockNumber	nread = 0;
+
+	while (queue->count > 0)
+	{
+		if (ReadOneBlock(rel, forknum, queue->blocks[queue->head]))
+			++nread;
+		queue->head = (queue->head + 1) % queue->size;
+		--queue->count;
+	}
+
+	queue->head = 0;
+
+	return nread;
+}
+
+/*
+ * Ask the kernel to read ahead 'count' blocks of the relation fork, starting at
+ * 'start', using one posix_fadvise() call per segment file instead of one per
+ * block. The kernel then reads the range using large requests, and the
+ * subsequent ReadBufferExtended() calls find the blocks in the OS cache.
+ *
+ * This is only a hint, so any failure to open the segment file is ignored.
+ */
+static void
+PrefetchRange(SegmentFile *seg, Relation rel, ForkNumber forknum, BlockNumber start, BlockNumber count)
+{
+#ifdef USE_PREFETCH
+	while (count > 0)
+	{
+		BlockNumber	segno	= start / ((BlockNumber) RELSEG_SIZE);
+		BlockNumber	segoff	= start % ((BlockNumber) RELSEG_SIZE);
+		BlockNumber	nblocks	= Min(count, ((BlockNumber) RELSEG_SIZE) - segoff);
+
+		if (seg->fd < 0
+			|| !RelFileNodeEquals(seg->rnode, rel->rd_node)
+			|| seg->forknum != forknum
+			|| seg->segno != segno)
+		{
+			char   *path;
+			char   *segpath;
+
+			CloseSegmentFile(seg);
+
+			path = relpathbackend(rel->rd_node, rel->rd_backend, forknum);
+			if (segno > 0)
+				segpath = psprintf("%s.%u", path, segno);
+			else
+				segpath = pstrdup(path);
+
+			seg->fd = OpenTransientFile(segpath, O_RDONLY | PG_BINARY, 0);
+			seg->rnode = rel->rd_node;
+			seg->forknum = forknum;
+			seg->segno = segno;
+
+			pfree(segpath);
+			pfree(path);
+
+			if (seg->fd < 0)
+				return;
+		}
+
+		(void) posix_fadvise(seg->fd, (off_t) segoff * BLCKSZ,
+							 (off_t) nblocks * BLCKSZ, POSIX_FADV_WILLNEED);
+
+		start += nblocks;
+		count -= nblocks;
+	}
+#endif	/* USE_PREFETCH */
+}
+
+/*
+ * Ask the kernel to read ahead the blocks of the 'count' blocks starting at
+ * 'start' that aren't in shared buffers, coalescing each run of them into one
+ * PrefetchRange() call; reading ahead the resident blocks would only waste
+ * I/O, since we're not going to read them.
+ */
+static void
+PrefetchMissingBlocks(SegmentFile *seg, Relation rel, ForkNumber forknum,
+					  BlockNumber start, BlockNumber count)
+{
+	BlockNumber	run_start = InvalidBlockNumber;
+	BlockNumber	block;
+
+	for (block = start; block < start + count; ++block)
+	{
+		if (!IsBlockResident(rel, forknum, block))
+		{
+			if (run_start == InvalidBlockNumber)
+				run_start = block;
+		}
+		else if (run_start != InvalidBlockNumber)
+		{
+			PrefetchRange(seg, rel, forknum, run_start, block - run_start);
+			run_start = InvalidBlockNumber;
+		}
+	}
+
+	if (run_start != InvalidBlockNumber)
+		PrefetchRange(seg, rel, forknum, run_start, block - run_start);
+}
+
+/*
+ * Restore the blocks first through last, both inclusive, of the relation fork,
+ * asking the kernel to read ahead pg_hibernator.range_read_size blocks at a
+ * time, one chunk ahead of the blocks we are reading. The blocks already in
+ * shared buffers are skipped; see ReadOneBlock().
+ *
+ * Returns the number of blocks read into shared buffers.
+ */
+static BlockNumber
+RestoreRange(PrefetchQueue *queue, SegmentFile *seg, Relation rel,
+			ForkNumber forknum, BlockNumber first, BlockNumber last)
+{
+	BlockNumber	block;
+	BlockNumber	nread = 0;
+
+	for (block = first; block <= last; ++block)
+	{
+		if (guc_range_read_size > 0
+			&& (block - first) % guc_range_read_size == 0)
+		{
+			BlockNumber	next_chunk = block + guc_range_read_size;
+
+			if (block == first)
+				PrefetchMissingBlocks(seg, rel, forknum, block,
+									  Min(guc_range_read_size, last - block + 1));
+
+			if (next_chunk <= last)
+				PrefetchMissingBlocks(seg, rel, forknum, next_chunk,
+									  Min(guc_range_read_size, last - next_chunk + 1));
+		}
+
+		nread += QueueBlock(queue, rel, forknum, block, guc_range_read_size == 0);
+	}
+
+	return nread;
+}
+
+/*
+ * Account for the block in the sequence of work units, and return true if the
+ * block falls in a unit claimed by us; see WorkUnitClaim.
+ */
+static bool
+ClaimBlock(WorkUnitClaim *claim, BlockNumber blocknum)
+{
+	BlockNumber	chunk = blocknum / BLOCKS_PER_WORK_UNIT;
+
+	if (chunk != claim->chunk)
+	{
+		uint32	unit = claim->nunits++;
+
+		claim->chunk = chunk;
+
+		/*
+		 * If we've moved past the unit we claimed, claim another one. The
+		 * counter has moved past our last claim, so this can't be a unit that
+		 * we've already parsed.
+		 */
+		if (claim->claimed < unit)
+			claim->claimed = pg_atomic_fetch_add_u32(claim->next_unit, 1);
+
+		claim->owned = (claim->claimed == unit);
+	}
+
+	return claim->owned;
+}
+
+/*
+ * Look up and open the relation, and check the fork, unless already done.
+ * Returns false if the fork's blocks can't be restored, because the relation
+ * has been rewritten/dropped since we saved it, or the fork doesn't exist
+ * anymore.
+ */
+static bool
+PrepareFork(ReaderFork *fork)
+{
+	if (!fork->rel_checked)
+	{
+		Oid		relOid = GetRelOid(fork->tablespace, fork->filenode);
+
+		fork->rel_checked = true;
+		my_stats->current_relid = relOid;
+
+		ereport(DEBUG3, (errmsg("processing filenode %u, relation %u",
+								fork->filenode, relOid)));
+
+		if (relOid != InvalidOid)
+		{
+			/* Open the relation */
+			fork->rel = relation_open(relOid, AccessShareLock);
+			RelationOpenSmgr(fork->rel);
+		}
+	}
+
+	if (fork->rel == NULL)
+		return false;
+
+	if (!fork->fork_checked)
+	{
+		fork->fork_checked = true;
+
+		ereport(DEBUG3, (errmsg("processing fork %d", fork->forknum)));
+
+		fork->fork_exists = smgrexists(fork->rel->rd_smgr, fork->forknum);
+		fork->nblocks = fork->fork_exists
+						? RelationGetNumberOfBlocksInFork(fork->rel, fork->forknum)
+						: 0;
+	}
+
+	return fork->fork_exists;
+}
+
+/* See RestoreJob. */
+static StructureClass
+ClassifyFork(ReaderFork *fork)
+{
+	Form_pg_class	relform = fork->rel->rd_rel;
+
+	if (fork->forknum == VISIBILITYMAP_FORKNUM || fork->forknum == FSM_FORKNUM ||
+		IsCatalogRelation(fork->rel))
+		return STRUCTURE_ALL;
+
+	if (fork->forknum == MAIN_FORKNUM && relform->relkind == RELKIND_INDEX &&
+		relform->relam == BTREE_AM_OID)
+		return STRUCTURE_BTREE;
+
+	return STRUCTURE_NONE;
+}
+
+/*
+ * Should this job restore the blocks of the prepared fork? The structure job
+ * restores the upper levels of a B-tree index itself, and adds the blocks it
+ * read to *blocks_restored; see RestoreJob.
+ *
+ * The readers of the slot all parse the same records, but only one of them
+ * claims the fork's first block record, so only that one walks the index; the
+ * others would only find the same pages in shared buffers.
+ */
+static bool
+WantFork(ReaderFork *fork, int level, bool structure_first, BlockNumber *blocks_restored)
+{
+	StructureClass	class;
+
+	if (!structure_first)
+		return true;
+
+	class = ClassifyFork(fork);
+
+	if (level != SAVEFILE_STRUCTURE_LEVEL)
+		return class != STRUCTURE_ALL;
+
+	if (class == STRUCTURE_BTREE && fork->block_records == 1)
+		*blocks_restored += RestoreIndexUpperLevels(fork->rel);
+
+	return class == STRUCTURE_ALL;
+}
+
+/*
+ * Read the metapage, the root, and the internal pages of the B-tree index, one
+ * level at a time, but none of its leaf pages. Returns the number of pages
+ * read from disk; those found in shared buffers don't count, like elsewhere
+ * in the restore; see ReadOneBlock().
+ *
+ * The index may be split concurrently, so this may miss a few pages, which
+ * does no harm; the other jobs restore the saved blocks of the index anyway.
+ */
+static BlockNumber
+RestoreIndexUpperLevels(Relation rel)
+{
+	Buffer			buf;
+	Page			page;
+	BTMetaPageData *metad;
+	BlockNumber		root;
+	uint32			root_level;
+	BlockNumber	   *current;
+	int				ncurrent;
+	long			reads_before = pgBufferUsage.shared_blks_read;
+	uint32			tree_level;
+
+	buf = ReadThrottledBuffer(rel, MAIN_FORKNUM, BTREE_METAPAGE);
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	page = BufferGetPage(buf);
+	metad = BTPageGetMeta(page);
+
+	if (!P_ISMETA((BTPageOpaque) PageGetSpecialPointer(page)) ||
+		metad->btm_magic != BTREE_MAGIC)
+	{
+		UnlockReleaseBuffer(buf);
+		return (BlockNumber) (pgBufferUsage.shared_blks_read - reads_before);
+	}
+
+	root = metad->btm_root;
+	root_level = metad->btm_level;
+	UnlockReleaseBuffer(buf);
+
+	if (root == P_NONE)
+		return (BlockNumber) (pgBufferUsage.shared_blks_read - reads_before);
+
+	current = palloc(sizeof(BlockNumber));
+	current[0] = root;
+	ncurrent = 1;
+
+	for (tree_level = root_level; ncurrent > 0; --tree_level)
+	{
+		BlockNumber	   *children = NULL;
+		int				nchildren = 0;
+		int				maxchildren = 0;
+		int				i;
+
+		for (i = 0; i < ncurrent; ++i)
+		{
+			BTPageOpaque	opaque;
+			OffsetNumber	offnum;
+			OffsetNumber	maxoff;
+
+			if (got_sigterm || RestoreBudgetExhausted())
+				break;
+
+			buf = ReadThrottledBuffer(rel, MAIN_FORKNUM, current[i]);
+
+			/* Internal pages of level 1 point to the leaves, which we leave alone. */
+			if (tree_level <= 1)
 			{
-				BlockNumber block;
+				ReleaseBuffer(buf);
+				continue;
+			}
+
+			LockBuffer(buf, BUFFER_LOCK_SHARE);
+			page = BufferGetPage(buf);
+			opaque = (BTPageOpaque) PageGetSpecialPointer(page);
+
+			if (P_ISLEAF(opaque) || P_IGNORE(opaque))
+			{
+				UnlockReleaseBuffer(buf);
+				continue;
+			}
+
+			maxoff = PageGetMaxOffsetNumber(page);
+			for (offnum = P_FIRSTDATAKEY(opaque); offnum <= maxoff; offnum = OffsetNumberNext(offnum))
+			{
+				IndexTuple	itup = (IndexTuple) PageGetItem(page, PageGetItemId(page, offnum));
+
+				if (nchildren == maxchildren)
+				{
+					maxchildren = Max(maxchildren * 2, 64);
+					children = children
+								? repalloc(children, sizeof(BlockNumber) * maxchildren)
+								: palloc(sizeof(BlockNumber) * maxchildren);
+				}
+
+				children[nchildren++] = ItemPointerGetBlockNumber(&itup->t_tid);
+			}
+
+			UnlockReleaseBuffer(buf);
+		}
+
+		pfree(current);
+		current = children;
+		ncurrent = nchildren;
+
+		if (got_sigterm || RestoreBudgetExhausted() || tree_level == 0)
+			break;
+	}
+
+	if (current)
+		pfree(current);
+
+	return (BlockNumber) (pgBufferUsage.shared_blks_read - reads_before);
+}
+
+static void
+CloseSegmentFile(SegmentFile *seg)
+{
+	if (seg->fd >= 0)
+		CloseTransientFile(seg->fd);
+
+	seg->fd = -1;
+}
+
+/* Milliseconds elapsed between the two timestamps */
+static double
+ElapsedMs(TimestampTz start, TimestampTz end)
+{
+	long	secs;
+	int		usecs;
+
+	TimestampDifference(start, end, &secs, &usecs);
+
+	return secs * 1000.0 + usecs / 1000.0;
+}
+
+/*
+ * Returns the entry to count the blocks of the database in; see
+ * DatabaseComposition.
+ */
+static DatabaseComposition *
+AddDatabaseComposition(SaveStats *stats, Oid database)
+{
+	DatabaseComposition *comp;
+
+	if (stats->overflow)
+		return &stats->composition[SAVE_STATS_MAX_DATABASES];
+
+	comp = &stats->composition[stats->ncomposition++];
+
+	if (stats->ncomposition > SAVE_STATS_MAX_DATABASES)
+	{
+		stats->overflow = true;
+		comp->database = InvalidOid;
+		return comp;
+	}
+
+	comp->database = database;
+
+	return comp;
+}
+
+/*
+ * Number of blocks all the BlockReaders may restore, together, in a restore; a
+ * fraction of shared_buffers.
+ *
+ * Restoring more blocks than fit in shared_buffers would only evict the blocks
+ * restored earlier, which are the hotter ones; see RestoreJob. This also caps
+ * the restore when shared_buffers is smaller than when the blocks were saved.
+ *
+ * A restore is the jobs queued by one RegisterBlockReaders() call: the restore
+ * at startup, that of each pg_hibernator_restore(), and each round of a
+ * followed snapshot. Each has a budget of its own, from the time it's queued,
+ * so a restore asked for while another one is running neither eats into the
+ * other's budget, nor gives it a fresh one. Its blocks are counted in the
+ * slots of its running jobs, and when a slot is reaped, they are carried over
+ * to the restore_base of its other slots, and to the BufferSaver's
+ * RestoreBudgetUse; see RetireSlotBudget().
+ */
+static uint32
+RestoreBudget(void)
+{
+	return (uint32) (guc_max_restore_fraction * NBuffers);
+}
+
+/* Has the BlockReader's restore used up its budget? */
+static bool
+RestoreBudgetExhausted(void)
+{
+	Assert(my_slot != NULL);
+
+	return RestoreBlocksSpent(my_slot->restore_id, 0) >= RestoreBudget();
+}
+
+/*
+ * Number of blocks restored so far by the restore. 'finished' counts those of
+ * its finished jobs, for when none of its jobs is running; otherwise their
+ * slots know.
+ */
+static uint32
+RestoreBlocksSpent(uint32 restore_id, uint32 finished)
+{
+	uint32		spent = 0;
+	bool		running = false;
+	int			i;
+
+	LWLockAcquire(shared_mem->lock, LW_SHARED);
+
+	for (i = 0; i < shared_mem->nslots; ++i)
+	{
+		RestoreSlot *slot = &shared_mem->slots[i];
+
+		if (slot->restore_id != restore_id)
+			continue;
+
+		if (!running)
+			spent = pg_atomic_read_u32(&slot->restore_base);
+		running = true;
+
+		spent += pg_atomic_read_u32(&slot->blocks_restored);
+	}
+
+	LWLockRelease(shared_mem->lock);
+
+	return running ? spent : finished;
+}
+
+/* Used only in BufferSaver. */
+static RestoreBudgetUse *
+GetRestoreBudgetUse(uint32 restore_id)
+{
+	ListCell   *lc;
+
+	foreach(lc, restores)
+	{
+		RestoreBudgetUse *use = (RestoreBudgetUse *) lfirst(lc);
+
+		if (use->restore_id == restore_id)
+			return use;
+	}
+
+	return NULL;
+}
+
+/*
+ * Carry the blocks restored by the slot's job over to the rest of its restore,
+ * and take the slot out of the restore; see RestoreBudget(). The caller holds
+ * the lock exclusively.
+ *
+ * Used only in BufferSaver.
+ */
+static void
+RetireSlotBudget(int slotno)
+{
+	RestoreSlot		   *slot = &shared_mem->slots[slotno];
+	RestoreBudgetUse   *use;
+	uint32				blocks;
+	int					i;
+
+	if (slot->restore_id == 0)
+		return;
+
+	blocks = pg_atomic_read_u32(&slot->blocks_restored);
+
+	for (i = 0; i < shared_mem->nslots; ++i)
+		if (i != slotno && shared_mem->slots[i].restore_id == slot->restore_id)
+			pg_atomic_fetch_add_u32(&shared_mem->slots[i].restore_base, blocks);
+
+	use = GetRestoreBudgetUse(slot->restore_id);
+	if (use != NULL)
+		use->blocks_restored += blocks;
+
+	slot->restore_id = 0;
+}
+
+/*
+ * Forget the restores that have neither a pending job nor a slot left.
+ *
+ * Used only in BufferSaver.
+ */
+static void
+ForgetFinishedRestores(void)
+{
+	ListCell   *lc;
+	ListCell   *prev = NULL;
+	ListCell   *next;
+
+	for (lc = list_head(restores); lc != NULL; lc = next)
+	{
+		RestoreBudgetUse *use = (RestoreBudgetUse *) lfirst(lc);
+		ListCell   *jc;
+		bool		active = false;
+		int			i;
+
+		next = lnext(lc);
+
+		foreach(jc, pendingJobs)
+		{
+			if (((RestoreJob *) lfirst(jc))->restore_id == use->restore_id)
+			{
+				active = true;
+				break;
+			}
+		}
+
+		LWLockAcquire(shared_mem->lock, LW_SHARED);
+		for (i = 0; !active && i < shared_mem->nslots; ++i)
+			if (shared_mem->slots[i].restore_id == use->restore_id)
+				active = true;
+		LWLockRelease(shared_mem->lock);
+
+		if (active)
+		{
+			prev = lc;
+			continue;
+		}
+
+		restores = list_delete_cell(restores, lc, prev);
+		pfree(use);
+	}
+}
+
+/*
+ * Forget the pending jobs of the restore, and remove their save-files, since
+ * they won't be restored. If a job of the save-file is being restored, leave
+ * the removal to it; see ReleaseRestoreSlot(). The save-files of snapshots are
+ * kept. Returns the number of jobs forgotten.
+ */
+static int
+DiscardPendingJobs(uint32 restore_id)
+{
+	ListCell   *lc;
+	ListCell   *prev = NULL;
+	ListCell   *next;
+	int			ndiscarded = 0;
+
+	for (lc = list_head(pendingJobs); lc != NULL; lc = next)
+	{
+		RestoreJob *job = (RestoreJob *) lfirst(lc);
+		bool		running = false;
+		int			i;
+
+		next = lnext(lc);
+
+		if (job->restore_id != restore_id)
+		{
+			prev = lc;
+			continue;
+		}
+
+		pendingJobs = list_delete_cell(pendingJobs, lc, prev);
+		++ndiscarded;
+
+		if (job->snapshot[0] != '\0')
+		{
+			pfree(job);
+			continue;
+		}
+
+		LWLockAcquire(shared_mem->lock, LW_EXCLUSIVE);
+
+		for (i = 0; i < shared_mem->nslots; ++i)
+		{
+			if (shared_mem->slots[i].filenum == job->filenum
+				&& shared_mem->slots[i].snapshot[0] == '\0')
+			{
+				shared_mem->slots[i].remove_file = true;
+				running = true;
+				break;
+			}
+		}
+
+		LWLockRelease(shared_mem->lock);
+
+		if (!running)
+		{
+			const char *filepath = getSavefileName(job->filenum);
+
+			/* The file is gone if we've seen another of its jobs already. */
+			if (remove(filepath) != 0 && errno != ENOENT)
+				ereport(WARNING,
+						(errcode_for_file_access(),
+						errmsg("error removing file \"%s\" : %m", filepath)));
+		}
+
+		pfree(job);
+	}
+
+	return ndiscarded;
+}
+
+/*
+ * Restore the followed snapshot if it changed since we last restored it, but
+ * not more often than once per pg_hibernator.follow_interval, and not while
+ * another restore is in progress. Each restore is limited by
+ * pg_hibernator.max_restore_fraction; the blocks still in shared buffers from
+ * the previous round are skipped, and don't count against it (see
+ * ReadOneBlock()), so the rounds after the first read only what the primary
+ * cached since. Returns the milliseconds until the next check.
+ */
+static long
+FollowSnapshot(void)
+{
+	static TimestampTz	last_check_time = 0;
+	static bool			followed_any = false;
+	static uint64		followed_generation = 0;
+	static char			followed_snapshot[NAMEDATALEN] = "";
+	TimestampTz			now = GetCurrentTimestamp();
+	TimestampTz			next_check_time;
+	uint64				generation;
+	long				interval = guc_follow_interval * 1000L;
+
+	next_check_time = TimestampTzPlusMilliseconds(last_check_time, interval);
+
+	if (now < next_check_time)
+	{
+		long	secs;
+		int		usecs;
+
+		TimestampDifference(now, next_check_time, &secs, &usecs);
+		return secs * 1000L + usecs / 1000 + 1;
+	}
+
+	/* Check again once the restore is done; the BlockReaders wake us up. */
+	if (RestoreInProgress())
+		return interval;
+
+	last_check_time = now;
+
+	/* Start afresh if we're asked to follow another snapshot. */
+	if (strcmp(followed_snapshot, guc_follow_snapshot) != 0)
+	{
+		strlcpy(followed_snapshot, guc_follow_snapshot, sizeof(followed_snapshot));
+		followed_any = false;
+	}
+
+	/*
+	 * Every save of the snapshot has a generation of its own, so unlike the
+	 * modification times, it changes even if the primary saves twice within a
+	 * second.
+	 */
+	if (!SnapshotGeneration(followed_snapshot, &generation)
+		|| (followed_any && generation == followed_generation))
+		return interval;
+
+	ereport(LOG,
+			(errmsg("Buffer Saver: restoring followed snapshot \"%s\"",
+					followed_snapshot)));
+
+	RegisterBlockReaders(followed_snapshot);
+	followed_any = true;
+	followed_generation = generation;
+
+	return interval;
+}
+
+/*
+ * Get the generation of the snapshot, from its generation.id; see
+ * WriteSaveGeneration(). A snapshot copied from a server that predates the
+ * generations has none, and then it's that of its save-files, which is 0.
+ * Returns false if the snapshot has no save-files yet.
+ */
+static bool
+SnapshotGeneration(const char *snapshot, uint64 *generation)
+{
+	char			hibernate_dir[MAXPGPATH];
+	DIR			   *dir;
+	struct dirent  *dent;
+	bool			found = false;
+
+	strlcpy(hibernate_dir, getSnapshotDirectory(snapshot), sizeof(hibernate_dir));
+
+	if (ReadSaveGeneration(hibernate_dir, generation))
+		return true;
+
+	/* The snapshot may not have arrived yet. */
+	dir = opendir(hibernate_dir);
+	if (dir == NULL)
+		return false;
+
+	while ((dent = readdir(dir)) != NULL)
+	{
+		int			filenum;
+		uint32		level_blocks[SAVEFILE_USAGE_LEVELS];
+		Oid			database;
+		Oid			tablespace;
+		uint64		file_generation;
+
+		if (!parseSavefileName(dent->d_name, &filenum))
+			continue;
+
+		(void) savefileReadUsageLevels(getSavefilePath(hibernate_dir, filenum),
+									   level_blocks, &database, &tablespace,
+									   &file_generation);
+
+		*generation = found ? Max(*generation, file_generation) : file_generation;
+		found = true;
+	}
+
+	closedir(dir);
+
+	return found;
+}
+
+/*
+ * Serve the request a backend made, if any; see SubmitRequest(). For a restore
+ * we only queue the jobs, and leave the launching of BlockReaders to
+ * DispatchBlockReaders(), like for the restore at startup.
+ */
+static void
+ServeRequest(void)
+{
+	HibernatorRequest	request;
+	char				snapshot[NAMEDATALEN];
+	int64				result = -1;
+
+	LWLockAcquire(shared_mem->lock, LW_SHARED);
+	request = shared_mem->request;
+	strlcpy(snapshot, shared_mem->request_snapshot, sizeof(snapshot));
+	LWLockRelease(shared_mem->lock);
+
+	switch (request)
+	{
+		case REQUEST_NONE:
+			return;
+
+		case REQUEST_SAVE:
+			ereport(LOG,
+					(errmsg("Buffer Saver: saving snapshot \"%s\"", snapshot)));
+			result = SaveSnapshot(snapshot);
+			break;
+
+		case REQUEST_RESTORE:
+			ereport(LOG,
+					(errmsg("Buffer Saver: restoring snapshot \"%s\"", snapshot)));
+
+			/* It gets a restore budget of its own; see RestoreBudget(). */
+			result = RegisterBlockReaders(snapshot);
+			break;
+	}
+
+	CompleteRequest(result);
+}
+
+/*
+ * Save the snapshot for a request. Returns the number of blocks saved, or -1 if
+ * the save failed.
+ *
+ * A failed save fails the request, not the BufferSaver: the error is reported
+ * and cleaned up after here, as the main loops of the auxiliary processes do,
+ * and we carry on. The name, which pg_hibernator_save() has checked already,
+ * and the directory are checked first, so that the usual mistakes don't get as
+ * far as the scan of the buffers.
+ */
+static int64
+SaveSnapshot(const char *snapshot)
+{
+	const char	   *dir = getSnapshotDirectory(snapshot);
+	MemoryContext	save_context;
+	MemoryContext	oldcontext;
+	struct stat		st;
+	int64			result = -1;
+
+	if (snapshot[0] == '\0' || !isValidSnapshotName(snapshot))
+	{
+		ereport(WARNING,
+				(errmsg("Buffer Saver: invalid snapshot name \"%s\"", snapshot)));
+		return -1;
+	}
+
+	if (mkdir(dir, S_IRWXU) != 0 && errno != EEXIST)
+	{
+		ereport(WARNING,
+				(errcode_for_file_access(),
+				errmsg("Buffer Saver: could not create directory \"%s\": %m", dir)));
+		return -1;
+	}
+
+	if (stat(dir, &st) != 0 || !S_ISDIR(st.st_mode) || access(dir, W_OK | X_OK) != 0)
+	{
+		ereport(WARNING,
+				(errmsg("Buffer Saver: \"%s\" is not a writable directory", dir)));
+		return -1;
+	}
+
+	save_context = AllocSetContextCreate(TopMemoryContext,
+										 "pg_hibernator snapshot save",
+										 ALLOCSET_DEFAULT_SIZES);
+	oldcontext = MemoryContextSwitchTo(save_context);
+
+	PG_TRY();
+	{
+		result = SaveBuffers(snapshot, "");
+	}
+	PG_CATCH();
+	{
+		HOLD_INTERRUPTS();
+
+		EmitErrorReport();
 
-				Assert(record_blocknum != InvalidBlockNumber);
+		LWLockReleaseAll();
+#if PG_VERSION_NUM >= 110000
+		AtEOXact_Files(false);
+#else
+		AtEOXact_Files();
+#endif
 
-				if (record_blocknum == InvalidBlockNumber)
-					ereport(ERROR,
-							(errmsg("found a block range record without a preceeding block record")));
+		MemoryContextSwitchTo(oldcontext);
+		FlushErrorState();
 
-				fileRead(&record_range, sizeof(int), file, false, filepath);
+		RESUME_INTERRUPTS();
 
-				if (skip_relation || skip_fork || skip_block)
-					continue;
+		pgstat_report_activity(STATE_IDLE, NULL);
 
-				ereport(log_level,
-						(errmsg("reader %d reading range filenode %u forknum %d blocknum %u range %u",
-								filenum, record_filenode, record_forknum, record_blocknum, record_range)));
+		ereport(WARNING,
+				(errmsg("Buffer Saver: could not save snapshot \"%s\"", snapshot)));
+		result = -1;
+	}
+	PG_END_TRY();
 
-				for (block = record_blocknum + 1; block <= (record_blocknum + record_range); ++block)
-				{
-					Buffer	buf;
+	MemoryContextSwitchTo(oldcontext);
+	MemoryContextDelete(save_context);
 
-					/*
-					* Don't try to read past the file; the file may have been
-					* shrunk by a vaccum operation.
-					*/
-					if (block >= nblocks)
-					{
-						ereport(log_level,
-								(errmsg("reader %d skipping block range filenode %u forknum %d start %u end %u",
-										filenum, record_filenode, record_forknum,
-										block, record_blocknum + record_range)));
+	return result;
+}
 
-						break;
-					}
+/*
+ * Complete the outstanding request, if any, with the result, and wake up the
+ * backend waiting for it.
+ */
+static void
+CompleteRequest(int64 result)
+{
+	Latch	   *latch = NULL;
 
-					buf = ReadBufferExtended(rel, record_forknum, block, RBM_NORMAL, NULL);
-					ReleaseBuffer(buf);
+	LWLockAcquire(shared_mem->lock, LW_EXCLUSIVE);
 
-					++blocks_restored;
-				}
-			}
-			break;
-			default:
-			{
-				ereport(ERROR,
-						(errmsg("found unexpected save-file marker %x - %c)", record_type, record_type)));
-				Assert(false);
-			}
-			break;
-		}
+	if (shared_mem->request != REQUEST_NONE)
+	{
+		shared_mem->request = REQUEST_NONE;
+		shared_mem->request_result = result;
+		shared_mem->completed_seq = shared_mem->request_seq;
+		latch = shared_mem->request_latch;
+		shared_mem->request_latch = NULL;
 	}
 
-	if (rel)
-		relation_close(rel, AccessShareLock);
+	LWLockRelease(shared_mem->lock);
 
-	ereport(LOG,
-			(errmsg("Block Reader %d: restored %u blocks",
-					filenum, blocks_restored)));
+	if (latch)
+		SetLatch(latch);
+}
 
-	SPI_finish();
-	PopActiveSnapshot();
-	CommitTransactionCommand();
-	pgstat_report_activity(STATE_IDLE, NULL);
+/*
+ * Ask the BufferSaver to serve a request for the snapshot, and wait for it to
+ * complete. Returns the result of the request, or -1 if the BufferSaver failed
+ * to serve it. There can only be one outstanding request at a time.
+ */
+static int64
+SubmitRequest(HibernatorRequest request, const char *snapshot)
+{
+	uint32		seq;
+	Latch	   *saver_latch;
 
-	fileClose(file, filepath);
+	LWLockAcquire(shared_mem->lock, LW_EXCLUSIVE);
 
-	/* Remove the save-file */
-	if (remove(filepath) != 0)
+	saver_latch = shared_mem->saver_latch;
+
+	if (saver_latch == NULL)
+	{
+		LWLockRelease(shared_mem->lock);
 		ereport(ERROR,
-				(errcode_for_file_access(),
-				errmsg("error removing file \"%s\" : %m", filepath)));
-}
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("Buffer Saver is not running")));
+	}
 
-static void
-BufferSaverMain(Datum main_arg)
-{
-	WorkerCommon();
+	if (shared_mem->request != REQUEST_NONE)
+	{
+		LWLockRelease(shared_mem->lock);
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_IN_USE),
+				 errmsg("another snapshot request is in progress")));
+	}
 
-	RegisterBlockReaders();
+	shared_mem->request = request;
+	strlcpy(shared_mem->request_snapshot, snapshot, sizeof(shared_mem->request_snapshot));
+	shared_mem->request_latch = MyLatch;
+	seq = ++shared_mem->request_seq;
 
-	/*
-	 * Main loop: do this until the SIGTERM handler tells us to terminate
-	 */
-	while (!got_sigterm)
+	LWLockRelease(shared_mem->lock);
+
+	SetLatch(saver_latch);
+
+	for (;;)
 	{
-		int	rc;
+		int64		result;
+		bool		done;
+		int			rc;
 
-		ResetLatch(&MyProc->procLatch);
-		processOnePendingWorker();
+		LWLockAcquire(shared_mem->lock, LW_SHARED);
+		done = (shared_mem->completed_seq == seq);
+		result = shared_mem->request_result;
+		LWLockRelease(shared_mem->lock);
+
+		if (done)
+			return result;
 
 		/*
-		 * Wait on the process latch, which sleeps as necessary, but is awakened
-		 * if postmaster dies. This way the background process goes away
-		 * immediately in case of an emergency.
+		 * The timeout covers a BufferSaver that died without completing the
+		 * request; its next incarnation completes it, see BufferSaverMain().
 		 */
-		rc = WaitLatch(&MyProc->procLatch,
-					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
-					   10 * 1000L);
+		rc = WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+					   1000L);
 
-		/* emergency bailout if postmaster has died */
 		if (rc & WL_POSTMASTER_DEATH)
-			proc_exit(1);
+			ereport(FATAL,
+					(errcode(ERRCODE_ADMIN_SHUTDOWN),
+					 errmsg("terminating connection due to unexpected postmaster exit")));
 
-		/*
-		 * In case of a SIGHUP, just reload the configuration.
-		 */
-		if (got_sighup)
-		{
-			got_sighup = false;
-			ProcessConfigFile(PGC_SIGHUP);
-		}
+		ResetLatch(MyLatch);
+		CHECK_FOR_INTERRUPTS();
 	}
+}
 
-	/*
-	 * We recieved the SIGTERM; Shutdown is in progress, so save the
-	 * shared-buffer contents.
-	 */
+/*
+ * Set up the tuplestore that our set-returning functions return their rows in,
+ * and return it, with the tuple descriptor of the rows in *tupdesc.
+ */
+static Tuplestorestate *
+BeginMaterializedResult(FunctionCallInfo fcinfo, TupleDesc *tupdesc)
+{
+	ReturnSetInfo	   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	Tuplestorestate	   *tupstore;
+	MemoryContext		per_query_ctx;
+	MemoryContext		oldcontext;
 
-	/* Save the buffers only if the extension is enabled. */
-	if (guc_enabled)
-		SaveBuffers();
+	if (shared_mem == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_hibernator must be loaded via shared_preload_libraries")));
 
-	/*
-	 * The worker exits here. A proc_exit(0) is not necessary, we'll let the
-	 * caller do that.
-	 */
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	if (get_call_result_type(fcinfo, NULL, tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = *tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	return tupstore;
 }
 
-static void
-SaveBuffers(void)
-{
-	int						i;
-	int						num_buffers;
-	int						log_level		= DEBUG3;
-	SavedBuffer			   *saved_buffers;
-	BufferDesc			   *bufHdr;
-	uint32				    bufstate;
-	FILE				   *file			= NULL;
-	int						database_counter= 0;
-	Oid						prev_database	= InvalidOid;
-	Oid						prev_filenode	= InvalidOid;
-	ForkNumber				prev_forknum	= InvalidForkNumber;
-	BlockNumber				prev_blocknum	= InvalidBlockNumber;
-	BlockNumber				range_counter	= 0;
-	const char			   *savefile_path = NULL;
+/*
+ * SQL-callable function behind the pg_hibernator_progress view; returns one row
+ * for each BlockReader that is restoring, or has restored, a save-file since
+ * the server started.
+ */
+PG_FUNCTION_INFO_V1(pg_hibernator_get_progress);
 
-	/*
-	 * XXX: If the memory request fails, ask for a smaller memory chunk, and use
-	 * it to create chunks of save-files, and make the workers read those chunks.
-	 *
-	 * This is not a concern as of now, so deferred; there's at least one other
-	 * place that allocates (NBuffers * (much_bigger_struct)), so this seems to
-	 * be an acceptable practice.
-	 */
+Datum
+pg_hibernator_get_progress(PG_FUNCTION_ARGS)
+{
+#define PG_HIBERNATOR_PROGRESS_COLS	14
+	TupleDesc			tupdesc;
+	Tuplestorestate	   *tupstore;
+	int					i;
 
-	saved_buffers = (SavedBuffer *) palloc(sizeof(SavedBuffer) * NBuffers);
+	tupstore = BeginMaterializedResult(fcinfo, &tupdesc);
 
-	/* Lock the buffer partitions for reading. */
-	for (i = 0; i < NUM_BUFFER_PARTITIONS; ++i)
-		LWLockAcquire(BufMappingPartitionLockByIndex(i), LW_SHARED);
+	LWLockAcquire(shared_mem->lock, LW_SHARED);
 
-	/* Scan and save a list of valid buffers. */
-	for (num_buffers = 0, i = 0; i < NBuffers; ++i)
+	for (i = 0; i < shared_mem->nslots; ++i)
 	{
-		bufHdr = &BufferDescriptors[i].bufferdesc;
-		/* Lock each buffer header before inspecting. */
-		bufstate = LockBufHdr(bufHdr);
+		ReaderStats	   *entry = &shared_mem->readers[i];
+		Datum			values[PG_HIBERNATOR_PROGRESS_COLS];
+		bool			nulls[PG_HIBERNATOR_PROGRESS_COLS];
+		const char	   *state;
 
-		/* Skip invalid buffers */
-		if ((bufstate & BM_VALID) && (bufstate & BM_TAG_VALID))
-		{
-			saved_buffers[num_buffers].database	= bufHdr->tag.rnode.dbNode;
-			saved_buffers[num_buffers].filenode	= bufHdr->tag.rnode.relNode;
-			saved_buffers[num_buffers].forknum	= bufHdr->tag.forkNum;
-			saved_buffers[num_buffers].blocknum	= bufHdr->tag.blockNum;
+		if (entry->state == READER_FREE)
+			continue;
 
-			++num_buffers;
+		MemSet(nulls, 0, sizeof(nulls));
+
+		switch (entry->state)
+		{
+			case READER_RUNNING:	state = "restoring";	break;
+			case READER_DONE:		state = "done";			break;
+			case READER_FAILED:		state = "failed";		break;
+			default:				state = "unknown";		break;
 		}
 
-		UnlockBufHdr(bufHdr, bufstate);
-	}
+		values[0] = Int32GetDatum(entry->pid);
+		values[1] = Int32GetDatum(entry->filenum);
 
-	/* Unlock the buffer partitions in reverse order, to avoid a deadlock. */
-	for (i = NUM_BUFFER_PARTITIONS - 1; i >= 0; --i)
-		LWLockRelease(BufMappingPartitionLockByIndex(i));
+		/* The save-file of global objects, and one not yet opened, have no database. */
+		if (entry->database[0] != '\0')
+			values[2] = CStringGetTextDatum(entry->database);
+		else
+			nulls[2] = true;
 
-	/*
-	 * Sort the list, so that we can optimize the storage of these buffers.
-	 *
-	 * The side-effect of this storage optimization is that when reading the
-	 * blocks back from relation forks, it leads to sequential reads, which
-	 * improve the restore speeds quite considerably as compared to random reads
-	 * from different blocks all over the data directory.
-	 */
-	pg_qsort(saved_buffers, num_buffers, sizeof(SavedBuffer), SavedBufferCmp);
+		if (entry->level >= 0)
+			values[3] = Int32GetDatum(entry->level);
+		else
+			nulls[3] = true;
 
-	/* Connect to the database and start a transaction for database name lookups. */
-	BackgroundWorkerInitializeConnection(guc_default_database, NULL);
-	SetCurrentStatementStartTimestamp();
-	StartTransactionCommand();
-	PushActiveSnapshot(GetTransactionSnapshot());
-	pgstat_report_activity(STATE_RUNNING, "saving buffers");
+		values[4] = CStringGetTextDatum(state);
 
-	for (i = 0; i < num_buffers; ++i)
-	{
-		int j;
-		SavedBuffer *buf = &saved_buffers[i];
+		if (entry->blocks_planned != 0)
+			values[5] = Int64GetDatum((int64) entry->blocks_planned);
+		else
+			nulls[5] = true;
 
-		if (i == 0)
-		{
-			/*
-			 * Special case for global objects. The sort brings them to the
-			 * front of the list.
-			 */
+		values[6] = Int64GetDatum((int64) entry->blocks_read);
+		values[7] = Int64GetDatum((int64) entry->blocks_skipped);
+		values[8] = Int64GetDatum((int64) entry->blocks_read * BLCKSZ);
+		values[9] = TimestampTzGetDatum(entry->start_time);
 
-			/* Make sure the first buffer we save belongs to global object. */
-			Assert(buf->database == InvalidOid);
+		if (entry->end_time != 0)
+			values[10] = TimestampTzGetDatum(entry->end_time);
+		else
+			nulls[10] = true;
 
-			/*
-			 * Database number (and save-file name) 1 is reserverd for storing
-			 * list of buffers of global objects.
-			 */
-			database_counter = 1;
+		if (OidIsValid(entry->current_relid))
+			values[11] = ObjectIdGetDatum(entry->current_relid);
+		else
+			nulls[11] = true;
 
-			savefile_path = getSavefileName(database_counter);
-			file = fileOpen(savefile_path, PG_BINARY_W);
-			writeDBName("", file, savefile_path);
+		if (entry->snapshot[0] != '\0')
+			values[12] = CStringGetTextDatum(entry->snapshot);
+		else
+			nulls[12] = true;
 
-			prev_database = buf->database;
-		}
+		if (OidIsValid(entry->tablespace))
+			values[13] = ObjectIdGetDatum(entry->tablespace);
+		else
+			nulls[13] = true;
 
-		if (buf->database != prev_database)
-		{
-			char *dbname;
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
 
-			/*
-			 * We are beginning to process a different database than the
-			 * previous one; close the save-file of previous database, and open
-			 * a new one.
-			 */
-			++database_counter;
+	LWLockRelease(shared_mem->lock);
 
-			dbname = get_database_name(buf->database);
+	tuplestore_donestoring(tupstore);
 
-			Assert(dbname != NULL);
+	return (Datum) 0;
+}
 
-			if (file != NULL)
-				fileClose(file, savefile_path);
+/*
+ * SQL-callable function returning the timings of the phases of the last save,
+ * if there was one since the server started.
+ */
+PG_FUNCTION_INFO_V1(pg_hibernator_last_save);
 
-			savefile_path = getSavefileName(database_counter);
-			file = fileOpen(savefile_path, PG_BINARY_W);
-			writeDBName(dbname, file, savefile_path);
+Datum
+pg_hibernator_last_save(PG_FUNCTION_ARGS)
+{
+#define PG_HIBERNATOR_LAST_SAVE_COLS	8
+	TupleDesc			tupdesc;
+	Tuplestorestate	   *tupstore;
+	Datum				values[PG_HIBERNATOR_LAST_SAVE_COLS];
+	bool				nulls[PG_HIBERNATOR_LAST_SAVE_COLS];
+	SaveStats		   *stats;
 
-			pfree(dbname);
+	tupstore = BeginMaterializedResult(fcinfo, &tupdesc);
 
-			/* Reset trackers appropriately */
-			prev_database	= buf->database;
-			prev_filenode	= InvalidOid;
-			prev_forknum	= InvalidForkNumber;
-			prev_blocknum	= InvalidBlockNumber;
-			range_counter	= 0;
-		}
+	MemSet(nulls, 0, sizeof(nulls));
 
-		if (buf->filenode != prev_filenode)
-		{
-			/* We're beginning to process a new relation; emit a record for it. */
-			fileWrite("r", 1, file, savefile_path);
-			fileWrite(&(buf->filenode), sizeof(Oid), file, savefile_path);
+	LWLockAcquire(shared_mem->lock, LW_SHARED);
 
-			/* Reset trackers appropriately */
-			prev_filenode	= buf->filenode;
-			prev_forknum	= InvalidForkNumber;
-			prev_blocknum	= InvalidBlockNumber;
-			range_counter	= 0;
-		}
+	stats = &shared_mem->last_save;
 
-		if (buf->forknum != prev_forknum)
-		{
-			/*
-			 * We're beginning to process a new fork of this relation; add a
-			 * record for it.
-			 */
-			fileWrite("f", 1, file, savefile_path);
-			fileWrite(&(buf->forknum), sizeof(ForkNumber), file, savefile_path);
+	if (stats->end_time != 0)
+	{
+		values[0] = TimestampTzGetDatum(stats->end_time);
+		values[1] = Int64GetDatum((int64) stats->num_buffers);
+		values[2] = Int32GetDatum(stats->num_databases);
+		values[3] = Float8GetDatum(stats->scan_ms);
+		values[4] = Float8GetDatum(stats->sort_ms);
+		values[5] = Float8GetDatum(stats->write_ms);
+		values[6] = Float8GetDatum(stats->fsync_ms);
+		values[7] = Float8GetDatum(stats->total_ms);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
 
-			/* Reset trackers appropriately */
-			prev_forknum	= buf->forknum;
-			prev_blocknum	= InvalidBlockNumber;
-			range_counter	= 0;
-		}
+	LWLockRelease(shared_mem->lock);
 
-		ereport(log_level,
-				(errmsg("writer: writing block db %d filenode %d forknum %d blocknum %d",
-						database_counter, prev_filenode, prev_forknum, buf->blocknum)));
+	tuplestore_donestoring(tupstore);
 
-		fileWrite("b", 1, file, savefile_path);
-		fileWrite(&(buf->blocknum), sizeof(BlockNumber), file, savefile_path);
+	return (Datum) 0;
+}
 
-		prev_blocknum = buf->blocknum;
+/*
+ * SQL-callable function returning the number of blocks of each fork of each
+ * database saved by the last save.
+ */
+PG_FUNCTION_INFO_V1(pg_hibernator_save_composition);
 
-		/*
-		 * If a continuous range of blocks follows this block, then emit one
-		 * entry for the range, instead of one for each block.
-		 */
-		range_counter = 0;
+Datum
+pg_hibernator_save_composition(PG_FUNCTION_ARGS)
+{
+#define PG_HIBERNATOR_COMPOSITION_COLS	4
+	TupleDesc			tupdesc;
+	Tuplestorestate	   *tupstore;
+	SaveStats		   *stats;
+	int					i;
 
-		for ( j = i+1; j < num_buffers; ++j)
-		{
-			SavedBuffer *tmp = &saved_buffers[j];
+	tupstore = BeginMaterializedResult(fcinfo, &tupdesc);
 
-			if (tmp->database		== prev_database
-				&& tmp->filenode	== prev_filenode
-				&& tmp->forknum		== prev_forknum
-				&& tmp->blocknum	== (prev_blocknum + range_counter + 1))
-			{
-				++range_counter;
-			}
-			else
-			{
-				break;
-			}
-		}
+	/* Take a copy, so that we look up the database names without the lock. */
+	stats = (SaveStats *) palloc(sizeof(SaveStats));
 
-		if (range_counter != 0)
+	LWLockAcquire(shared_mem->lock, LW_SHARED);
+	memcpy(stats, &shared_mem->last_save, sizeof(SaveStats));
+	LWLockRelease(shared_mem->lock);
+
+	for (i = 0; i < stats->ncomposition; ++i)
+	{
+		DatabaseComposition *c = &stats->composition[i];
+		bool		lumped = stats->overflow && i == stats->ncomposition - 1;
+		char	   *dbname = NULL;
+		int			forknum;
+
+		/* NULL if the database has been dropped since. */
+		if (!lumped && c->database != InvalidOid)
+			dbname = get_database_name(c->database);
+
+		for (forknum = 0; forknum <= MAX_FORKNUM; ++forknum)
 		{
-			ereport(log_level,
-				(errmsg("writer: writing range db %d filenode %d forknum %d blocknum %d range %d",
-						database_counter, prev_filenode, prev_forknum, prev_blocknum, range_counter)));
+			Datum	values[PG_HIBERNATOR_COMPOSITION_COLS];
+			bool	nulls[PG_HIBERNATOR_COMPOSITION_COLS];
 
-			fileWrite("N", 1, file, savefile_path);
-			fileWrite(&range_counter, sizeof(range_counter), file, savefile_path);
+			if (c->blocks[forknum] == 0)
+				continue;
 
-			i += range_counter;
-		}
-	}
+			MemSet(nulls, 0, sizeof(nulls));
 
-	ereport(LOG,
-			(errmsg("Buffer Saver: saved metadata of %d blocks", num_buffers)));
+			/* The lumped entry has neither, and global objects have no name. */
+			if (!lumped)
+				values[0] = ObjectIdGetDatum(c->database);
+			else
+				nulls[0] = true;
 
-	Assert(file != NULL);
-	fileClose(file, savefile_path);
+			if (dbname != NULL)
+				values[1] = CStringGetTextDatum(dbname);
+			else
+				nulls[1] = true;
 
-	pfree(saved_buffers);
+			values[2] = CStringGetTextDatum(forkNames[forknum]);
+			values[3] = Int64GetDatum((int64) c->blocks[forknum]);
 
-	PopActiveSnapshot();
-	CommitTransactionCommand();
-	pgstat_report_activity(STATE_IDLE, NULL);
-}
+			tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+		}
 
-#define svdbfrcmp(fld)			\
-	if (a->fld < b->fld)		\
-		return -1;				\
-	else if (a->fld > b->fld)	\
-		return 1;
+		if (dbname != NULL)
+			pfree(dbname);
+	}
 
-static int
-SavedBufferCmp(const void *p, const void *q)
-{
-	SavedBuffer *a = (SavedBuffer *) p;
-	SavedBuffer *b = (SavedBuffer *) q;
+	pfree(stats);
 
-	svdbfrcmp(database);
-	svdbfrcmp(filenode);
-	svdbfrcmp(forknum);
-	svdbfrcmp(blocknum);
+	tuplestore_donestoring(tupstore);
 
-	Assert(false);	// No two buffers should be storing identical page
+	return (Datum) 0;
+}
 
-	return 0;	// Keep compiler happy.
+/* Raise an error if the name can't be used as the name of a snapshot. */
+static void
+CheckSnapshotName(const char *snapshot)
+{
+	if (!isValidSnapshotName(snapshot))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("invalid snapshot name \"%s\"", snapshot),
+				 errhint("Snapshot names consist of at most %d letters, digits, underscores and dashes.",
+						 NAMEDATALEN - 1)));
 }
 
-static Oid
-GetRelOid(Oid filenode)
+/*
+ * SQL-callable function to save the list of blocks in shared buffers as the
+ * named snapshot, replacing an earlier snapshot of the same name. Returns the
+ * number of blocks saved.
+ */
+PG_FUNCTION_INFO_V1(pg_hibernator_save);
+
+Datum
+pg_hibernator_save(PG_FUNCTION_ARGS)
 {
-	int			ret;
-	Oid			relid;
-	bool		isnull;
-	Datum		value[1] = { ObjectIdGetDatum(filenode) };
+	char	   *snapshot = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	int64		result;
 
-	static SPIPlanPtr	plan = NULL;
+	CheckSnapshotName(snapshot);
 
-	/* If this is our first time here, create a plan and save it for later calls. */
-	if (plan == NULL)
-	{
-		StringInfoData	buf;
-		Oid	paramType[1] = {OIDOID};
+	result = SubmitRequest(REQUEST_SAVE, snapshot);
 
-		initStringInfo(&buf);
-		appendStringInfo(&buf, "select oid from pg_class where pg_relation_filenode(oid) = $1");
+	if (result < 0)
+		ereport(ERROR,
+				(errmsg("could not save snapshot \"%s\"", snapshot),
+				 errhint("See the server log for details.")));
 
-		plan = SPI_prepare(buf.data, 1, (Oid*)&paramType);
+	PG_RETURN_INT64(result);
+}
 
-		if (plan == NULL)
-			elog(ERROR, "SPI_prepare returned %d", SPI_result);
-	}
+/*
+ * SQL-callable function to restore the named snapshot into shared buffers.
+ * Returns the number of save-files queued for the BlockReaders, without waiting
+ * for them; see the pg_hibernator_progress view for that.
+ */
+PG_FUNCTION_INFO_V1(pg_hibernator_restore);
 
-	ret = SPI_execute_plan(plan, (Datum*)&value, NULL, true, 1);
+Datum
+pg_hibernator_restore(PG_FUNCTION_ARGS)
+{
+	char	   *snapshot = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	struct stat	st;
+	int64		result;
 
-	if (ret != SPI_OK_SELECT)
-		ereport(FATAL, (errmsg("SPI_execute_plan failed: error code %d", ret)));
+	CheckSnapshotName(snapshot);
 
-	if (SPI_processed < 1)
-		return InvalidOid;
+	if (stat(getSnapshotDirectory(snapshot), &st) != 0 || !S_ISDIR(st.st_mode))
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_OBJECT),
+				 errmsg("snapshot \"%s\" does not exist", snapshot)));
 
-	relid = DatumGetObjectId(SPI_getbinval(SPI_tuptable->vals[0],
-											SPI_tuptable->tupdesc, 1, &isnull));
-	if (isnull)
-		return InvalidOid;
+	result = SubmitRequest(REQUEST_RESTORE, snapshot);
+
+	if (result < 0)
+		ereport(ERROR,
+				(errmsg("could not restore snapshot \"%s\"", snapshot),
+				 errhint("See the server log for details.")));
 
-	return relid;
+	PG_RETURN_INT32((int32) result);
 }
 
 #endif /* PG_VERSION_NUM >= 90400 */
@@ -0,0 +1,67 @@
+/* pg_hibernator--1.0.sql */
+
+-- complain if script is sourced in psql, rather than via CREATE EXTENSION
+\echo Use "CREATE EXTENSION pg_hibernator" to load this file. \quit
+
+CREATE FUNCTION pg_hibernator_get_progress(
+	OUT pid				int4,
+	OUT savefile		int4,
+	OUT database		text,
+	OUT usage_count		int4,
+	OUT state			text,
+	OUT blocks_planned	int8,
+	OUT blocks_read		int8,
+	OUT blocks_skipped	int8,
+	OUT bytes_read		int8,
+	OUT started_at		timestamptz,
+	OUT finished_at		timestamptz,
+	OUT current_relid	oid,
+	OUT snapshot		text,
+	OUT tablespace		oid)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_hibernator_get_progress'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE VIEW pg_hibernator_progress AS
+	SELECT *, coalesce(finished_at, now()) - started_at AS elapsed
+	FROM pg_hibernator_get_progress();
+
+CREATE FUNCTION pg_hibernator_last_save(
+	OUT finished_at		timestamptz,
+	OUT blocks			int8,
+	OUT databases		int4,
+	OUT scan_ms			float8,
+	OUT sort_ms			float8,
+	OUT write_ms		float8,
+	OUT fsync_ms		float8,
+	OUT total_ms		float8)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_hibernator_last_save'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION pg_hibernator_save_composition(
+	OUT database		oid,
+	OUT database_name	text,
+	OUT fork			text,
+	OUT blocks			int8)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_hibernator_save_composition'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION pg_hibernator_save(snapshot text)
+RETURNS int8
+AS 'MODULE_PATHNAME', 'pg_hibernator_save'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION pg_hibernator_restore(snapshot text)
+RETURNS int4
+AS 'MODULE_PATHNAME', 'pg_hibernator_restore'
+LANGUAGE C STRICT VOLATILE;
+
+-- Don't want these to be available to public
+REVOKE ALL ON FUNCTION pg_hibernator_get_progress() FROM PUBLIC;
+REVOKE ALL ON pg_hibernator_progress FROM PUBLIC;
+REVOKE ALL ON FUNCTION pg_hibernator_last_save() FROM PUBLIC;
+REVOKE ALL ON FUNCTION pg_hibernator_save_composition() FROM PUBLIC;
+REVOKE ALL ON FUNCTION pg_hibernator_save(text) FROM PUBLIC;
+REVOKE ALL ON FUNCTION pg_hibernator_restore(text) FROM PUBLIC;
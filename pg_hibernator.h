@@ -1,6 +1,12 @@
 
+#include <fcntl.h>
+#include <math.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <sched.h>		/* for sched_setaffinity() */
+#endif
 
 /* These are always necessary for a bgworker */
 #include "miscadmin.h"
@@ -12,25 +18,49 @@
 #include "storage/shmem.h"
 
 /* Header files needed by this extension */
+#include "access/nbtree.h"
 #include "access/xact.h"
+#include "access/xlog.h"
+#include "catalog/catalog.h"
+#include "catalog/pg_am.h"
+#include "catalog/pg_tablespace.h"
 #include "catalog/pg_type.h"
+#include "common/relpath.h"
 #include "commands/dbcommands.h"
+#include "executor/instrument.h"
 #include "executor/spi.h"
 #include "fmgr.h"
+#include "funcapi.h"
+#include "lib/binaryheap.h"
 #include "nodes/pg_list.h"
 #include "pgstat.h"
+#include "port/atomics.h"
+#include "port/pg_crc32c.h"
 #include "storage/block.h"
 #include "storage/buf_internals.h"
+#include "storage/buffile.h"
 #include "storage/bufmgr.h"
 #include "storage/fd.h"
 #include "storage/relfilenode.h"
+#include "utils/builtins.h"
 #include "utils/guc.h"
+#include "utils/hsearch.h"
 #include "utils/memutils.h"
 #include "utils/snapmgr.h"
+#include "utils/timestamp.h"
+#include "utils/tuplestore.h"
 #include "utils/rel.h"
 
+/* The save-file format, shared with the benchmarks in tests/ */
+#include "savefile.h"
+
+#if SAVEFILE_USAGE_LEVELS != BM_MAX_USAGE_COUNT + 1
+#error "SAVEFILE_USAGE_LEVELS doesn't match BM_MAX_USAGE_COUNT"
+#endif
+
 /* Functions defined in misc.c */
 extern bool		parseSavefileName(const char *fname, int *filenum);
+extern bool		parseDeltaFileName(const char *fname, int *filenum);
 extern FILE*	fileOpen(const char *path, const char *mode);
 extern bool		fileClose(FILE *file, const char *path);
 extern bool		fileRead(void *dest, size_t size, FILE *file, bool eof_ok, const char *path);
@@ -38,6 +68,14 @@ extern bool		fileWrite(const void *src, size_t size, FILE *file, const char *pat
 extern bool		writeDBName(const char *dbname, FILE *file, const char *path);
 extern char*	readDBName(FILE *file, const char *path);
 extern const char* getSavefileName(int filenum);
+extern const char* getSavefilePath(const char *dir, int filenum);
+extern const char* getTempSavefilePath(const char *dir, int filenum);
+extern const char* getDeltaFilePath(const char *dir, int filenum);
+extern const char* getTempDeltaFilePath(const char *dir, int filenum);
+extern const char* getGenerationFilePath(const char *dir);
+extern const char* getTempGenerationFilePath(const char *dir);
+extern const char* getSnapshotDirectory(const char *snapshot);
+extern bool		isValidSnapshotName(const char *snapshot);
 
 /* Constants */
 #define SAVE_LOCATION "pg_hibernator"
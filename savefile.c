@@ -0,0 +1,1115 @@
+/*
+ * The save-file format, and the code that sorts the saved buffers and encodes
+ * and decodes them.
+ *
+ * This file is also built without the backend, with FRONTEND defined, for the
+ * benchmarks in tests/bench_savefile.c; so it sticks to what libpgcommon and
+ * libpgport offer, and reports through the savefile_log_* macros below.
+ */
+#ifndef FRONTEND
+#include "postgres.h"
+#include "pg_hibernator.h"
+#else
+#include "postgres_fe.h"
+#include "savefile.h"
+#endif
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Messages, in the style of common/logging.h: ereport() in the backend. The
+ * benchmarks print errors to stderr and exit, and drop the debug messages.
+ */
+#ifndef FRONTEND
+#define savefile_log_file_error(...) \
+	ereport(ERROR, (errcode_for_file_access(), errmsg(__VA_ARGS__)))
+#define savefile_log_error(...) \
+	ereport(ERROR, (errmsg(__VA_ARGS__)))
+#define savefile_log_debug(...) \
+	ereport(DEBUG1, (errmsg(__VA_ARGS__)))
+#else
+#define savefile_log_file_error(...) \
+	savefile_log_error(__VA_ARGS__)
+#define savefile_log_error(...) \
+	do { fprintf(stderr, __VA_ARGS__); fputc('\n', stderr); exit(1); } while (0)
+#define savefile_log_debug(...) \
+	((void) 0)
+
+/* Defined by the program, for the header of the save-files it writes */
+extern int NBuffers;
+#endif
+
+/*
+ * Save-file format
+ * ----------------
+ *
+ * Version 1 save-files (the ones without a header) start with the database
+ * name, followed by records, each made of a one-byte marker followed by a
+ * fixed size field:
+ *
+ *	'r' Oid			relfilenode of the relation the following forks belong to
+ *	'f' ForkNumber	fork the following blocks belong to
+ *	'b' BlockNumber	a block of the fork
+ *	'N' uint32		number of blocks following the last 'b' block, all of which
+ *					are to be restored too
+ *
+ * Version 2 save-files start with a header:
+ *
+ *	SAVEFILE_MAGIC, which can't be the start of a version 1 file,
+ *	uint32 format version,
+ *	uint32 BLCKSZ, and uint32 NBuffers, of the server that saved the file,
+ *	the null-terminated database name.
+ *
+ * followed by the same kinds of records, but with variable length fields (see
+ * encodeVarint()), and delta encoding:
+ *
+ *	'r' varint		relfilenode, minus the relfilenode of the previous 'r'
+ *					record; the writer sorts the relations by relfilenode.
+ *	'f' varint		fork number
+ *	'b' varint		(D << 1) | R, where D is the block number minus the number
+ *					of the block following the last block or range of this
+ *					fork (or minus zero, for the first block of the fork), and
+ *					R says whether a range follows
+ *	    varint		present iff R is set: number of blocks following the 'b'
+ *					block, just like the field of the 'N' record in version 1
+ *
+ * Version 3 save-files add, right after NBuffers in the header,
+ *
+ *	uint32[SAVEFILE_USAGE_LEVELS] number of blocks saved with each usage count,
+ *					filled in when the file is closed,
+ *
+ * and one more kind of record:
+ *
+ *	'u' varint		usage count of the buffers of the following blocks and
+ *					ranges, until the next 'u' record; 0 at the start of the file.
+ *					A range never spans blocks of different usage counts.
+ *
+ * Version 4 save-files end with a trailer:
+ *
+ *	pg_crc32c		CRC-32C of the rest of the file, computed with the usage
+ *					count histogram taken out of the header and appended to
+ *					the end, since the histogram is filled in last.
+ *
+ * Version 5 save-files may have a second section, listing the blocks that were
+ * in the OS page cache rather than in shared buffers:
+ *
+ *	'c' varint		always 0; starts the section. The 'r', 'f' and 'b' records
+ *					that follow, up to the trailer, describe the page cache;
+ *					the delta encoding of relfilenodes starts anew, and their
+ *					blocks are not counted in the usage count histogram.
+ *
+ * Version 6 save-files name the database by its uint32 OID, InvalidOid for
+ * global objects, in place of the null-terminated database name in the
+ * header; so that the saving doesn't need catalog access.
+ *
+ * Version 7 save-files add the uint32 OID of the tablespace right after the
+ * database OID; all the blocks of a save-file belong to that tablespace.
+ *
+ * Version 8 adds delta files. N.delta records how the blocks of N.save have
+ * changed since N.save was written, so that a periodic save needn't rewrite
+ * the save-files; see SaveDelta(). A delta file has the header of its
+ * save-file, the blocks that have been read into shared buffers, or whose
+ * usage count has changed, since then, and one more kind of record:
+ *
+ *	'd' varint		always 0; starts the section of the blocks that are no
+ *					longer in shared buffers. Like 'c', it restarts the delta
+ *					encoding of relfilenodes, and its blocks are not counted
+ *					in the usage count histogram.
+ *
+ * The BlockReaders never see a delta file; it's folded into its save-file
+ * before the restore; see FoldDeltaFiles().
+ *
+ * Version 9 save-files add, right after the tablespace OID,
+ *
+ *	uint64			generation of the full save the file belongs to; a delta
+ *					file has that of its save-file. The save-files written by
+ *					a save are only valid once the save has published its
+ *					generation; see WriteSaveGeneration().
+ *
+ * The readers below present all versions as version 1 records, plus the 'u',
+ * 'c' and 'd' records.
+ */
+
+/*
+ * Encode 'value' into 'buf', 7 bits per byte, least significant bits first.
+ * The high bit of each byte says whether more bytes follow. Returns the number
+ * of bytes used; at most VARINT_MAX_BYTES.
+ */
+int
+encodeVarint(uint64 value, uint8 *buf)
+{
+	int		len = 0;
+
+	while (value >= 0x80)
+	{
+		buf[len++] = (uint8) (value | 0x80);
+		value >>= 7;
+	}
+
+	buf[len++] = (uint8) value;
+
+	return len;
+}
+
+/*
+ * Buffered save-file I/O
+ * ----------------------
+ *
+ * The readers and writers below move SAVEFILE_BUFFER_SIZE bytes at a time
+ * between the save-file and their buffer, and encode/decode the records right
+ * in the buffer, so that we make one system call per buffer-full instead of
+ * one stdio call per field.
+ *
+ * In the backend the save-files are opened as transient files, which are
+ * closed at the end of the transaction, or at the cleanup after an ERROR, so
+ * that an error midway doesn't leak the descriptor.
+ */
+
+static int
+savefileOpenFd(const char *path, int flags, mode_t mode)
+{
+#ifndef FRONTEND
+	return OpenTransientFile((char *) path, flags, mode);
+#else
+	return open(path, flags, mode);
+#endif
+}
+
+static int
+savefileCloseFd(int fd)
+{
+#ifndef FRONTEND
+	return CloseTransientFile(fd);
+#else
+	return close(fd);
+#endif
+}
+
+/* Write out the contents of the buffer. Doesn't return on error. */
+static void
+writerFlush(SavefileWriter *writer)
+{
+	char   *p = writer->buf;
+	int		left = writer->len;
+
+	COMP_CRC32C(writer->crc, writer->buf, writer->len);
+
+	while (left > 0)
+	{
+		ssize_t	rc = write(writer->fd, p, left);
+
+		if (rc < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			savefile_log_file_error("error writing to \"%s\": %m", writer->path);
+		}
+
+		p += rc;
+		left -= rc;
+	}
+
+	writer->len = 0;
+}
+
+/* Append the bytes to the buffer, flushing it as needed. */
+static void
+writerPut(SavefileWriter *writer, const void *src, int size)
+{
+	const char *p = src;
+
+	while (size > 0)
+	{
+		int		n = Min(size, SAVEFILE_BUFFER_SIZE - writer->len);
+
+		memcpy(writer->buf + writer->len, p, n);
+		writer->len += n;
+		p += n;
+		size -= n;
+
+		if (writer->len == SAVEFILE_BUFFER_SIZE)
+			writerFlush(writer);
+	}
+}
+
+/* Append a marker and a variable length field, encoded in place. */
+static void
+writerPutRecord(SavefileWriter *writer, char marker, uint64 value)
+{
+	if (writer->len + 1 + VARINT_MAX_BYTES > SAVEFILE_BUFFER_SIZE)
+		writerFlush(writer);
+
+	writer->buf[writer->len++] = marker;
+	writer->len += encodeVarint(value, (uint8 *) writer->buf + writer->len);
+}
+
+/*
+ * Returns a writer positioned after the header, doesn't return on error. The
+ * database is InvalidOid for the save-file of global objects.
+ */
+SavefileWriter *
+savefileOpenWrite(const char *path, Oid database, Oid tablespace, uint64 generation)
+{
+	SavefileWriter *writer = palloc0(sizeof(SavefileWriter));
+	uint32			header[3];
+
+	strlcpy(writer->path, path, sizeof(writer->path));
+	writer->fd = savefileOpenFd(writer->path, O_WRONLY | O_CREAT | O_TRUNC | PG_BINARY, S_IRUSR | S_IWUSR);
+	if (writer->fd < 0)
+		savefile_log_file_error("could not open \"%s\": %m", writer->path);
+
+	writer->buf = palloc(SAVEFILE_BUFFER_SIZE);
+	writer->len = 0;
+	INIT_CRC32C(writer->crc);
+
+	header[0] = SAVEFILE_VERSION;
+	header[1] = BLCKSZ;
+	header[2] = NBuffers;
+
+	writerPut(writer, SAVEFILE_MAGIC, SAVEFILE_MAGIC_LEN);
+	writerPut(writer, header, sizeof(header));
+	/* Zeroes for now, and in the checksum; see savefileCloseWrite() */
+	writerPut(writer, writer->level_blocks, sizeof(writer->level_blocks));
+	writerPut(writer, &database, sizeof(database));
+	writerPut(writer, &tablespace, sizeof(tablespace));
+	writerPut(writer, &generation, sizeof(generation));
+
+	writer->last_filenode = InvalidOid;
+	writer->next_block = 0;
+	writer->usage = 0;
+
+	return writer;
+}
+
+bool
+savefileWriteRelation(SavefileWriter *writer, Oid filenode)
+{
+	Assert(filenode > writer->last_filenode);
+
+	writerPutRecord(writer, 'r', filenode - writer->last_filenode);
+
+	writer->last_filenode = filenode;
+	writer->next_block = 0;
+
+	return true;
+}
+
+bool
+savefileWriteFork(SavefileWriter *writer, ForkNumber forknum)
+{
+	writerPutRecord(writer, 'f', forknum);
+
+	writer->next_block = 0;
+
+	return true;
+}
+
+/*
+ * Record the block, and the 'range' blocks following it, all of which were in
+ * buffers of the given usage count.
+ */
+bool
+savefileWriteBlocks(SavefileWriter *writer, BlockNumber blocknum, BlockNumber range, uint32 usage)
+{
+	uint64	delta;
+
+	Assert(blocknum >= writer->next_block);
+	Assert(usage < SAVEFILE_USAGE_LEVELS);
+
+	if (usage != writer->usage)
+	{
+		writerPutRecord(writer, 'u', usage);
+		writer->usage = usage;
+	}
+
+	if (!writer->cache_section && !writer->removed_section)
+		writer->level_blocks[usage] += range + 1;
+
+	delta = blocknum - writer->next_block;
+
+	writerPutRecord(writer, 'b', (delta << 1) | (range != 0 ? 1 : 0));
+
+	if (range != 0)
+	{
+		if (writer->len + VARINT_MAX_BYTES > SAVEFILE_BUFFER_SIZE)
+			writerFlush(writer);
+
+		writer->len += encodeVarint(range, (uint8 *) writer->buf + writer->len);
+	}
+
+	writer->next_block = blocknum + range + 1;
+
+	return true;
+}
+
+/*
+ * Start the page cache section; see the save-file format above. The usage
+ * count passed to savefileWriteBlocks() doesn't matter from now on.
+ */
+bool
+savefileWriteCacheSection(SavefileWriter *writer)
+{
+	Assert(!writer->cache_section);
+
+	writerPutRecord(writer, 'c', 0);
+
+	writer->cache_section = true;
+	writer->last_filenode = InvalidOid;
+	writer->next_block = 0;
+
+	return true;
+}
+
+/*
+ * Start the section of the removed blocks of a delta file; see the save-file
+ * format above. The usage count passed to savefileWriteBlocks() doesn't matter
+ * from now on.
+ */
+bool
+savefileWriteRemovedSection(SavefileWriter *writer)
+{
+	Assert(!writer->removed_section && !writer->cache_section);
+
+	writerPutRecord(writer, 'd', 0);
+
+	writer->removed_section = true;
+	writer->last_filenode = InvalidOid;
+	writer->next_block = 0;
+
+	return true;
+}
+
+/*
+ * Write the trailer, and fill in the header. Returns true on success, doesn't
+ * return on error. The file isn't fsync'ed here; the callers publish it with
+ * durable_rename(), which does that.
+ */
+bool
+savefileCloseWrite(SavefileWriter *writer)
+{
+	pg_crc32c	crc;
+
+	writerFlush(writer);
+
+	crc = writer->crc;
+	COMP_CRC32C(crc, writer->level_blocks, sizeof(writer->level_blocks));
+	FIN_CRC32C(crc);
+
+	writerPut(writer, &crc, sizeof(crc));
+	writerFlush(writer);
+
+	/* Fill in the usage count histogram in the header. */
+	if (pwrite(writer->fd, writer->level_blocks, sizeof(writer->level_blocks),
+				SAVEFILE_MAGIC_LEN + 3 * sizeof(uint32)) != sizeof(writer->level_blocks))
+		savefile_log_file_error("error writing to \"%s\": %m", writer->path);
+
+	if (savefileCloseFd(writer->fd) != 0)
+		savefile_log_file_error("encountered error while closing file \"%s\": %m",
+								writer->path);
+
+	pfree(writer->buf);
+	pfree(writer);
+
+	return true;
+}
+
+/*
+ * Refill the buffer, keeping the bytes not yet consumed. Returns the number of
+ * bytes available in the buffer, which is 0 only at EOF. Doesn't return on
+ * error.
+ */
+static int
+readerFill(SavefileReader *reader)
+{
+	int		avail = reader->len - reader->pos;
+
+	if (avail > 0 && reader->pos > 0)
+		memmove(reader->buf, reader->buf + reader->pos, avail);
+
+	reader->len = avail;
+	reader->pos = 0;
+
+	while (!reader->eof && reader->len < SAVEFILE_BUFFER_SIZE)
+	{
+		size_t	want = SAVEFILE_BUFFER_SIZE - reader->len;
+		ssize_t	rc;
+
+		/* Don't read the trailer as if it were records. */
+		if (reader->data_end >= 0)
+			want = Min(want, reader->data_end - reader->file_offset);
+
+		rc = want > 0 ? read(reader->fd, reader->buf + reader->len, want) : 0;
+
+		if (rc < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			savefile_log_file_error("error reading \"%s\" : %m", reader->path);
+		}
+
+		if (rc == 0)
+			reader->eof = true;
+
+		reader->len += rc;
+		reader->file_offset += rc;
+
+		/* Don't wait for a full buffer if we have enough for a record. */
+		if (reader->len >= 1 + 2 * VARINT_MAX_BYTES)
+			break;
+	}
+
+	return reader->len;
+}
+
+/*
+ * Make sure that at least 'size' bytes are available in the buffer, unless the
+ * file ends before that. Returns false at EOF if eof_ok, else doesn't return.
+ */
+static bool
+readerEnsure(SavefileReader *reader, int size, bool eof_ok)
+{
+	Assert(size <= SAVEFILE_BUFFER_SIZE);
+
+	while (reader->len - reader->pos < size)
+	{
+		int		avail = reader->len - reader->pos;
+
+		if (reader->eof || readerFill(reader) == avail)
+		{
+			if (eof_ok && reader->len == reader->pos)
+				return false;
+
+			savefile_log_error("found EOF when not expecting one \"%s\"", reader->path);
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Decode a variable length field from the buffer. Returns the decoded value,
+ * doesn't return on error.
+ */
+static uint64
+readerGetVarint(SavefileReader *reader)
+{
+	uint64	value = 0;
+	int		shift;
+
+	for (shift = 0; shift < VARINT_MAX_BYTES * 7; shift += 7)
+	{
+		uint8	byte;
+
+		if (reader->pos == reader->len)
+			readerEnsure(reader, 1, false);
+
+		byte = (uint8) reader->buf[reader->pos++];
+
+		value |= ((uint64) (byte & 0x7F)) << shift;
+
+		if ((byte & 0x80) == 0)
+			return value;
+	}
+
+	savefile_log_error("found malformed variable length field in \"%s\"", reader->path);
+
+	return 0;	/* Keep compiler happy. */
+}
+
+/* Copy the next 'size' bytes out of the buffer. Doesn't return on error. */
+static void
+readerGet(SavefileReader *reader, void *dest, int size)
+{
+	readerEnsure(reader, size, false);
+
+	memcpy(dest, reader->buf + reader->pos, size);
+	reader->pos += size;
+}
+
+/* Read the null-terminated database name. Doesn't return on error. */
+static void
+readerGetDBName(SavefileReader *reader)
+{
+	char   *nul;
+
+	/* Make sure that the buffer holds the longest possible name, or the whole file */
+	while (!reader->eof && reader->len - reader->pos < NAMEDATALEN)
+		readerFill(reader);
+
+	nul = memchr(reader->buf + reader->pos, '\0',
+				 Min(NAMEDATALEN, reader->len - reader->pos));
+
+	if (nul == NULL)
+		savefile_log_error("error reading database name from \"%s\"", reader->path);
+
+	strlcpy(reader->dbname, reader->buf + reader->pos, sizeof(reader->dbname));
+	reader->pos += (nul - (reader->buf + reader->pos)) + 1;
+}
+
+/*
+ * Returns a reader positioned at the first record, doesn't return on error.
+ *
+ * Find out the version of the save-file by looking at its first few bytes; a
+ * version 1 file starts with the database name, and a version 2+ file with the
+ * magic bytes.
+ */
+SavefileReader *
+savefileOpenRead(const char *path)
+{
+	SavefileReader *reader = palloc0(sizeof(SavefileReader));
+
+	strlcpy(reader->path, path, sizeof(reader->path));
+	reader->fd = savefileOpenFd(reader->path, O_RDONLY | PG_BINARY, 0);
+	if (reader->fd < 0)
+		savefile_log_file_error("could not open \"%s\": %m", reader->path);
+
+	reader->buf = palloc(SAVEFILE_BUFFER_SIZE);
+	reader->len = 0;
+	reader->pos = 0;
+	reader->eof = false;
+	reader->file_offset = 0;
+	reader->data_end = -1;
+
+	readerFill(reader);
+
+	if (reader->len >= SAVEFILE_MAGIC_LEN
+		&& memcmp(reader->buf, SAVEFILE_MAGIC, SAVEFILE_MAGIC_LEN) == 0)
+	{
+		uint32	header[3];
+
+		reader->pos = SAVEFILE_MAGIC_LEN;
+		readerGet(reader, header, sizeof(header));
+
+		reader->version		= header[0];
+		reader->blcksz		= header[1];
+		reader->nbuffers	= header[2];
+
+		/*
+		 * Stop the records short of the trailer. The caller has verified the
+		 * checksum already; see savefileVerify().
+		 */
+		if (reader->version >= 4 && reader->version <= SAVEFILE_VERSION)
+		{
+			struct stat	st;
+
+			if (fstat(reader->fd, &st) != 0)
+				savefile_log_file_error("could not stat \"%s\": %m", reader->path);
+
+			reader->data_end = st.st_size - sizeof(pg_crc32c);
+
+			if (reader->file_offset > reader->data_end)
+			{
+				reader->len -= reader->file_offset - reader->data_end;
+				reader->file_offset = reader->data_end;
+				reader->eof = true;
+			}
+		}
+
+		if (reader->version >= 3 && reader->version <= SAVEFILE_VERSION)
+			readerGet(reader, reader->level_blocks, sizeof(reader->level_blocks));
+	}
+	else
+	{
+		/* A version 1 file, which starts with the database name. */
+		reader->version		= 1;
+		reader->blcksz		= BLCKSZ;
+		reader->nbuffers	= 0;	/* Unknown */
+	}
+
+	/* Don't try to interpret the rest of a file from the future. */
+	if (reader->version > SAVEFILE_VERSION)
+		return reader;
+
+	reader->database = InvalidOid;
+	reader->tablespace = InvalidOid;
+	if (reader->version >= 6)
+		readerGet(reader, &reader->database, sizeof(reader->database));
+	else
+		readerGetDBName(reader);
+	if (reader->version >= 7)
+		readerGet(reader, &reader->tablespace, sizeof(reader->tablespace));
+	reader->generation = 0;
+	if (reader->version >= 9)
+		readerGet(reader, &reader->generation, sizeof(reader->generation));
+
+	reader->last_filenode = InvalidOid;
+	reader->next_block = 0;
+	reader->pending_range = 0;
+
+	return reader;
+}
+
+/*
+ * Read the next record, and return its marker and field in *type and *value.
+ * Returns false on EOF, doesn't return on error.
+ *
+ * Records of all versions are returned as if they were version 1 records; for
+ * example, a version 2 block record with a range is returned as a 'b' record,
+ * and the next call returns an 'N' record.
+ */
+bool
+savefileReadRecord(SavefileReader *reader, char *type, uint32 *value)
+{
+	if (reader->pending_range != 0)
+	{
+		*type = 'N';
+		*value = reader->pending_range;
+		reader->pending_range = 0;
+		return true;
+	}
+
+	if (!readerEnsure(reader, 1, true))
+		return false;
+
+	*type = reader->buf[reader->pos++];
+
+	if (reader->version == 1)
+	{
+		switch (*type)
+		{
+			case 'r':
+				readerGet(reader, value, sizeof(Oid));
+				break;
+			case 'f':
+				readerGet(reader, value, sizeof(ForkNumber));
+				break;
+			case 'b':
+				readerGet(reader, value, sizeof(BlockNumber));
+				break;
+			case 'N':
+				readerGet(reader, value, sizeof(int));
+				break;
+			default:
+				/* Let the caller complain about the marker. */
+				*value = 0;
+				break;
+		}
+
+		return true;
+	}
+
+	switch (*type)
+	{
+		case 'r':
+			reader->last_filenode += (Oid) readerGetVarint(reader);
+			reader->next_block = 0;
+			*value = reader->last_filenode;
+			break;
+		case 'f':
+			*value = (uint32) readerGetVarint(reader);
+			reader->next_block = 0;
+			break;
+		case 'u':
+			*value = (uint32) readerGetVarint(reader);
+			break;
+		case 'c':
+		case 'd':
+			*value = (uint32) readerGetVarint(reader);
+			reader->last_filenode = InvalidOid;
+			reader->next_block = 0;
+			break;
+		case 'b':
+		{
+			uint64	field = readerGetVarint(reader);
+			uint64	blocknum = reader->next_block + (field >> 1);
+			uint64	range = 0;
+
+			if (field & 1)
+				range = readerGetVarint(reader);
+
+			if (blocknum + range > MaxBlockNumber)
+				savefile_log_error("found invalid block number in \"%s\"", reader->path);
+
+			*value = (BlockNumber) blocknum;
+			reader->next_block = (BlockNumber) (blocknum + range + 1);
+			reader->pending_range = (BlockNumber) range;
+		}
+		break;
+		default:
+			/* Let the caller complain about the marker. */
+			*value = 0;
+			break;
+	}
+
+	return true;
+}
+
+/*
+ * Copy the usage count histogram from the header of the save-file, and the
+ * database and tablespace, or InvalidOid for the ones the file doesn't name,
+ * and the generation, or 0 if it has none.
+ * The database is InvalidOid for the global objects too. Returns false if the file
+ * doesn't have a histogram, or can't be read; unlike the functions
+ * above, this one never raises an error, so that a broken save-file is left
+ * for the BlockReader to complain about.
+ */
+bool
+savefileReadUsageLevels(const char *path, uint32 *level_blocks, Oid *database,
+						Oid *tablespace, uint64 *generation)
+{
+	int		fd;
+	char	buf[SAVEFILE_MAGIC_LEN + 3 * sizeof(uint32) + SAVEFILE_USAGE_LEVELS * sizeof(uint32)];
+	Oid		ids[2];		/* database and tablespace */
+	uint32	version;
+	bool	ret = false;
+
+	*database = InvalidOid;
+	*tablespace = InvalidOid;
+	*generation = 0;
+
+	fd = savefileOpenFd(path, O_RDONLY | PG_BINARY, 0);
+	if (fd < 0)
+		return false;
+
+	if (read(fd, buf, sizeof(buf)) == sizeof(buf)
+		&& memcmp(buf, SAVEFILE_MAGIC, SAVEFILE_MAGIC_LEN) == 0)
+	{
+		memcpy(&version, buf + SAVEFILE_MAGIC_LEN, sizeof(version));
+
+		if (version >= 3 && version <= SAVEFILE_VERSION)
+		{
+			memcpy(level_blocks, buf + SAVEFILE_MAGIC_LEN + 3 * sizeof(uint32),
+					SAVEFILE_USAGE_LEVELS * sizeof(uint32));
+			ret = true;
+
+			if (version >= 7 && read(fd, ids, sizeof(ids)) == sizeof(ids))
+			{
+				*database = ids[0];
+				*tablespace = ids[1];
+
+				if (version >= 9
+					&& read(fd, generation, sizeof(*generation)) != sizeof(*generation))
+					ret = false;
+			}
+			else if (version == 6 && read(fd, ids, sizeof(Oid)) == sizeof(Oid))
+				*database = ids[0];
+		}
+	}
+
+	savefileCloseFd(fd);
+
+	return ret;
+}
+
+/*
+ * Check the checksum of the save-file. Returns false if the file is truncated
+ * or corrupted, or can't be read, and true if it's intact, or predates the
+ * checksums. Like savefileReadUsageLevels(), this never raises an error.
+ */
+bool
+savefileVerify(const char *path)
+{
+	int			fd;
+	char	   *buf;
+	ssize_t		rc;
+	off_t		offset = 0;
+	off_t		data_end;
+	struct stat	st;
+	pg_crc32c	crc;
+	pg_crc32c	file_crc;
+	uint32		version;
+	uint32		level_blocks[SAVEFILE_USAGE_LEVELS];
+	const int	levels_offset = SAVEFILE_MAGIC_LEN + 3 * sizeof(uint32);
+	const int	header_len = levels_offset + sizeof(level_blocks);
+	bool		ret = false;
+
+	fd = savefileOpenFd(path, O_RDONLY | PG_BINARY, 0);
+	if (fd < 0)
+		return false;
+
+	buf = palloc(SAVEFILE_BUFFER_SIZE);
+
+	if (fstat(fd, &st) != 0)
+		goto done;
+
+	rc = read(fd, buf, SAVEFILE_BUFFER_SIZE);
+	if (rc < 0)
+		goto done;
+
+	/* No checksum before version 4 */
+	if ((size_t) rc < SAVEFILE_MAGIC_LEN + sizeof(version)
+		|| memcmp(buf, SAVEFILE_MAGIC, SAVEFILE_MAGIC_LEN) != 0)
+	{
+		ret = true;
+		goto done;
+	}
+
+	memcpy(&version, buf + SAVEFILE_MAGIC_LEN, sizeof(version));
+	if (version < 4 || version > SAVEFILE_VERSION)
+	{
+		ret = true;
+		goto done;
+	}
+
+	data_end = st.st_size - sizeof(pg_crc32c);
+	if (data_end < header_len || rc < header_len)
+		goto done;
+
+	/* Move the histogram from the header to the end; see the format above. */
+	memcpy(level_blocks, buf + levels_offset, sizeof(level_blocks));
+	memset(buf + levels_offset, 0, sizeof(level_blocks));
+
+	INIT_CRC32C(crc);
+
+	while (rc > 0 && offset < data_end)
+	{
+		COMP_CRC32C(crc, buf, Min(rc, data_end - offset));
+		offset += rc;
+
+		if (offset < data_end)
+			rc = read(fd, buf, SAVEFILE_BUFFER_SIZE);
+	}
+
+	if (rc < 0 || offset < data_end)
+		goto done;
+
+	COMP_CRC32C(crc, level_blocks, sizeof(level_blocks));
+	FIN_CRC32C(crc);
+
+	if (pread(fd, &file_crc, sizeof(file_crc), data_end) != sizeof(file_crc))
+		goto done;
+
+	ret = EQ_CRC32C(crc, file_crc);
+
+done:
+	pfree(buf);
+	savefileCloseFd(fd);
+
+	return ret;
+}
+
+/* Returns true on success, doesn't return on error. */
+bool
+savefileCloseRead(SavefileReader *reader)
+{
+	if (savefileCloseFd(reader->fd) != 0)
+		savefile_log_file_error("encountered error while closing file \"%s\": %m",
+								reader->path);
+
+	pfree(reader->buf);
+	pfree(reader);
+
+	return true;
+}
+
+/*
+ * SortSavedBuffers() sorts the SavedBuffer array with an LSD radix sort, using
+ * 16-bit digits of the sort key (database, tablespace, filenode, forknum,
+ * blocknum). Below
+ * RADIX_SORT_THRESHOLD entries pg_qsort() is just as fast.
+ */
+#define RADIX_BITS				16
+#define RADIX_SIZE				(1 << RADIX_BITS)
+#define RADIX_PASSES			9
+#define RADIX_SORT_THRESHOLD	(64 * 1024)
+
+#define svdbfrcmp(fld)			\
+	if (a->fld < b->fld)		\
+		return -1;				\
+	else if (a->fld > b->fld)	\
+		return 1;
+
+int
+SavedBufferCmp(const void *p, const void *q)
+{
+	SavedBuffer *a = (SavedBuffer *) p;
+	SavedBuffer *b = (SavedBuffer *) q;
+
+	svdbfrcmp(database);
+	svdbfrcmp(tablespace);
+	svdbfrcmp(filenode);
+	svdbfrcmp(forknum);
+	svdbfrcmp(blocknum);
+
+	/* The same block, found twice by the lockless scan; see SortSavedBuffers(). */
+	return 0;
+}
+
+/* Returns the 'pass'th 16-bit digit of the sort key, least significant first */
+static inline uint32
+SavedBufferDigit(const SavedBuffer *buf, int pass)
+{
+	switch (pass)
+	{
+		case 0: return buf->blocknum & (RADIX_SIZE - 1);
+		case 1: return buf->blocknum >> RADIX_BITS;
+		case 2: return (uint32) buf->forknum & (RADIX_SIZE - 1);
+		case 3: return buf->filenode & (RADIX_SIZE - 1);
+		case 4: return buf->filenode >> RADIX_BITS;
+		case 5: return buf->tablespace & (RADIX_SIZE - 1);
+		case 6: return buf->tablespace >> RADIX_BITS;
+		case 7: return buf->database & (RADIX_SIZE - 1);
+		case 8: return buf->database >> RADIX_BITS;
+	}
+
+	Assert(false);
+	return 0;	/* Keep compiler happy. */
+}
+
+/*
+ * Remove the duplicates from the sorted buffers, keeping the hottest copy of
+ * each block, and return the number of buffers left.
+ */
+static int
+RemoveDuplicateBuffers(SavedBuffer *buffers, int num_buffers)
+{
+	int		i;
+	int		n = 0;
+
+	for (i = 0; i < num_buffers; ++i)
+	{
+		if (n > 0 && SavedBufferCmp(&buffers[n - 1], &buffers[i]) == 0)
+		{
+			buffers[n - 1].usage = Max(buffers[n - 1].usage, buffers[i].usage);
+			continue;
+		}
+
+		buffers[n++] = buffers[i];
+	}
+
+	return n;
+}
+
+/*
+ * Sort the buffers in the order of SavedBufferCmp(), and return their number
+ * after removing the duplicates.
+ *
+ * The lockless scan (see ScanBuffer()) may find a block twice, if it moved to
+ * another buffer during the scan. The writers need one entry per block: a
+ * block at or below the end of the last range would wrap the block number
+ * delta of its 'b' record around, and the restore would reject the save-file.
+ *
+ * The histograms of all the digits are built in a single scan of the array,
+ * and the passes over digits that are the same for all the buffers (e.g. the
+ * high bits of block numbers of a small database) are skipped, so a typical
+ * sort makes 3 to 5 passes over the array. If we can't get the memory for the
+ * scratch array, or the array is small, fall back to pg_qsort().
+ */
+int
+SortSavedBuffers(SavedBuffer *buffers, int num_buffers)
+{
+	SavedBuffer	   *scratch;
+	SavedBuffer	   *src;
+	SavedBuffer	   *dst;
+	uint32		   *counts;
+	int				pass;
+	int				i;
+
+	if (num_buffers < RADIX_SORT_THRESHOLD)
+	{
+		pg_qsort(buffers, num_buffers, sizeof(SavedBuffer), SavedBufferCmp);
+		return RemoveDuplicateBuffers(buffers, num_buffers);
+	}
+
+	scratch = palloc_extended(sizeof(SavedBuffer) * num_buffers,
+							  MCXT_ALLOC_HUGE | MCXT_ALLOC_NO_OOM);
+	counts = palloc_extended(sizeof(uint32) * RADIX_PASSES * RADIX_SIZE,
+							 MCXT_ALLOC_NO_OOM | MCXT_ALLOC_ZERO);
+
+	if (scratch == NULL || counts == NULL)
+	{
+		savefile_log_debug("Buffer Saver: not enough memory for radix sort, using qsort");
+
+		if (scratch != NULL)
+			pfree(scratch);
+		if (counts != NULL)
+			pfree(counts);
+
+		pg_qsort(buffers, num_buffers, sizeof(SavedBuffer), SavedBufferCmp);
+		return RemoveDuplicateBuffers(buffers, num_buffers);
+	}
+
+	for (i = 0; i < num_buffers; ++i)
+		for (pass = 0; pass < RADIX_PASSES; ++pass)
+			++counts[pass * RADIX_SIZE + SavedBufferDigit(&buffers[i], pass)];
+
+	src = buffers;
+	dst = scratch;
+
+	for (pass = 0; pass < RADIX_PASSES; ++pass)
+	{
+		uint32	   *count = &counts[pass * RADIX_SIZE];
+		uint32		offset = 0;
+		SavedBuffer *tmp;
+
+		/* Skip the pass if all the buffers have the same digit. */
+		if (count[SavedBufferDigit(&src[0], pass)] == num_buffers)
+			continue;
+
+		/* Turn the counts into starting offsets of each digit's bucket. */
+		for (i = 0; i < RADIX_SIZE; ++i)
+		{
+			uint32	c = count[i];
+
+			count[i] = offset;
+			offset += c;
+		}
+
+		for (i = 0; i < num_buffers; ++i)
+			dst[count[SavedBufferDigit(&src[i], pass)]++] = src[i];
+
+		tmp = src;
+		src = dst;
+		dst = tmp;
+	}
+
+	/* If the sorted buffers ended up in the scratch array, copy them back. */
+	if (src != buffers)
+		memcpy(buffers, src, sizeof(SavedBuffer) * num_buffers);
+
+	pfree(counts);
+	pfree(scratch);
+
+	return RemoveDuplicateBuffers(buffers, num_buffers);
+}
+
+/*
+ * Write the sorted blocks, all of one save-file, with one record per range of
+ * blocks of the same usage count; like SaveBuffers() does.
+ */
+void
+WriteBufferList(SavefileWriter *writer, SavedBuffer *buffers, int num_buffers)
+{
+	Oid			prev_filenode	= InvalidOid;
+	ForkNumber	prev_forknum	= InvalidForkNumber;
+	int			i = 0;
+
+	while (i < num_buffers)
+	{
+		SavedBuffer	   *buf = &buffers[i];
+		BlockNumber		range = 0;
+		int				j;
+
+		if (buf->filenode != prev_filenode)
+		{
+			savefileWriteRelation(writer, buf->filenode);
+			prev_filenode = buf->filenode;
+			prev_forknum = InvalidForkNumber;
+		}
+
+		if (buf->forknum != prev_forknum)
+		{
+			savefileWriteFork(writer, buf->forknum);
+			prev_forknum = buf->forknum;
+		}
+
+		for (j = i + 1; j < num_buffers; ++j)
+		{
+			SavedBuffer *tmp = &buffers[j];
+
+			if (tmp->filenode != buf->filenode || tmp->forknum != buf->forknum
+				|| tmp->blocknum != buf->blocknum + range + 1 || tmp->usage != buf->usage)
+				break;
+
+			++range;
+		}
+
+		savefileWriteBlocks(writer, buf->blocknum, range, buf->usage);
+
+		i += range + 1;
+	}
+}
@@ -0,0 +1,106 @@
+#ifndef PG_HIBERNATOR_SAVEFILE_H
+#define PG_HIBERNATOR_SAVEFILE_H
+
+/*
+ * This header is also used without the backend (see tests/bench_savefile.c),
+ * so it includes only headers that work in frontend code too.
+ */
+#include "common/relpath.h"
+#include "port/pg_crc32c.h"
+#include "storage/block.h"
+
+/* Save-file format; see the comments in savefile.c */
+#define SAVEFILE_MAGIC		"\0PGH"
+#define SAVEFILE_MAGIC_LEN	4
+#define SAVEFILE_VERSION	9
+
+/*
+ * Number of distinct buffer usage counts, i.e. BM_MAX_USAGE_COUNT + 1; see the
+ * 'u' record. Spelled out so that this header doesn't need the backend's.
+ */
+#define SAVEFILE_USAGE_LEVELS	6
+
+/* Bytes needed to encode a uint64 in a variable length field */
+#define VARINT_MAX_BYTES	10
+
+/* Size of the I/O buffer of save-file readers and writers */
+#define SAVEFILE_BUFFER_SIZE	(64 * 1024)
+
+typedef struct SavefileWriter
+{
+	int			fd;
+	char		path[MAXPGPATH];
+	char	   *buf;			/* SAVEFILE_BUFFER_SIZE bytes */
+	int			len;			/* bytes in buf not yet written out */
+	Oid			last_filenode;	/* for delta encoding of relfilenodes */
+	BlockNumber	next_block;		/* for delta encoding of block numbers */
+	uint32		usage;			/* usage count of the last 'u' record */
+	bool		cache_section;	/* past the 'c' record? */
+	bool		removed_section;	/* past the 'd' record? */
+	pg_crc32c	crc;			/* of the bytes written so far; see savefile.c */
+
+	/* Number of blocks written at each usage count, for the header */
+	uint32		level_blocks[SAVEFILE_USAGE_LEVELS];
+} SavefileWriter;
+
+typedef struct SavefileReader
+{
+	int			fd;
+	char		path[MAXPGPATH];
+	char	   *buf;			/* SAVEFILE_BUFFER_SIZE bytes */
+	int			len;			/* bytes in buf */
+	int			pos;			/* bytes in buf already consumed */
+	bool		eof;			/* have we seen the end of the records? */
+	off_t		file_offset;	/* of the end of the data in buf */
+	off_t		data_end;		/* offset of the trailer, -1 if none */
+
+	/* From the header. For version 1 files, nbuffers is 0, i.e. unknown. */
+	uint32		version;
+	uint32		blcksz;
+	uint32		nbuffers;
+	uint32		level_blocks[SAVEFILE_USAGE_LEVELS];	/* all 0 before version 3 */
+	Oid			database;		/* InvalidOid before version 6 */
+	Oid			tablespace;		/* InvalidOid before version 7 */
+	uint64		generation;		/* 0 before version 9 */
+	char		dbname[NAMEDATALEN];	/* empty from version 6 on */
+
+	/* Decoding state */
+	Oid			last_filenode;
+	BlockNumber	next_block;
+	BlockNumber	pending_range;	/* 'N' record to return next, if non-zero */
+} SavefileReader;
+
+/* A block in shared buffers, as saved by the BufferSaver */
+typedef struct SavedBuffer
+{
+	Oid			database;
+	Oid			tablespace;	/* Each (database, tablespace) has a save-file */
+	Oid			filenode;	/* On-disk marker: 'r', for Relfilenode */
+	ForkNumber	forknum;	/* On-disk marker: 'f' */
+	BlockNumber	blocknum;	/* On-disk marker: 'b' */
+							/* On-disk marker: 'N', for range of N blocks */
+	uint8		usage;		/* On-disk marker: 'u', for Usage count */
+} SavedBuffer;
+
+/* Functions defined in savefile.c */
+extern int		encodeVarint(uint64 value, uint8 *buf);
+extern SavefileWriter *savefileOpenWrite(const char *path, Oid database, Oid tablespace,
+									 uint64 generation);
+extern bool		savefileWriteRelation(SavefileWriter *writer, Oid filenode);
+extern bool		savefileWriteFork(SavefileWriter *writer, ForkNumber forknum);
+extern bool		savefileWriteBlocks(SavefileWriter *writer, BlockNumber blocknum, BlockNumber range, uint32 usage);
+extern bool		savefileWriteCacheSection(SavefileWriter *writer);
+extern bool		savefileWriteRemovedSection(SavefileWriter *writer);
+extern bool		savefileCloseWrite(SavefileWriter *writer);
+extern SavefileReader *savefileOpenRead(const char *path);
+extern bool		savefileReadRecord(SavefileReader *reader, char *type, uint32 *value);
+extern bool		savefileCloseRead(SavefileReader *reader);
+extern bool		savefileReadUsageLevels(const char *path, uint32 *level_blocks, Oid *database,
+										Oid *tablespace, uint64 *generation);
+extern bool		savefileVerify(const char *path);
+
+extern int		SavedBufferCmp(const void *a, const void *b);
+extern int		SortSavedBuffers(SavedBuffer *buffers, int num_buffers);
+extern void		WriteBufferList(SavefileWriter *writer, SavedBuffer *buffers, int num_buffers);
+
+#endif	/* PG_HIBERNATOR_SAVEFILE_H */
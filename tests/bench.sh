@@ -0,0 +1,295 @@
+#!/usr/bin/env bash
+#
+# Scripted version of test_run.txt: measure how quickly a server gets back to
+# its steady-state throughput after a restart, with and without Postgres
+# Hibernator.
+#
+# Builds a scratch cluster, fills it with a pgbench database, and then, for
+# each mode in BENCH_MODES, restarts the server (dropping the OS caches, if
+# allowed to) and runs pgbench until the TPS levels off. For every second of
+# each run it records the TPS, the buffer hit ratio, and the 99th percentile
+# latency, in $BENCH_DIR/results/<mode>.csv; and for each mode it reports how
+# long the BufferSaver took to save at shutdown, how long the BlockReaders
+# took to restore, and how long the TPS took to reach 90% of its steady-state
+# value.
+#
+# Run it with `make bench`, after `make install`. Everything is configurable
+# through the environment; see the defaults below. To compare the restore
+# modes, pass their settings in BENCH_EXTRA_CONF, e.g.
+#
+#   BENCH_EXTRA_CONF="pg_hibernator.structure_first = on" make bench
+#
+# Dropping the OS caches needs root, via `sudo -n`; without it the restarts
+# are warm as far as the OS is concerned, which understates the difference the
+# extension makes.
+
+set -euo pipefail
+
+PG_BINDIR="${PG_BINDIR:-$(pg_config --bindir)}"
+PATH="$PG_BINDIR:$PATH"
+
+BENCH_DIR="${BENCH_DIR:-$PWD/pg_hibernator_bench}"
+BENCH_PORT="${BENCH_PORT:-54329}"
+BENCH_MODES="${BENCH_MODES:-off cold hibernator hibernator-wait}"
+BENCH_EXTRA_CONF="${BENCH_EXTRA_CONF:-}"
+SHARED_BUFFERS="${SHARED_BUFFERS:-1GB}"
+PGBENCH_SCALE="${PGBENCH_SCALE:-100}"	# Big enough to fill up shared_buffers
+CLIENTS="${CLIENTS:-$(nproc)}"
+CHUNK_TIME="${CHUNK_TIME:-10}"			# Seconds per pgbench run
+MIN_TIME="${MIN_TIME:-30}"				# Don't call it steady before this
+MAX_TIME="${MAX_TIME:-600}"				# Give up on steady state after this
+STEADY_TOLERANCE="${STEADY_TOLERANCE:-5}"	# Percent
+DROP_CACHES="${DROP_CACHES:-auto}"		# yes, no, or auto (if sudo works)
+
+DATADIR="$BENCH_DIR/data"
+RESULTS="$BENCH_DIR/results"
+LOGFILE="$BENCH_DIR/server.log"
+
+export PGPORT="$BENCH_PORT"
+export PGHOST="$BENCH_DIR"
+
+log()
+{
+	echo "bench: $*" >&2
+}
+
+psql_value()
+{
+	psql -X -At -d postgres -c "$1"
+}
+
+server_start()
+{
+	pg_ctl -w -D "$DATADIR" -l "$LOGFILE" -o "-p $BENCH_PORT -k $BENCH_DIR" start >/dev/null
+}
+
+server_stop()
+{
+	pg_ctl -w -D "$DATADIR" -m fast stop >/dev/null
+}
+
+drop_caches()
+{
+	case "$DROP_CACHES" in
+		no)
+			return;;
+		auto)
+			if ! sudo -n true 2>/dev/null; then
+				log "can't drop the OS caches without sudo; restarts will be warm"
+				DROP_CACHES=no
+				return
+			fi
+			DROP_CACHES=yes;;
+	esac
+
+	sync
+	echo 3 | sudo -n tee /proc/sys/vm/drop_caches >/dev/null
+}
+
+# The settings of each mode go in a file of their own, included by
+# postgresql.conf, so that the modes don't pile up on each other.
+set_mode()
+{
+	local mode="$1"
+
+	case "$mode" in
+		off|cold)
+			echo "shared_preload_libraries = ''" > "$DATADIR/bench_mode.conf";;
+		hibernator|hibernator-wait)
+			{
+				echo "shared_preload_libraries = 'pg_hibernator'"
+				echo "$BENCH_EXTRA_CONF"
+			} > "$DATADIR/bench_mode.conf";;
+		*)
+			log "unknown mode \"$mode\""
+			exit 1;;
+	esac
+}
+
+setup_cluster()
+{
+	rm -rf "$DATADIR"
+	mkdir -p "$DATADIR" "$RESULTS"
+
+	initdb -D "$DATADIR" >/dev/null
+
+	cat >> "$DATADIR/postgresql.conf" <<-EOF
+	# Changes for pg_hibernator benchmarking
+	shared_buffers = $SHARED_BUFFERS
+	max_connections = $((CLIENTS + 20))
+	track_io_timing = on
+	include_if_exists 'bench_mode.conf'
+	EOF
+
+	set_mode hibernator
+	server_start
+	createdb pgbench
+	log "initializing pgbench database at scale $PGBENCH_SCALE"
+	pgbench --initialize --quiet --scale="$PGBENCH_SCALE" pgbench >/dev/null 2>&1
+	psql -X -q -d postgres -c "CREATE EXTENSION pg_hibernator" 2>/dev/null || true
+	log "database size $(psql_value "select pg_size_pretty(pg_database_size('pgbench'))"), shared_buffers $SHARED_BUFFERS"
+	server_stop
+}
+
+# Prints the time the last shutdown save took, in ms, from the server log.
+save_duration()
+{
+	grep 'Buffer Saver: saved metadata of' "$LOGFILE" | tail -n 1 \
+		| sed -n 's/.* in \([0-9.]*\) ms.*/\1/p'
+}
+
+# Waits for the BlockReaders to finish, and prints how long they took, in
+# seconds; empty if nothing was restored.
+wait_for_restore()
+{
+	local i
+
+	# The BlockReaders are launched only once the server is up.
+	for i in $(seq 10); do
+		[ "$(psql_value "select count(*) from pg_hibernator_progress" 2>/dev/null || echo 0)" = "0" ] || break
+		sleep 1
+	done
+
+	while [ "$(psql_value "select count(*) from pg_hibernator_progress where state = 'restoring'" 2>/dev/null || echo 0)" != "0" ]; do
+		sleep 1
+	done
+
+	psql_value "select extract(epoch from max(finished_at) - min(started_at)) from pg_hibernator_progress" 2>/dev/null || true
+}
+
+# Samples the cluster-wide buffer hit ratio once a second, until killed.
+sample_hit_ratio()
+{
+	local out="$1"
+	local last_hit=0 last_read=0
+
+	while true; do
+		read -r epoch hit read < <(psql_value "select extract(epoch from now())::bigint, sum(blks_hit), sum(blks_read) from pg_stat_database" | tr '|' ' ')
+		if [ "$last_hit" != "0" ] || [ "$last_read" != "0" ]; then
+			awk -v e="$epoch" -v h=$((hit - last_hit)) -v r=$((read - last_read)) \
+				'BEGIN { printf "%d %.4f\n", e, (h + r) > 0 ? h / (h + r) : 1 }' >> "$out"
+		fi
+		last_hit=$hit
+		last_read=$read
+		sleep 1
+	done
+}
+
+# Runs pgbench in chunks until the TPS of a chunk is within STEADY_TOLERANCE
+# percent of the previous two, and writes the per-second results to the CSV.
+run_until_steady()
+{
+	local mode="$1"
+	local work="$BENCH_DIR/work/$mode"
+	local start elapsed=0 chunk=0
+	local -a tps_history=()
+
+	rm -rf "$work"
+	mkdir -p "$work"
+
+	sample_hit_ratio "$work/hit_ratio" &
+	local sampler=$!
+
+	start=$(date +%s)
+
+	while [ "$elapsed" -lt "$MAX_TIME" ]; do
+		chunk=$((chunk + 1))
+		pgbench --no-vacuum --protocol=prepared --select-only \
+			--time="$CHUNK_TIME" --client="$CLIENTS" --jobs="$CLIENTS" \
+			--log --log-prefix="$work/txn.$chunk" pgbench > "$work/pgbench.$chunk" 2>&1
+
+		tps_history+=("$(sed -n 's/^tps = \([0-9.]*\) (excluding.*/\1/p' "$work/pgbench.$chunk")")
+		elapsed=$(( $(date +%s) - start ))
+
+		local n=${#tps_history[@]}
+		if [ "$elapsed" -ge "$MIN_TIME" ] && [ "$n" -ge 3 ] \
+			&& awk -v a="${tps_history[n-1]}" -v b="${tps_history[n-2]}" -v c="${tps_history[n-3]}" -v tol="$STEADY_TOLERANCE" \
+				'BEGIN { m = (b + c) / 2; d = a > m ? a - m : m - a; exit !(m > 0 && d * 100 / m <= tol) }'; then
+			break
+		fi
+	done
+
+	kill "$sampler" 2>/dev/null || true
+	wait "$sampler" 2>/dev/null || true
+
+	# Per-transaction log lines: client txn latency_us script epoch usec
+	cat "$work"/txn.* | awk -v start="$start" '{ print $5 - start, $3 }' | sort -n -k1,1 -k2,2 \
+		| awk -v hits="$work/hit_ratio" -v start="$start" '
+			BEGIN {
+				while ((getline line < hits) > 0) {
+					split(line, f, " ")
+					ratio[f[1] - start] = f[2]
+				}
+			}
+			function flush() {
+				if (n > 0)
+					printf "%d,%d,%s,%.3f\n", sec, n, (sec in ratio) ? ratio[sec] : "", lat[int((n - 1) * 0.99) + 1] / 1000
+			}
+			BEGIN { print "second,tps,hit_ratio,p99_ms" }
+			$1 != sec { flush(); sec = $1; n = 0 }
+			{ lat[++n] = $2 }
+			END { flush() }' > "$RESULTS/$mode.csv"
+}
+
+# Seconds until the TPS first reached 90% of the mean of the last CHUNK_TIME seconds.
+ramp_up_time()
+{
+	awk -F, -v window="$CHUNK_TIME" '
+		NR > 1 { sec[NR] = $1; tps[NR] = $2; last = NR }
+		END {
+			for (i = last; i > last - window && i > 1; --i) { sum += tps[i]; ++n }
+			steady = n ? sum / n : 0
+			for (i = 2; i <= last; ++i)
+				if (tps[i] >= 0.9 * steady) { print sec[i], steady; exit }
+			print "-", steady
+		}' "$1"
+}
+
+main()
+{
+	setup_cluster
+
+	printf "%-16s %12s %12s %14s %12s\n" mode save_ms restore_s ramp_up_s steady_tps > "$RESULTS/summary.txt"
+
+	for mode in $BENCH_MODES; do
+		local save_ms restore_s ramp
+
+		log "running mode \"$mode\""
+
+		# A warm run first, so that the shutdown has a full cache to save.
+		set_mode "$mode"
+		server_start
+		pgbench --no-vacuum --select-only --time="$MIN_TIME" --client="$CLIENTS" --jobs="$CLIENTS" pgbench >/dev/null 2>&1
+		server_stop
+		save_ms=$(save_duration)
+
+		# "off" is a plain restart, with the OS caches left warm.
+		[ "$mode" = "off" ] || drop_caches
+		server_start
+
+		restore_s=""
+		case "$mode" in
+			hibernator-wait)
+				restore_s=$(wait_for_restore);;
+		esac
+
+		run_until_steady "$mode"
+
+		case "$mode" in
+			hibernator)
+				restore_s=$(wait_for_restore);;
+			off|cold)
+				save_ms="";;
+		esac
+
+		server_stop
+
+		read -r ramp steady < <(ramp_up_time "$RESULTS/$mode.csv")
+		printf "%-16s %12s %12s %14s %12s\n" "$mode" "${save_ms:--}" "${restore_s:--}" "${ramp:--}" "${steady:--}" >> "$RESULTS/summary.txt"
+	done
+
+	cat "$RESULTS/summary.txt"
+	log "per-second results are in $RESULTS"
+}
+
+main "$@"
@@ -0,0 +1,727 @@
+/*
+ * Microbenchmarks of the save-file code, without a server.
+ *
+ * Built from the same savefile.c as the extension (see the Makefile), this
+ * times, on its own, each of the steps the BufferSaver and the BlockReaders
+ * take on a list of saved buffers:
+ *
+ *	sort		SortSavedBuffers(), and pg_qsort() with SavedBufferCmp(), which
+ *				it falls back to
+ *	encode		writing the sorted list to a save-file, as SaveBuffers() does,
+ *				including the fsync that durable_rename() does there
+ *	decode		verifying the checksum and reading the records back, as
+ *				ReadBlocks() does before it looks up any relation
+ *
+ * for synthetic lists of 1M to 64M buffers in a few fragmentation patterns,
+ * and reports the size of the save-file per buffer and the buffers handled per
+ * second. The encode and decode steps are run for the current format, and for
+ * the fixed size records of version 1; the versions in between encode blocks
+ * the same way as the current one, and differ only in their header, their
+ * sections, and in having or not 'u' records.
+ *
+ * Before the timings, it checks that a list with blocks found twice, as the
+ * lockless scan may find them, is sorted down to one entry per block and
+ * reads back from the save-file; see CheckDuplicates().
+ *
+ * The save-files are written to the directory given with -d, the current
+ * directory by default, and are removed afterwards. They're read back right
+ * after being written, so the decode step measures the CPU cost of the parser,
+ * not the disk.
+ */
+#include "postgres_fe.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "portability/instr_time.h"
+#include "savefile.h"
+
+/* For the header of the save-files; see savefile.c */
+int			NBuffers = 0;
+
+/* The OIDs of a typical user database in pg_default */
+#define BENCH_DATABASE		16384
+#define BENCH_TABLESPACE	1663
+#define BENCH_FIRST_FILENODE	16384
+
+typedef void (*GenerateFunc) (SavedBuffer *buffers, int num_buffers);
+
+typedef struct Pattern
+{
+	const char	   *name;
+	GenerateFunc	generate;
+	const char	   *description;
+} Pattern;
+
+static void GenerateSequential(SavedBuffer *buffers, int num_buffers);
+static void GenerateClustered(SavedBuffer *buffers, int num_buffers);
+static void GenerateRandom(SavedBuffer *buffers, int num_buffers);
+static void GenerateSmall(SavedBuffer *buffers, int num_buffers);
+
+static const Pattern patterns[] =
+{
+	{"sequential", GenerateSequential,
+		"whole 1GB relations, the usage count changing every few thousand blocks"},
+	{"clustered", GenerateClustered,
+		"runs of up to 32 blocks of one usage count, with gaps of up to 64, and a few FSM and VM blocks per relation"},
+	{"random", GenerateRandom,
+		"one block in 8 of large relations, each of its own usage count"},
+	{"small", GenerateSmall,
+		"relations of 1 to 8 blocks, like the catalogs, or many small partitions"},
+};
+
+#define NUM_PATTERNS	lengthof(patterns)
+
+static uint64 rng_state;
+
+/* Appends blocks to the list being generated, in sort order. */
+typedef struct Generator
+{
+	SavedBuffer	   *buffers;
+	int				num_buffers;
+	int				n;			/* generated so far */
+	Oid				filenode;
+} Generator;
+
+static int	RandomUsage(void);
+static const char *FormatCount(int64 count);
+
+/* xorshift64*; reproducible, and fast enough not to show in the timings */
+static uint64
+Random(void)
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+
+	return rng_state * UINT64CONST(2685821657736338717);
+}
+
+static int
+RandomUsage(void)
+{
+	return 1 + Random() % (SAVEFILE_USAGE_LEVELS - 1);
+}
+
+static void
+GeneratorInit(Generator *gen, SavedBuffer *buffers, int num_buffers)
+{
+	gen->buffers = buffers;
+	gen->num_buffers = num_buffers;
+	gen->n = 0;
+	gen->filenode = BENCH_FIRST_FILENODE;
+}
+
+/* Add the block; returns false once the list is full. */
+static bool
+Emit(Generator *gen, ForkNumber forknum, BlockNumber blocknum, int usage)
+{
+	SavedBuffer	   *buf;
+
+	if (gen->n == gen->num_buffers)
+		return false;
+
+	buf = &gen->buffers[gen->n++];
+	buf->database = BENCH_DATABASE;
+	buf->tablespace = BENCH_TABLESPACE;
+	buf->filenode = gen->filenode;
+	buf->forknum = forknum;
+	buf->blocknum = blocknum;
+	buf->usage = usage;
+
+	return true;
+}
+
+static void
+GenerateSequential(SavedBuffer *buffers, int num_buffers)
+{
+	Generator	gen;
+
+	GeneratorInit(&gen, buffers, num_buffers);
+
+	for (;; ++gen.filenode)
+	{
+		BlockNumber	block;
+		int			usage = RandomUsage();
+
+		for (block = 0; block < 128 * 1024; ++block)
+		{
+			if (Random() % 4096 == 0)
+				usage = RandomUsage();
+
+			if (!Emit(&gen, MAIN_FORKNUM, block, usage))
+				return;
+		}
+	}
+}
+
+static void
+GenerateClustered(SavedBuffer *buffers, int num_buffers)
+{
+	Generator	gen;
+
+	GeneratorInit(&gen, buffers, num_buffers);
+
+	for (;; gen.filenode += 1 + Random() % 4)
+	{
+		BlockNumber	block = Random() % 64;
+		int			runs = 16 + Random() % 2048;
+		int			i;
+
+		while (runs-- > 0)
+		{
+			int		len = 1 + Random() % 32;
+			int		usage = RandomUsage();
+
+			for (i = 0; i < len; ++i)
+				if (!Emit(&gen, MAIN_FORKNUM, block++, usage))
+					return;
+
+			block += 1 + Random() % 64;
+		}
+
+		for (i = 0; i < 3; ++i)
+			if (!Emit(&gen, FSM_FORKNUM, i, RandomUsage()))
+				return;
+
+		if (!Emit(&gen, VISIBILITYMAP_FORKNUM, 0, RandomUsage()))
+			return;
+	}
+}
+
+static void
+GenerateRandom(SavedBuffer *buffers, int num_buffers)
+{
+	Generator	gen;
+
+	GeneratorInit(&gen, buffers, num_buffers);
+
+	for (;; ++gen.filenode)
+	{
+		BlockNumber	block;
+
+		for (block = Random() % 8; block < 1024 * 1024; block += 1 + Random() % 15)
+			if (!Emit(&gen, MAIN_FORKNUM, block, Random() % SAVEFILE_USAGE_LEVELS))
+				return;
+	}
+}
+
+static void
+GenerateSmall(SavedBuffer *buffers, int num_buffers)
+{
+	Generator	gen;
+
+	GeneratorInit(&gen, buffers, num_buffers);
+
+	for (;; gen.filenode += 1 + Random() % 3)
+	{
+		BlockNumber	nblocks = 1 + Random() % 8;
+		BlockNumber	block;
+
+		for (block = 0; block < nblocks; ++block)
+			if (!Emit(&gen, MAIN_FORKNUM, block, RandomUsage()))
+				return;
+	}
+}
+
+/*
+ * Shuffle the list into the order a scan of shared buffers would find it in.
+ * The same seed gives the same order, so that the sorts all start from the
+ * same list.
+ */
+static void
+Shuffle(SavedBuffer *buffers, int num_buffers, uint64 seed)
+{
+	int		i;
+
+	rng_state = seed;
+
+	for (i = num_buffers - 1; i > 0; --i)
+	{
+		int			j = Random() % (i + 1);
+		SavedBuffer	tmp = buffers[i];
+
+		buffers[i] = buffers[j];
+		buffers[j] = tmp;
+	}
+}
+
+static void
+CheckSorted(SavedBuffer *buffers, int num_buffers, const char *what)
+{
+	int		i;
+
+	for (i = 1; i < num_buffers; ++i)
+		if (SavedBufferCmp(&buffers[i - 1], &buffers[i]) >= 0)
+		{
+			fprintf(stderr, "%s left the buffers out of order at %d\n", what, i);
+			exit(1);
+		}
+}
+
+/*
+ * Write the list in the version 1 format, the way the BufferSaver of version 1
+ * did: fixed size fields, and ranges regardless of usage counts.
+ */
+static void
+WriteVersion1(const char *path, SavedBuffer *buffers, int num_buffers)
+{
+	FILE	   *file;
+	Oid			prev_filenode = InvalidOid;
+	ForkNumber	prev_forknum = InvalidForkNumber;
+	int			i = 0;
+
+	file = fopen(path, PG_BINARY_W);
+	if (file == NULL)
+	{
+		fprintf(stderr, "could not open \"%s\": %m\n", path);
+		exit(1);
+	}
+
+	setvbuf(file, NULL, _IOFBF, SAVEFILE_BUFFER_SIZE);
+
+	fwrite("bench", 1, sizeof("bench"), file);
+
+	while (i < num_buffers)
+	{
+		SavedBuffer	   *buf = &buffers[i];
+		int				range = 0;
+
+		if (buf->filenode != prev_filenode)
+		{
+			fputc('r', file);
+			fwrite(&buf->filenode, sizeof(Oid), 1, file);
+			prev_filenode = buf->filenode;
+			prev_forknum = InvalidForkNumber;
+		}
+
+		if (buf->forknum != prev_forknum)
+		{
+			fputc('f', file);
+			fwrite(&buf->forknum, sizeof(ForkNumber), 1, file);
+			prev_forknum = buf->forknum;
+		}
+
+		while (i + range + 1 < num_buffers
+			   && buffers[i + range + 1].filenode == buf->filenode
+			   && buffers[i + range + 1].forknum == buf->forknum
+			   && buffers[i + range + 1].blocknum == buf->blocknum + range + 1)
+			++range;
+
+		fputc('b', file);
+		fwrite(&buf->blocknum, sizeof(BlockNumber), 1, file);
+
+		if (range != 0)
+		{
+			fputc('N', file);
+			fwrite(&range, sizeof(int), 1, file);
+		}
+
+		i += range + 1;
+	}
+
+	if (fflush(file) != 0 || ferror(file) || fsync(fileno(file)) != 0 || fclose(file) != 0)
+	{
+		fprintf(stderr, "error writing to \"%s\": %m\n", path);
+		exit(1);
+	}
+}
+
+static void
+WriteCurrentVersion(const char *path, SavedBuffer *buffers, int num_buffers)
+{
+	SavefileWriter *writer;
+	int				fd;
+
+	writer = savefileOpenWrite(path, BENCH_DATABASE, BENCH_TABLESPACE, 1);
+	WriteBufferList(writer, buffers, num_buffers);
+	savefileCloseWrite(writer);
+
+	fd = open(path, O_RDONLY | PG_BINARY, 0);
+	if (fd < 0 || fsync(fd) != 0 || close(fd) != 0)
+	{
+		fprintf(stderr, "could not fsync file \"%s\": %m\n", path);
+		exit(1);
+	}
+}
+
+/* Read the save-file the way ReadBlocks() does, and return the number of blocks in it. */
+static int64
+ReadSavefile(const char *path)
+{
+	SavefileReader *reader;
+	char			type;
+	uint32			value;
+	int64			blocks = 0;
+
+	if (!savefileVerify(path))
+	{
+		fprintf(stderr, "save-file \"%s\" is corrupt\n", path);
+		exit(1);
+	}
+
+	reader = savefileOpenRead(path);
+
+	while (savefileReadRecord(reader, &type, &value))
+	{
+		switch (type)
+		{
+			case 'b':
+				++blocks;
+				break;
+			case 'N':
+				blocks += value;
+				break;
+			case 'r':
+			case 'f':
+			case 'u':
+				break;
+			default:
+				fprintf(stderr, "found unexpected record '%c' in \"%s\"\n", type, path);
+				exit(1);
+		}
+	}
+
+	savefileCloseRead(reader);
+
+	return blocks;
+}
+
+static double
+ElapsedMs(instr_time start)
+{
+	instr_time	now;
+
+	INSTR_TIME_SET_CURRENT(now);
+	INSTR_TIME_SUBTRACT(now, start);
+
+	return INSTR_TIME_GET_MILLISEC(now);
+}
+
+static void
+Report(const char *pattern, int num_buffers, const char *step, double bytes, double ms)
+{
+	char	bytes_per_entry[32] = "-";
+
+	if (bytes >= 0)
+		snprintf(bytes_per_entry, sizeof(bytes_per_entry), "%.4g", bytes / num_buffers);
+
+	printf("%-12s %9s  %-14s %12s %12.1f %14.2f\n",
+		   pattern, FormatCount(num_buffers), step, bytes_per_entry, ms,
+		   ms > 0 ? num_buffers / ms / 1000.0 : 0.0);
+	fflush(stdout);
+}
+
+static void
+BenchEncoding(const char *pattern, SavedBuffer *buffers, int num_buffers,
+			  const char *dir, int version)
+{
+	char		path[MAXPGPATH];
+	char		step[32];
+	instr_time	start;
+	struct stat	st;
+	double		ms;
+	int64		blocks;
+
+	snprintf(path, sizeof(path), "%s/bench_savefile.%d.tmp", dir, version);
+
+	INSTR_TIME_SET_CURRENT(start);
+	if (version == 1)
+		WriteVersion1(path, buffers, num_buffers);
+	else
+		WriteCurrentVersion(path, buffers, num_buffers);
+	ms = ElapsedMs(start);
+
+	if (stat(path, &st) != 0)
+	{
+		fprintf(stderr, "could not stat \"%s\": %m\n", path);
+		exit(1);
+	}
+
+	snprintf(step, sizeof(step), "v%d encode", version);
+	Report(pattern, num_buffers, step, st.st_size, ms);
+
+	INSTR_TIME_SET_CURRENT(start);
+	blocks = ReadSavefile(path);
+	ms = ElapsedMs(start);
+
+	if (blocks != num_buffers)
+	{
+		fprintf(stderr, "read back " INT64_FORMAT " blocks from \"%s\", instead of %d\n",
+				blocks, path, num_buffers);
+		exit(1);
+	}
+
+	snprintf(step, sizeof(step), "v%d decode", version);
+	Report(pattern, num_buffers, step, -1, ms);
+
+	unlink(path);
+}
+
+/*
+ * Add a second copy of every 7th block, with another usage count, and check
+ * that SortSavedBuffers() keeps one entry per block, with the higher usage
+ * count, and that the save-file reads back. Run on lists on both sides of the
+ * radix sort threshold.
+ */
+static void
+CheckDuplicates(const char *dir)
+{
+	const int	sizes[] = {1000, 256 * 1024};
+	char		path[MAXPGPATH];
+	int			s;
+
+	snprintf(path, sizeof(path), "%s/bench_savefile.dup.tmp", dir);
+
+	for (s = 0; s < lengthof(sizes); ++s)
+	{
+		int				num_buffers = sizes[s];
+		int				ndups = (num_buffers + 6) / 7;
+		SavedBuffer	   *buffers = malloc(sizeof(SavedBuffer) * (Size) (num_buffers + ndups));
+		uint8		   *usage = malloc(num_buffers);
+		int				n;
+		int				i;
+
+		if (buffers == NULL || usage == NULL)
+		{
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+
+		rng_state = UINT64CONST(0x2545F4914F6CDD1D);
+		GenerateClustered(buffers, num_buffers);
+
+		for (i = 0; i < num_buffers; ++i)
+			usage[i] = buffers[i].usage;
+
+		for (i = 0; i < ndups; ++i)
+		{
+			buffers[num_buffers + i] = buffers[i * 7];
+			buffers[num_buffers + i].usage = (buffers[i * 7].usage + 2) % SAVEFILE_USAGE_LEVELS;
+			usage[i * 7] = Max(usage[i * 7], buffers[num_buffers + i].usage);
+		}
+
+		Shuffle(buffers, num_buffers + ndups, UINT64CONST(0x9E3779B97F4A7C15));
+		NBuffers = num_buffers + ndups;
+		n = SortSavedBuffers(buffers, num_buffers + ndups);
+
+		if (n != num_buffers)
+		{
+			fprintf(stderr, "SortSavedBuffers() left %d of %d buffers, instead of %d\n",
+					n, num_buffers + ndups, num_buffers);
+			exit(1);
+		}
+
+		CheckSorted(buffers, n, "SortSavedBuffers() with duplicates");
+
+		/* GenerateClustered() emits the blocks in sort order. */
+		for (i = 0; i < n; ++i)
+			if (buffers[i].usage != usage[i])
+			{
+				fprintf(stderr, "SortSavedBuffers() kept usage count %d of block %d, instead of %d\n",
+						buffers[i].usage, i, usage[i]);
+				exit(1);
+			}
+
+		WriteCurrentVersion(path, buffers, n);
+		if (ReadSavefile(path) != n)
+		{
+			fprintf(stderr, "read back the wrong number of blocks from \"%s\"\n", path);
+			exit(1);
+		}
+
+		unlink(path);
+		free(usage);
+		free(buffers);
+	}
+}
+
+static void
+Bench(const Pattern *pattern, int num_buffers, const char *dir, bool with_qsort)
+{
+	SavedBuffer	   *buffers;
+	instr_time		start;
+	const uint64	seed = UINT64CONST(0x9E3779B97F4A7C15);
+
+	buffers = malloc(sizeof(SavedBuffer) * (Size) num_buffers);
+	if (buffers == NULL)
+	{
+		fprintf(stderr, "skipping %s buffers: out of memory\n", FormatCount(num_buffers));
+		return;
+	}
+
+	rng_state = seed;
+	pattern->generate(buffers, num_buffers);
+
+	Shuffle(buffers, num_buffers, seed);
+	INSTR_TIME_SET_CURRENT(start);
+	SortSavedBuffers(buffers, num_buffers);
+	Report(pattern->name, num_buffers, "radix sort", -1, ElapsedMs(start));
+	CheckSorted(buffers, num_buffers, "SortSavedBuffers()");
+
+	if (with_qsort)
+	{
+		Shuffle(buffers, num_buffers, seed);
+		INSTR_TIME_SET_CURRENT(start);
+		pg_qsort(buffers, num_buffers, sizeof(SavedBuffer), SavedBufferCmp);
+		Report(pattern->name, num_buffers, "qsort", -1, ElapsedMs(start));
+		CheckSorted(buffers, num_buffers, "pg_qsort()");
+	}
+
+	BenchEncoding(pattern->name, buffers, num_buffers, dir, 1);
+	BenchEncoding(pattern->name, buffers, num_buffers, dir, SAVEFILE_VERSION);
+
+	free(buffers);
+}
+
+static const char *
+FormatCount(int64 count)
+{
+	static char	buf[32];
+
+	if (count % (1024 * 1024) == 0)
+		snprintf(buf, sizeof(buf), INT64_FORMAT "M", count / (1024 * 1024));
+	else if (count % 1024 == 0)
+		snprintf(buf, sizeof(buf), INT64_FORMAT "K", count / 1024);
+	else
+		snprintf(buf, sizeof(buf), INT64_FORMAT, count);
+
+	return buf;
+}
+
+/* Parse a count like 16M or 512K; returns -1 if it's not one. */
+static int
+ParseCount(const char *str)
+{
+	char   *end;
+	long	count = strtol(str, &end, 10);
+
+	if (*end == 'K' || *end == 'k')
+	{
+		count *= 1024;
+		++end;
+	}
+	else if (*end == 'M' || *end == 'm')
+	{
+		count *= 1024 * 1024;
+		++end;
+	}
+
+	if (end == str || *end != '\0' || count <= 0 || count > INT_MAX)
+		return -1;
+
+	return (int) count;
+}
+
+static void
+PrintUsage(const char *progname)
+{
+	int		i;
+
+	printf("Usage: %s [-n COUNT[,COUNT...]] [-p PATTERN[,PATTERN...]] [-d DIR] [-Q]\n\n", progname);
+	printf("  -n  numbers of buffers to save, e.g. 1M,64M; default 1M,4M,16M,64M\n");
+	printf("  -p  fragmentation patterns; default all of them\n");
+	printf("  -d  directory to write the save-files in; default the current one\n");
+	printf("  -Q  don't time pg_qsort()\n\n");
+	printf("Patterns:\n");
+	for (i = 0; i < NUM_PATTERNS; ++i)
+		printf("  %-12s %s\n", patterns[i].name, patterns[i].description);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *counts_arg = "1M,4M,16M,64M";
+	const char *patterns_arg = NULL;
+	const char *dir = ".";
+	bool		with_qsort = true;
+	bool		wanted[NUM_PATTERNS];
+	int			counts[64];
+	int			ncounts = 0;
+	char	   *copy;
+	char	   *tok;
+	int			c;
+	int			i;
+	int			j;
+
+	while ((c = getopt(argc, argv, "n:p:d:Qh")) != -1)
+	{
+		switch (c)
+		{
+			case 'n':
+				counts_arg = optarg;
+				break;
+			case 'p':
+				patterns_arg = optarg;
+				break;
+			case 'd':
+				dir = optarg;
+				break;
+			case 'Q':
+				with_qsort = false;
+				break;
+			case 'h':
+				PrintUsage(argv[0]);
+				exit(0);
+			default:
+				PrintUsage(argv[0]);
+				exit(1);
+		}
+	}
+
+	copy = strdup(counts_arg);
+	for (tok = strtok(copy, ","); tok != NULL; tok = strtok(NULL, ","))
+	{
+		if (ncounts == lengthof(counts) || (counts[ncounts] = ParseCount(tok)) < 0)
+		{
+			fprintf(stderr, "invalid number of buffers \"%s\"\n", tok);
+			exit(1);
+		}
+		++ncounts;
+	}
+	free(copy);
+
+	for (i = 0; i < NUM_PATTERNS; ++i)
+		wanted[i] = (patterns_arg == NULL);
+
+	if (patterns_arg != NULL)
+	{
+		copy = strdup(patterns_arg);
+		for (tok = strtok(copy, ","); tok != NULL; tok = strtok(NULL, ","))
+		{
+			for (i = 0; i < NUM_PATTERNS; ++i)
+				if (strcmp(tok, patterns[i].name) == 0)
+					break;
+
+			if (i == NUM_PATTERNS)
+			{
+				fprintf(stderr, "unknown pattern \"%s\"\n", tok);
+				exit(1);
+			}
+
+			wanted[i] = true;
+		}
+		free(copy);
+	}
+
+	CheckDuplicates(dir);
+
+	printf("%-12s %9s  %-14s %12s %12s %14s\n",
+		   "pattern", "entries", "step", "bytes/entry", "ms", "Mentries/s");
+
+	for (i = 0; i < NUM_PATTERNS; ++i)
+	{
+		if (!wanted[i])
+			continue;
+
+		for (j = 0; j < ncounts; ++j)
+		{
+			NBuffers = counts[j];
+			Bench(&patterns[i], counts[j], dir, with_qsort);
+		}
+	}
+
+	return 0;
+}